@@ -0,0 +1,179 @@
+#ifndef __ALIGNMENT_CACHE_HPP__
+#define __ALIGNMENT_CACHE_HPP__
+
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "KSW2Aligner.hpp"
+#include "xxhash.h"
+
+namespace pufferfish {
+
+/**
+ * A small LRU cache of gap alignments, meant to be owned by a single
+ * worker thread.
+ *
+ * The reads of a multi-mapping fragment tend to align the same read gap
+ * against the same reference substring under many references (e.g. all
+ * of the isoforms that share an exon), so rather than re-running the DP
+ * we remember the score and CIGAR of the last `capacity` alignments,
+ * keyed on the (read codes, reference codes, aligner configuration)
+ * triple.  Entries are looked up by a 64-bit hash of the triple and then
+ * compared in full, so a hash collision can only cost a miss.
+ **/
+class AlignmentCache {
+public:
+  struct Entry {
+    int score;
+    // packed as by KSW2 (length << 4 | op)
+    std::vector<uint32_t> cigar;
+  };
+
+  // All of the nodes (and the hash buckets) are allocated here, so once
+  // their buffers have grown to the usual gap sizes, the cache doesn't
+  // allocate any more.
+  explicit AlignmentCache(size_t capacity = 1024) : nodes_(capacity) {
+    size_t numBuckets{1};
+    while (numBuckets < 2 * capacity) { numBuckets <<= 1; }
+    buckets_.assign(numBuckets, static_cast<uint32_t>(none_));
+    mask_ = numBuckets - 1;
+  }
+
+  // The cached alignment of `read` against `ref`, or nullptr if there is none.
+  const Entry* find(const std::vector<uint8_t>& read,
+                    const std::vector<uint8_t>& ref,
+                    const ksw2pp::KSW2Config& config) {
+    auto cfg = configKey_(config);
+    uint32_t i = lookup_(hash_(read, ref, cfg));
+    if (i == none_ or !nodes_[i].matches(read, ref, cfg)) {
+      ++misses_;
+      return nullptr;
+    }
+    // move to the front of the recency list
+    unlinkLru_(i);
+    pushFront_(i);
+    ++hits_;
+    return &(nodes_[i].entry);
+  }
+
+  void insert(const std::vector<uint8_t>& read,
+              const std::vector<uint8_t>& ref,
+              const ksw2pp::KSW2Config& config,
+              int score, const uint32_t* cigar, size_t nCigar) {
+    if (nodes_.empty()) { return; }
+    auto cfg = configKey_(config);
+    auto h = hash_(read, ref, cfg);
+    uint32_t i = lookup_(h);
+    if (i != none_) {
+      // same hash, either the same key or a collision; keep the newest one
+      unlinkLru_(i);
+    } else {
+      if (used_ < nodes_.size()) {
+        i = static_cast<uint32_t>(used_++);
+      } else {
+        // evict the least recently used entry, and recycle its buffers
+        i = tail_;
+        unlinkLru_(i);
+        unlinkHash_(i);
+      }
+      auto& chain = buckets_[h & mask_];
+      nodes_[i].chain = chain;
+      chain = i;
+    }
+    fill_(nodes_[i], h, read, ref, cfg, score, cigar, nCigar);
+    pushFront_(i);
+  }
+
+  inline uint64_t hits() const { return hits_; }
+  inline uint64_t misses() const { return misses_; }
+
+private:
+  using ConfigKey = std::array<int, 5>;
+  static constexpr uint32_t none_ = std::numeric_limits<uint32_t>::max();
+
+  struct Node {
+    uint64_t hash;
+    std::vector<uint8_t> read;
+    std::vector<uint8_t> ref;
+    ConfigKey config;
+    Entry entry;
+    // neighbours in the recency list, and the next node of the hash bucket
+    uint32_t prev{none_};
+    uint32_t next{none_};
+    uint32_t chain{none_};
+
+    bool matches(const std::vector<uint8_t>& r, const std::vector<uint8_t>& t,
+                 const ConfigKey& c) const {
+      return config == c and read == r and ref == t;
+    }
+  };
+
+  inline uint32_t lookup_(uint64_t h) const {
+    uint32_t i = buckets_[h & mask_];
+    while (i != none_ and nodes_[i].hash != h) { i = nodes_[i].chain; }
+    return i;
+  }
+
+  inline void unlinkHash_(uint32_t i) {
+    uint32_t* link = &buckets_[nodes_[i].hash & mask_];
+    while (*link != i) { link = &nodes_[*link].chain; }
+    *link = nodes_[i].chain;
+  }
+
+  inline void unlinkLru_(uint32_t i) {
+    auto& n = nodes_[i];
+    if (n.prev != none_) { nodes_[n.prev].next = n.next; } else { head_ = n.next; }
+    if (n.next != none_) { nodes_[n.next].prev = n.prev; } else { tail_ = n.prev; }
+    n.prev = n.next = none_;
+  }
+
+  inline void pushFront_(uint32_t i) {
+    nodes_[i].next = head_;
+    if (head_ != none_) { nodes_[head_].prev = i; } else { tail_ = i; }
+    head_ = i;
+  }
+
+  static inline ConfigKey configKey_(const ksw2pp::KSW2Config& config) {
+    return {{config.gapo, config.gape, config.bandwidth, config.flag,
+             static_cast<int>(config.atype)}};
+  }
+
+  static inline uint64_t hash_(const std::vector<uint8_t>& read,
+                               const std::vector<uint8_t>& ref,
+                               const ConfigKey& cfg) {
+    auto h = XXH64(cfg.data(), sizeof(int) * cfg.size(), read.size());
+    h = XXH64(ref.data(), ref.size(), h);
+    return XXH64(read.data(), read.size(), h);
+  }
+
+  static inline void fill_(Node& n, uint64_t h,
+                           const std::vector<uint8_t>& read,
+                           const std::vector<uint8_t>& ref,
+                           const ConfigKey& cfg, int score,
+                           const uint32_t* cigar, size_t nCigar) {
+    n.hash = h;
+    n.read.assign(read.begin(), read.end());
+    n.ref.assign(ref.begin(), ref.end());
+    n.config = cfg;
+    n.entry.score = score;
+    n.entry.cigar.assign(cigar, cigar + nCigar);
+  }
+
+  uint64_t hits_{0};
+  uint64_t misses_{0};
+  std::vector<Node> nodes_;
+  // the number of nodes that have been used so far
+  size_t used_{0};
+  // the most and least recently used nodes
+  uint32_t head_{none_};
+  uint32_t tail_{none_};
+  // the first node of each hash chain
+  std::vector<uint32_t> buckets_;
+  uint64_t mask_{0};
+};
+
+} // namespace pufferfish
+
+#endif // __ALIGNMENT_CACHE_HPP__
@@ -0,0 +1,395 @@
+#ifndef BAM_WRITER_HPP
+#define BAM_WRITER_HPP
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "PairedAlignmentFormatter.hpp"
+#include "SAMWriter.hpp"
+#include "Util.hpp"
+
+/**
+ * BAM encoding of the records written by SAMWriter.  Records are built in
+ * binary form straight from the QuasiAlignments (reference ids, 4-bit
+ * packed sequence, binary CIGAR) into the same output buffers as the SAM
+ * text; the BGZF compression is done by the OutputWriter.  Each writer
+ * here produces exactly the records its SAMWriter counterpart would.
+ **/
+namespace bam {
+
+// BAM CIGAR operations; M, I and D have the codes of util::PackedCigar
+constexpr uint32_t CIGAR_M = 0;
+constexpr uint32_t CIGAR_S = 4;
+
+template <typename T>
+inline void put(fmt::MemoryWriter& out, T v) {
+  // BAM is little-endian, like the hosts we run on
+  auto p = reinterpret_cast<const char*>(&v);
+  out.buffer().append(p, p + sizeof(T));
+}
+
+// the 4-bit code of a base ("=ACMGRSVTWYHKDBN")
+inline uint8_t baseCode(char c) {
+  switch (c) {
+    case 'A': case 'a': return 1;
+    case 'C': case 'c': return 2;
+    case 'G': case 'g': return 4;
+    case 'T': case 't': return 8;
+    default: return 15;
+  }
+}
+
+// the smallest bin containing [beg, end), as in the SAM specification
+inline uint16_t reg2bin(int32_t beg, int32_t end) {
+  --end;
+  if (beg >> 14 == end >> 14) return ((1 << 15) - 1) / 7 + (beg >> 14);
+  if (beg >> 17 == end >> 17) return ((1 << 12) - 1) / 7 + (beg >> 17);
+  if (beg >> 20 == end >> 20) return ((1 << 9) - 1) / 7 + (beg >> 20);
+  if (beg >> 23 == end >> 23) return ((1 << 6) - 1) / 7 + (beg >> 23);
+  if (beg >> 26 == end >> 26) return ((1 << 3) - 1) / 7 + (beg >> 26);
+  return 0;
+}
+
+// ops holds cigar with adjacent operations of the same kind merged and
+// empty ones dropped (as writeCigar writes it)
+inline void normalizeCigar(const util::PackedCigar& cigar, std::vector<uint32_t>& ops) {
+  ops.clear();
+  for (auto op : cigar) {
+    if ((op >> 4) == 0) { continue; }
+    if (!ops.empty() and (ops.back() & 0xf) == (op & 0xf)) {
+      ops.back() += op & ~0xfu;
+    } else {
+      ops.push_back(op);
+    }
+  }
+}
+
+// The CIGAR ops for the mapping of a read at pos, soft-clipping what hangs
+// over either end of the reference; adjusts pos like adjustOverhang does.
+inline void overhangCigar(int32_t& pos, uint32_t readLen, uint32_t txpLen,
+                          std::vector<uint32_t>& ops) {
+  ops.clear();
+  int32_t readLenS = static_cast<int32_t>(readLen);
+  int32_t txpLenS = static_cast<int32_t>(txpLen);
+  if (pos + readLenS < 0) {
+    ops.push_back((readLen << 4) | CIGAR_S);
+    pos = 0;
+  } else if (pos < 0) {
+    int32_t matchLen = readLenS + pos;
+    int32_t clipLen = readLenS - matchLen;
+    if (clipLen > 0) { ops.push_back((clipLen << 4) | CIGAR_S); }
+    if (matchLen > 0) { ops.push_back((matchLen << 4) | CIGAR_M); }
+    pos = 0;
+  } else if (pos > txpLenS) {
+    ops.push_back((readLen << 4) | CIGAR_S);
+  } else if (pos + readLenS > txpLenS) {
+    int32_t matchLen = txpLenS - pos;
+    int32_t clipLen = readLenS - matchLen;
+    if (matchLen > 0) { ops.push_back((matchLen << 4) | CIGAR_M); }
+    if (clipLen > 0) { ops.push_back((clipLen << 4) | CIGAR_S); }
+  } else {
+    ops.push_back((readLen << 4) | CIGAR_M);
+  }
+}
+
+// number of reference bases covered by ops
+inline int32_t refSpan(const std::vector<uint32_t>& ops) {
+  int32_t span{0};
+  for (auto op : ops) {
+    uint32_t code = op & 0xf;
+    // M, D, N, =, X
+    if (code == 0 or code == 2 or code == 3 or code == 7 or code == 8) { span += op >> 4; }
+  }
+  return span;
+}
+
+// Append one BAM alignment record (without qualities, and with an NH tag)
+// to out.
+inline void writeRecord(fmt::MemoryWriter& out, stx::string_view name,
+                        uint16_t flag, int32_t refID, int32_t pos, uint8_t mapq,
+                        const std::vector<uint32_t>& ops, int32_t nextRefID,
+                        int32_t nextPos, int32_t tlen, stx::string_view seq,
+                        int32_t numHits) {
+  uint32_t nameLen = static_cast<uint32_t>(name.length()) + 1;
+  int32_t seqLen = static_cast<int32_t>(seq.length());
+  uint16_t bin = (refID < 0) ? reg2bin(-1, 0)
+    : reg2bin(pos, pos + std::max(refSpan(ops), static_cast<int32_t>(1)));
+  int32_t blockSize = 32 + nameLen + 4 * ops.size() + (seqLen + 1) / 2 + seqLen + 7;
+  put(out, blockSize);
+  put(out, refID);
+  put(out, pos);
+  put(out, static_cast<uint8_t>(nameLen));
+  put(out, mapq);
+  put(out, bin);
+  put(out, static_cast<uint16_t>(ops.size()));
+  put(out, flag);
+  put(out, seqLen);
+  put(out, nextRefID);
+  put(out, nextPos);
+  put(out, tlen);
+  out.buffer().append(name.data(), name.data() + name.length());
+  put(out, static_cast<uint8_t>(0));
+  for (auto op : ops) { put(out, op); }
+  for (int32_t i = 0; i < seqLen; i += 2) {
+    uint8_t b = baseCode(seq[i]) << 4;
+    if (i + 1 < seqLen) { b |= baseCode(seq[i + 1]); }
+    put(out, b);
+  }
+  for (int32_t i = 0; i < seqLen; ++i) { put(out, static_cast<uint8_t>(0xff)); }
+  out.buffer().append("NHi", "NHi" + 3);
+  put(out, numHits);
+}
+
+template <typename T>
+inline T get(const char* p) {
+  T v;
+  std::memcpy(&v, p, sizeof(T));
+  return v;
+}
+
+// Append the SAM line of the BAM record rec (of len bytes, starting with
+// its block size), as written by writeRecord, to out; used to write
+// sorted SAM, whose records are kept in binary form until the merge.
+inline void writeSAMRecord(const char* rec, size_t len,
+                           const std::vector<std::string>& refNames,
+                           fmt::MemoryWriter& out) {
+  int32_t refID = get<int32_t>(rec + 4);
+  int32_t pos = get<int32_t>(rec + 8);
+  uint8_t nameLen = get<uint8_t>(rec + 12);
+  uint8_t mapq = get<uint8_t>(rec + 13);
+  uint16_t nCigar = get<uint16_t>(rec + 16);
+  uint16_t flag = get<uint16_t>(rec + 18);
+  int32_t seqLen = get<int32_t>(rec + 20);
+  int32_t nextRefID = get<int32_t>(rec + 24);
+  int32_t nextPos = get<int32_t>(rec + 28);
+  int32_t tlen = get<int32_t>(rec + 32);
+  const char* p = rec + 36;
+
+  out << p << '\t' << flag << '\t';
+  p += nameLen;
+  if (refID < 0) { out << '*'; } else { out << refNames[refID]; }
+  out << '\t' << pos + 1 << '\t' << static_cast<int>(mapq) << '\t';
+  if (nCigar == 0) { out << '*'; }
+  for (uint16_t i = 0; i < nCigar; ++i, p += 4) {
+    uint32_t op = get<uint32_t>(p);
+    out << (op >> 4) << "MIDNSHP=X"[op & 0xf];
+  }
+  out << '\t';
+  if (nextRefID == refID) {
+    out << '=';
+  } else if (nextRefID < 0) {
+    out << '*';
+  } else {
+    out << refNames[nextRefID];
+  }
+  out << '\t' << nextPos + 1 << '\t' << tlen << '\t';
+  for (int32_t i = 0; i < seqLen; ++i) {
+    uint8_t b = static_cast<uint8_t>(p[i >> 1]);
+    out << "=ACMGRSVTWYHKDBN"[(i & 1) ? (b & 0xf) : (b >> 4)];
+  }
+  if (seqLen == 0) { out << '*'; }
+  p += (seqLen + 1) / 2;
+  // qualities are never stored
+  out << "\t*";
+  p += seqLen;
+  // the integer tags (all that writeRecord writes)
+  const char* end = rec + len;
+  while (p + 3 <= end) {
+    out << '\t' << p[0] << p[1] << ":i:";
+    char type = p[2];
+    p += 3;
+    switch (type) {
+      case 'c': out << static_cast<int>(get<int8_t>(p)); p += 1; break;
+      case 'C': out << static_cast<int>(get<uint8_t>(p)); p += 1; break;
+      case 's': out << get<int16_t>(p); p += 2; break;
+      case 'S': out << get<uint16_t>(p); p += 2; break;
+      case 'i': out << get<int32_t>(p); p += 4; break;
+      default: out << get<uint32_t>(p); p += 4; break;
+    }
+  }
+  out << '\n';
+}
+
+} // namespace bam
+
+template <typename IndexT>
+inline void writeBAMHeader(IndexT& pfi, fmt::MemoryWriter& out, bool sorted = false) {
+  fmt::MemoryWriter text;
+  writeSAMHeader(pfi, text, sorted);
+  auto& txpNames = pfi.getRefNames();
+  auto& txpLens = pfi.getRefLengths();
+  out.buffer().append("BAM\1", "BAM\1" + 4);
+  bam::put(out, static_cast<int32_t>(text.size()));
+  out.buffer().append(text.data(), text.data() + text.size());
+  bam::put(out, static_cast<int32_t>(txpNames.size()));
+  for (size_t i = 0; i < txpNames.size(); ++i) {
+    bam::put(out, static_cast<int32_t>(txpNames[i].length() + 1));
+    out.buffer().append(txpNames[i].c_str(), txpNames[i].c_str() + txpNames[i].length() + 1);
+    bam::put(out, static_cast<int32_t>(txpLens[i]));
+  }
+}
+
+template <typename ReadT, typename IndexT>
+inline uint32_t writeUnmappedAlignmentsToBAMSingle(
+    ReadT& r, PairedAlignmentFormatter<IndexT>& formatter,
+    std::vector<util::QuasiAlignment>& jointHits, fmt::MemoryWriter& out) {
+  (void) jointHits;
+  formatter.cigarOps1.clear();
+  bam::writeRecord(out, trimReadName(r.name), 4, -1, -1, 255, formatter.cigarOps1, -1, -1, 0, r.seq, 0);
+  return 0;
+}
+
+template <typename ReadPairT, typename IndexT>
+inline uint32_t writeUnmappedAlignmentsToBAM(
+    ReadPairT& r, PairedAlignmentFormatter<IndexT>& formatter,
+    std::vector<util::QuasiAlignment>& jointHits, fmt::MemoryWriter& out) {
+  (void) jointHits;
+  formatter.cigarOps1.clear();
+  bam::writeRecord(out, trimReadName(r.first.name), 77, -1, -1, 255, formatter.cigarOps1, -1, -1, 0, r.first.seq, 0);
+  bam::writeRecord(out, trimReadName(r.second.name), 141, -1, -1, 255, formatter.cigarOps1, -1, -1, 0, r.second.seq, 0);
+  return 0;
+}
+
+template <typename ReadT, typename IndexT>
+inline uint32_t writeAlignmentsToBAMSingle(
+    ReadT& r, PairedAlignmentFormatter<IndexT>& formatter,
+    std::vector<util::QuasiAlignment>& jointHits, fmt::MemoryWriter& out, bool justMappings) {
+  auto& read1Temp = formatter.read1Temp;
+  auto& ops1 = formatter.cigarOps1;
+  auto readName = trimReadName(r.name);
+  int32_t numHits = static_cast<int32_t>(jointHits.size());
+  uint16_t flags1;
+  uint32_t alnCtr{0};
+  bool haveRev1{false};
+  for (auto& qa : jointHits) {
+    uint32_t txpLen = formatter.index->refLength(qa.tid);
+    getSamFlags(qa, flags1);
+    if (alnCtr != 0) { flags1 |= 0x100; }
+    bam::overhangCigar(qa.pos, qa.readLen, txpLen, ops1);
+    if (!justMappings) { bam::normalizeCigar(qa.cigar, ops1); }
+
+    stx::string_view readSeq1 = r.seq;
+    if (!qa.fwd) {
+      if (!haveRev1) {
+        util::reverseRead(readSeq1, read1Temp);
+        haveRev1 = true;
+      }
+      readSeq1 = read1Temp;
+    }
+    int32_t minPos = qa.pos;
+    if (minPos + qa.fragLen > txpLen) { qa.fragLen = txpLen - minPos; }
+    const int32_t fragLen = static_cast<int32_t>(qa.fragLen);
+    int32_t tid = static_cast<int32_t>(qa.tid);
+    bam::writeRecord(out, readName, flags1, tid, qa.pos, 1, ops1, tid, -1, fragLen, readSeq1, numHits);
+    ++alnCtr;
+  }
+  return 0;
+}
+
+template <typename ReadPairT, typename IndexT>
+inline uint32_t writeAlignmentsToBAM(
+    ReadPairT& r, PairedAlignmentFormatter<IndexT>& formatter,
+    std::vector<util::QuasiAlignment>& jointHits, fmt::MemoryWriter& out,
+    bool writeOrphans, bool justMappings) {
+  auto& read1Temp = formatter.read1Temp;
+  auto& read2Temp = formatter.read2Temp;
+  auto& ops1 = formatter.cigarOps1;
+  auto& ops2 = formatter.cigarOps2;
+  auto readName = trimReadName(r.first.name);
+  auto mateName = trimReadName(r.second.name);
+  int32_t numHits = static_cast<int32_t>(jointHits.size());
+  uint16_t flags1, flags2;
+  uint32_t alnCtr{0};
+  bool haveRev1{false};
+  bool haveRev2{false};
+
+  for (auto& qa : jointHits) {
+    uint32_t txpLen = formatter.index->refLength(qa.tid);
+    int32_t tid = static_cast<int32_t>(qa.tid);
+    if (!qa.isPaired and !writeOrphans) {
+      ++alnCtr;
+      continue;
+    }
+    getSamFlags(qa, true, flags1, flags2);
+    if (alnCtr != 0) {
+      flags1 |= 0x100;
+      flags2 |= 0x100;
+    }
+    // mirrors adjustOverhang(qa, ...)
+    if (qa.isPaired) {
+      bam::overhangCigar(qa.pos, qa.readLen, txpLen, ops1);
+      bam::overhangCigar(qa.matePos, qa.mateLen, txpLen, ops2);
+    } else if (qa.mateStatus == util::MateStatus::PAIRED_END_LEFT) {
+      bam::overhangCigar(qa.pos, qa.readLen, txpLen, ops1);
+    } else {
+      bam::overhangCigar(qa.pos, qa.readLen, txpLen, ops2);
+    }
+
+    if (qa.isPaired) {
+      if (!justMappings) {
+        bam::normalizeCigar(qa.cigar, ops1);
+        bam::normalizeCigar(qa.mateCigar, ops2);
+      }
+      stx::string_view readSeq1 = r.first.seq;
+      if (!qa.fwd) {
+        if (!haveRev1) {
+          util::reverseRead(readSeq1, read1Temp);
+          haveRev1 = true;
+        }
+        readSeq1 = read1Temp;
+      }
+      stx::string_view readSeq2 = r.second.seq;
+      if (!qa.mateIsFwd) {
+        if (!haveRev2) {
+          util::reverseRead(readSeq2, read2Temp);
+          haveRev2 = true;
+        }
+        readSeq2 = read2Temp;
+      }
+      const bool read1First{qa.pos < qa.matePos};
+      const int32_t minPos = read1First ? qa.pos : qa.matePos;
+      if (minPos + qa.fragLen > txpLen) { qa.fragLen = txpLen - minPos; }
+      const int32_t fragLen = static_cast<int32_t>(qa.fragLen);
+
+      bam::writeRecord(out, readName, flags1, tid, qa.pos, 1, ops1, tid, qa.matePos,
+                       read1First ? fragLen : -fragLen, readSeq1, numHits);
+      bam::writeRecord(out, mateName, flags2, tid, qa.matePos, 1, ops2, tid, qa.pos,
+                       read1First ? -fragLen : fragLen, readSeq2, numHits);
+    } else {
+      // orphan: the mapped end as a full-length match, and its unmapped mate
+      bool isLeft = qa.mateStatus == util::MateStatus::PAIRED_END_LEFT;
+      stx::string_view alignedName = isLeft ? readName : mateName;
+      stx::string_view unalignedName = isLeft ? mateName : readName;
+      stx::string_view readSeq = isLeft ? r.first.seq : r.second.seq;
+      stx::string_view unalignedSeq = isLeft ? r.second.seq : r.first.seq;
+      bool& haveRev = isLeft ? haveRev1 : haveRev2;
+      std::string& readTemp = isLeft ? read1Temp : read2Temp;
+      uint16_t flags = isLeft ? flags1 : flags2;
+      if (!qa.fwd) {
+        if (!haveRev) {
+          util::reverseRead(readSeq, readTemp);
+          haveRev = true;
+        }
+        readSeq = readTemp;
+      }
+      const bool read1First{qa.pos < qa.matePos};
+      const int32_t minPos = read1First ? qa.pos : qa.matePos;
+      if (minPos + qa.fragLen > txpLen) { qa.fragLen = txpLen - minPos; }
+      const int32_t fragLen = static_cast<int32_t>(qa.fragLen);
+
+      ops1.clear();
+      ops1.push_back((static_cast<uint32_t>(r.first.seq.length()) << 4) | bam::CIGAR_M);
+      ops2.clear();
+      bam::writeRecord(out, alignedName, flags, tid, qa.pos, 1, ops1, tid, qa.matePos,
+                       read1First ? fragLen : -fragLen, readSeq, numHits);
+      bam::writeRecord(out, unalignedName, flags2, tid, qa.pos, 0, ops2, tid, qa.pos,
+                       read1First ? -fragLen : fragLen, unalignedSeq, numHits);
+    }
+    ++alnCtr;
+  }
+  return 0;
+}
+
+#endif // BAM_WRITER_HPP
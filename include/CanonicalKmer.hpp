@@ -63,6 +63,13 @@ public:
     rc_ = fw_.getRC();
   }
 
+  // Set both strands directly (e.g. from words extracted in bulk) without
+  // recomputing the reverse complement.
+  inline void fromWords(uint64_t fw, uint64_t rc) {
+    fw_.word__(0) = fw;
+    rc_.word__(0) = rc;
+  }
+
   inline void swap(){
     std::swap(fw_, rc_);
     //my_mer tmp = fw_ ;
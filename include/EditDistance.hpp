@@ -0,0 +1,150 @@
+#ifndef __EDIT_DISTANCE_HPP__
+#define __EDIT_DISTANCE_HPP__
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+#include "EncodedRead.hpp"
+
+namespace pufferfish {
+
+/**
+ * Global (Levenshtein) edit distance between two sequences of EncodedRead
+ * codes, using Myers' bit-vector algorithm (in Hyyro's block formulation):
+ * a column of the DP matrix is kept as two bit vectors of vertical deltas,
+ * and advancing to the next target base costs a handful of word operations
+ * per 64 query bases.
+ *
+ * This is meant as a cheap filter in front of an affine-gap aligner: the
+ * edit distance bounds the score any alignment of the pair can reach (see
+ * maxScore()), and the computation stops as soon as the distance is known
+ * to exceed the limit.  An N does not match anything, not even another N
+ * (just like EncodedRead::countMismatches).
+ *
+ * Buffers are kept across calls, so one instance per worker does not
+ * allocate in steady state.
+ **/
+class MyersEditDistance {
+public:
+  /**
+   * The scores are those of the affine-gap aligner being filtered (match
+   * and mismatch scores, and the per-base gap extension cost), and are
+   * only used by maxDistance() and maxScore().
+   **/
+  MyersEditDistance(int match = 2, int mismatch = -4, int gapExtend = 2)
+    : match_(match) {
+    // Any global alignment of a query and a target of lengths q and t with
+    // M matches, X mismatches, Nn pairs involving an N and G gap bases has
+    // 2(M + X + Nn) + G = q + t, so its score is at most
+    //   match * (q + t) / 2 - (match - mismatch) X - match Nn - (match / 2 + gapExtend) G,
+    // and since the edit distance d is at most X + Nn + G, at most
+    //   (match * (q + t) - editCost2_ * d) / 2.
+    editCost2_ = std::min(2 * match, std::min(2 * (match - mismatch), match + 2 * gapExtend));
+  }
+
+  /**
+   * The largest edit distance at which a query and target of these lengths
+   * may still align with a score of at least minScore, or -1 if they can't
+   * reach it at all.
+   **/
+  int maxDistance(int queryLength, int targetLength, int minScore) const {
+    int64_t slack = static_cast<int64_t>(match_) * (queryLength + targetLength) - 2 * static_cast<int64_t>(minScore);
+    if (slack < 0) { return -1; }
+    if (editCost2_ <= 0) { return queryLength + targetLength; }
+    return static_cast<int>(std::min(slack / editCost2_, static_cast<int64_t>(queryLength + targetLength)));
+  }
+
+  // An upper bound on the score of an alignment at edit distance dist.
+  int maxScore(int queryLength, int targetLength, int dist) const {
+    int64_t s2 = static_cast<int64_t>(match_) * (queryLength + targetLength) - static_cast<int64_t>(editCost2_) * dist;
+    return static_cast<int>(s2 >= 0 ? s2 / 2 : -((-s2 + 1) / 2));
+  }
+
+  /**
+   * The edit distance between query and target, or -1 if it is larger than
+   * maxDist (pass a negative maxDist for no limit).
+   **/
+  int operator()(const uint8_t* query, int queryLength,
+                 const uint8_t* target, int targetLength,
+                 int maxDist = -1) {
+    if (maxDist < 0) { maxDist = queryLength + targetLength; }
+    if (std::abs(queryLength - targetLength) > maxDist) { return -1; }
+    if (queryLength == 0 or targetLength == 0) {
+      return queryLength + targetLength;
+    }
+
+    int numBlocks = (queryLength + wordSize - 1) / wordSize;
+    buildPeq_(query, queryLength, numBlocks);
+    pv_.assign(numBlocks, ~Word(0));
+    mv_.assign(numBlocks, Word(0));
+
+    // we track the last row of the matrix, i.e. the distance between the
+    // whole query and the target prefix seen so far
+    Word lastRowMask = Word(1) << ((queryLength - 1) % wordSize);
+    int score = queryLength;
+    for (int j = 0; j < targetLength; ++j) {
+      const Word* eqs = peq_.data() + target[j] * numBlocks;
+      // the first row of the matrix (the empty query) increases by one per column
+      int hin = 1;
+      for (int b = 0; b < numBlocks; ++b) {
+        Word mask = (b == numBlocks - 1) ? lastRowMask : highBit;
+        hin = advance_(pv_[b], mv_[b], eqs[b], hin, mask);
+      }
+      score += hin;
+      // a row of the matrix changes by at most one per column, so the
+      // remaining target bases can't bring the distance back under maxDist
+      if (score - (targetLength - 1 - j) > maxDist) { return -1; }
+    }
+    return score <= maxDist ? score : -1;
+  }
+
+private:
+  using Word = uint64_t;
+  static constexpr int wordSize = 64;
+  static constexpr Word highBit = Word(1) << (wordSize - 1);
+
+  // peq_[c * numBlocks + b] has bit i set iff query[b * wordSize + i] == c;
+  // codes >= invalidCode (N) are left empty so that they never match
+  void buildPeq_(const uint8_t* query, int queryLength, int numBlocks) {
+    peq_.assign((EncodedRead::invalidCode + 1) * numBlocks, Word(0));
+    for (int i = 0; i < queryLength; ++i) {
+      if (query[i] < EncodedRead::invalidCode) {
+        peq_[query[i] * numBlocks + i / wordSize] |= Word(1) << (i % wordSize);
+      }
+    }
+  }
+
+  /**
+   * Advance one block of the current column by one target base, given the
+   * horizontal delta (-1, 0 or +1) entering it from above.  Returns the
+   * horizontal delta at the row selected by outMask.
+   **/
+  static inline int advance_(Word& pv, Word& mv, Word eq, int hin, Word outMask) {
+    Word hinIsNeg = static_cast<Word>(hin < 0);
+    Word xv = eq | mv;
+    eq |= hinIsNeg;
+    Word xh = (((eq & pv) + pv) ^ pv) | eq;
+    Word ph = mv | ~(xh | pv);
+    Word mh = pv & xh;
+    int hout = static_cast<int>((ph & outMask) != 0) - static_cast<int>((mh & outMask) != 0);
+    ph <<= 1;
+    mh <<= 1;
+    mh |= hinIsNeg;
+    ph |= static_cast<Word>(hin > 0);
+    pv = mh | ~(xv | ph);
+    mv = ph & xv;
+    return hout;
+  }
+
+  int match_;
+  int editCost2_;
+  std::vector<Word> peq_;
+  std::vector<Word> pv_;
+  std::vector<Word> mv_;
+};
+
+} // namespace pufferfish
+
+#endif // __EDIT_DISTANCE_HPP__
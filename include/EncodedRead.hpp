@@ -0,0 +1,151 @@
+#ifndef __ENCODED_READ_HPP__
+#define __ENCODED_READ_HPP__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "Kmer.hpp"
+#include "string_view.hpp"
+
+namespace pufferfish {
+
+/**
+ * A read that has been encoded once, right after parsing, so that the
+ * k-mer iterator, uni-MEM expansion and the aligner don't each have to
+ * re-derive nucleotide codes (and reverse complements) from the characters.
+ *
+ * Both strands are stored with one code per base using the same alphabet
+ * as KSW2 (A=0, C=1, G=2, T=3, anything else=4), so slices of either
+ * array can be handed to the uint8_t overloads of ksw2pp::KSW2Aligner
+ * directly.  rc()[i] is the complement of the base at position
+ * length() - 1 - i of the forward read.  The N mask has one bit per
+ * (forward) position that does not hold a valid nucleotide.
+ *
+ * The object keeps its buffers between calls to encode(), so a single
+ * instance per worker thread does not allocate once it has seen the
+ * longest read.
+ **/
+class EncodedRead {
+public:
+  static constexpr uint8_t invalidCode = 4;
+
+  EncodedRead() = default;
+  explicit EncodedRead(stx::string_view s) { encode(s); }
+
+  void encode(stx::string_view s) {
+    namespace kmers = combinelib::kmers;
+    seq_ = s;
+    len_ = s.length();
+    numN_ = 0;
+    fw_.resize(len_);
+    rc_.resize(len_);
+    nmask_.assign((len_ + 63) / 64, 0);
+    for (size_t i = 0; i < len_; ++i) {
+      int c = kmers::codeForChar(s[i]);
+      uint8_t code = (c < 0) ? invalidCode : static_cast<uint8_t>(c);
+      fw_[i] = code;
+      if (code == invalidCode) {
+        rc_[len_ - 1 - i] = invalidCode;
+        nmask_[i >> 6] |= (1ULL << (i & 0x3f));
+        ++numN_;
+      } else {
+        rc_[len_ - 1 - i] = 0x3 - code;
+      }
+    }
+  }
+
+  inline size_t length() const { return len_; }
+  inline bool empty() const { return len_ == 0; }
+  // The character sequence this object was encoded from.
+  inline stx::string_view seq() const { return seq_; }
+
+  inline const uint8_t* fw() const { return fw_.data(); }
+  inline const uint8_t* rc() const { return rc_.data(); }
+
+  inline uint8_t fwCode(size_t i) const { return fw_[i]; }
+  // Code of the complement of the base at forward position i.
+  inline uint8_t rcCodeAt(size_t i) const { return rc_[len_ - 1 - i]; }
+
+  inline bool isN(size_t i) const { return (nmask_[i >> 6] >> (i & 0x3f)) & 0x1; }
+  inline bool hasN() const { return numN_ > 0; }
+  inline size_t numN() const { return numN_; }
+  inline const std::vector<uint64_t>& nMask() const { return nmask_; }
+
+  /**
+   * Fill `out` with the codes of the forward read interval [rstart, rend)
+   * if isFw is true, or with the reverse complement of that interval
+   * otherwise.  This is the encoded counterpart of taking a substring of
+   * the read (and reverse complementing it).
+   **/
+  inline void extract(uint32_t rstart, uint32_t rend, bool isFw,
+                      std::vector<uint8_t>& out) const {
+    if (rend <= rstart) {
+      out.clear();
+      return;
+    }
+    if (isFw) {
+      out.assign(fw_.begin() + rstart, fw_.begin() + rend);
+    } else {
+      out.assign(rc_.begin() + (len_ - rend), rc_.begin() + (len_ - rstart));
+    }
+  }
+
+  // Encode a character sequence (e.g. reference) with the same alphabet.
+  static inline void encodeSeq(const std::string& s, std::vector<uint8_t>& out) {
+    namespace kmers = combinelib::kmers;
+    out.resize(s.length());
+    for (size_t i = 0; i < s.length(); ++i) {
+      int c = kmers::codeForChar(s[i]);
+      out[i] = (c < 0) ? invalidCode : static_cast<uint8_t>(c);
+    }
+  }
+
+  // Decode a run of codes back to characters (for debugging output).
+  static inline std::string decode(const uint8_t* codes, size_t len) {
+    std::string s(len, 'N');
+    for (size_t i = 0; i < len; ++i) {
+      s[i] = "ACGTN"[codes[i] < 4 ? codes[i] : 4];
+    }
+    return s;
+  }
+
+  /**
+   * The number of positions at which two equally long runs of codes
+   * differ; an N (on either side) never matches.  Compares 16 bases per
+   * instruction when SSE2 is available.
+   **/
+  static inline size_t countMismatches(const uint8_t* a, const uint8_t* b, size_t len) {
+    size_t numMatch{0};
+    size_t i{0};
+#if defined(__SSE2__)
+    const __m128i valid = _mm_set1_epi8(invalidCode);
+    for (; i + 16 <= len; i += 16) {
+      __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+      __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+      __m128i eq = _mm_and_si128(_mm_cmpeq_epi8(x, y), _mm_cmplt_epi8(x, valid));
+      numMatch += __builtin_popcount(static_cast<uint32_t>(_mm_movemask_epi8(eq)));
+    }
+#endif
+    for (; i < len; ++i) {
+      numMatch += (a[i] == b[i] and a[i] < invalidCode);
+    }
+    return len - numMatch;
+  }
+
+private:
+  stx::string_view seq_;
+  size_t len_{0};
+  size_t numN_{0};
+  std::vector<uint8_t> fw_;
+  std::vector<uint8_t> rc_;
+  std::vector<uint64_t> nmask_;
+};
+
+} // namespace pufferfish
+
+#endif // __ENCODED_READ_HPP__
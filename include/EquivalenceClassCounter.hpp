@@ -0,0 +1,102 @@
+#ifndef __EQUIVALENCE_CLASS_COUNTER_HPP__
+#define __EQUIVALENCE_CLASS_COUNTER_HPP__
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "spdlog/fmt/fmt.h"
+#include "xxhash.h"
+
+#include "Util.hpp"
+
+namespace pufferfish {
+
+/**
+ * Counts reads per equivalence class, i.e. per set of references a read
+ * (or read pair) is compatible with, which is all that EM-based
+ * quantifiers need from a mapping run (--eqclasses).
+ *
+ * Each worker thread counts into its own EquivalenceClassCounter and
+ * merges it into the shared one once it is done with its reads, so the
+ * only synchronization is one merge per thread.
+ **/
+class EquivalenceClassCounter {
+public:
+  using Label = std::vector<uint32_t>;
+
+  // Count a read mapping to the references of hits (nothing if it didn't map)
+  void addRead(const std::vector<util::QuasiAlignment>& hits) {
+    if (hits.empty()) { return; }
+    label_.clear();
+    for (auto& qa : hits) { label_.push_back(qa.tid); }
+    std::sort(label_.begin(), label_.end());
+    label_.erase(std::unique(label_.begin(), label_.end()), label_.end());
+    addLabel(label_);
+  }
+
+  // Count a read compatible with the (sorted) references of label
+  void addLabel(const Label& label) {
+    if (label.empty()) { return; }
+    auto it = counts_.find(label);
+    if (it == counts_.end()) {
+      counts_.emplace(label, 1);
+    } else {
+      ++it->second;
+    }
+  }
+
+  // Add the counts of other (a finished thread's counter) to this one
+  void merge(const EquivalenceClassCounter& other) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& kv : other.counts_) { counts_[kv.first] += kv.second; }
+  }
+
+  size_t numClasses() const { return counts_.size(); }
+
+  /**
+   * Write the table: the number of references and of classes, then the
+   * name and length of each reference (one per line), then each class as
+   * its number of references, their ids and its read count.  Classes are
+   * written in label order, so the output doesn't depend on the threads.
+   **/
+  template <typename IndexT>
+  void write(IndexT& pfi, fmt::MemoryWriter& out) const {
+    auto& txpNames = pfi.getRefNames();
+    auto& txpLens = pfi.getRefLengths();
+    std::vector<const std::pair<const Label, uint64_t>*> classes;
+    classes.reserve(counts_.size());
+    for (auto& kv : counts_) { classes.push_back(&kv); }
+    std::sort(classes.begin(), classes.end(),
+              [](const std::pair<const Label, uint64_t>* a,
+                 const std::pair<const Label, uint64_t>* b) { return a->first < b->first; });
+    out << txpNames.size() << '\n' << classes.size() << '\n';
+    for (size_t i = 0; i < txpNames.size(); ++i) {
+      out << txpNames[i] << '\t' << txpLens[i] << '\n';
+    }
+    for (auto c : classes) {
+      out << c->first.size();
+      for (auto tid : c->first) { out << '\t' << tid; }
+      out << '\t' << c->second << '\n';
+    }
+  }
+
+private:
+  struct LabelHash {
+    size_t operator()(const Label& l) const {
+      return XXH64(l.data(), l.size() * sizeof(uint32_t), 0);
+    }
+  };
+
+  // the label of the current read (reused to avoid an allocation per read)
+  Label label_;
+  std::unordered_map<Label, uint64_t, LabelHash> counts_;
+  std::mutex mutex_;
+};
+
+} // namespace pufferfish
+
+#endif // __EQUIVALENCE_CLASS_COUNTER_HPP__
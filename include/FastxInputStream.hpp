@@ -0,0 +1,106 @@
+#ifndef __FASTX_INPUT_STREAM__
+#define __FASTX_INPUT_STREAM__
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "concurrentqueue.h"
+
+namespace fastx_parser {
+
+/**
+ * The bytes of one read file, as the parsing threads' kseq sees them.
+ * Decompression happens off the parsing thread, so a parser only has to
+ * split records:
+ *
+ *  - BGZF files (gzip made of independent blocks, as written by bgzip or
+ *    `--compressOutput`) are cut at block boundaries into batches that are
+ *    inflated by a pool of threads and handed back in order;
+ *  - other gzip files are inflated by one thread that runs ahead of the
+ *    parser, filling large buffers;
+ *  - anything that isn't a regular file (a pipe, a FIFO, or stdin, named
+ *    "-") is read (and inflated, if it is gzip) by one thread that hands
+ *    over what it has as soon as the input stalls, so that reads arriving
+ *    over time (e.g. from a running sequencer) aren't held back;
+ *  - uncompressed regular files are mapped into memory.
+ **/
+class InputStream {
+public:
+  // numThreads is the number of inflating threads used for BGZF input
+  InputStream(const std::string& fname, uint32_t numThreads);
+  ~InputStream();
+
+  InputStream(const InputStream&) = delete;
+  InputStream& operator=(const InputStream&) = delete;
+
+  // false if the file could not be opened
+  bool good() const { return good_; }
+
+  // true for pipes, FIFOs and stdin, whose input may arrive over time
+  bool isStream() const { return kind_ == Kind::Stream; }
+
+  // Have read() call onStall before it waits for input that hasn't
+  // arrived yet (used to hand over the reads parsed so far when streaming)
+  void setStallHandler(std::function<void()> onStall) { onStall_ = std::move(onStall); }
+
+  // Copy up to len bytes to buf; returns the number of bytes copied, 0 at
+  // the end of the file and -1 if the file is corrupt or truncated (the
+  // convention of kseq's read function)
+  int read(char* buf, int len);
+
+private:
+  enum class Kind { Mapped, Gzip, BGZF, Stream };
+
+  // A run of input that is decompressed as a unit.  Batch i lives in
+  // slot i % ring_.size() until the reader is done with it.
+  struct Batch {
+    static constexpr int Free = 0;
+    static constexpr int Compressed = 1;
+    static constexpr int Ready = 2;
+    std::vector<char> in;
+    std::vector<char> out;
+    std::atomic<int> state{Free};
+    bool failed{false};
+  };
+
+  bool openMapped_(size_t size);
+  void readBGZF_();
+  void inflateBGZF_();
+  void readGzip_();
+  void readStream_();
+  bool waitForFree_(Batch& b);
+  bool inflateBatch_(Batch& b);
+
+  Kind kind_{Kind::Mapped};
+  bool good_{false};
+  int fd_{-1};
+
+  // Kind::Mapped
+  const char* map_{nullptr};
+  size_t mapSize_{0};
+  size_t mapPos_{0};
+
+  // the other kinds
+  std::vector<std::unique_ptr<Batch>> ring_;
+  // ids of the batches waiting to be inflated (BGZF)
+  moodycamel::ConcurrentQueue<size_t> inflateQueue_;
+  std::vector<std::thread> threads_;
+  std::atomic<bool> readerDone_{false};
+  std::atomic<bool> stop_{false};
+  std::atomic<bool> readFailed_{false};
+  std::atomic<size_t> numBatches_{0};
+  std::function<void()> onStall_;
+  // the batch being consumed by read()
+  size_t next_{0};
+  Batch* cur_{nullptr};
+  size_t curPos_{0};
+};
+
+} // namespace fastx_parser
+
+#endif // __FASTX_INPUT_STREAM__
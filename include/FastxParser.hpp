@@ -4,6 +4,7 @@
 #include "fcntl.h"
 #include "unistd.h"
 #include <atomic>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
 #include <iostream>
@@ -15,6 +16,7 @@ extern "C" {
 }
 
 #include "concurrentqueue.h"
+#include "string_view.hpp"
 
 #ifndef __FASTX_PARSER_PRECXX14_MAKE_UNIQUE__
 #define __FASTX_PARSER_PRECXX14_MAKE_UNIQUE__
@@ -70,6 +72,31 @@ struct ReadPair {
   ReadSeq second;
 };
 
+/**
+ * Records that don't own their bytes: the name, sequence and quality
+ * (empty for FASTA) point into the arena of the chunk holding the record,
+ * and stay valid until that chunk is handed back to the parser (by
+ * refill() or finishedWithGroup()).  Parsing into them copies each record
+ * once into a buffer that is reused across refills, rather than into two
+ * std::strings per read.
+ **/
+struct ReadSeqView {
+  stx::string_view seq;
+  stx::string_view name;
+  stx::string_view qual;
+};
+
+struct ReadPairView {
+  ReadSeqView first;
+  ReadSeqView second;
+};
+
+// Where a field of a record lives in its chunk's arena
+struct ArenaSpan {
+  size_t offset;
+  size_t length;
+};
+
 template <typename T> class ReadChunk {
 public:
   ReadChunk(size_t want) : group_(want), want_(want), have_(want) {}
@@ -80,10 +107,39 @@ public:
   typename std::vector<T>::iterator begin() { return group_.begin(); }
   typename std::vector<T>::iterator end() { return group_.begin() + have_; }
 
+  // Make the chunk ready to be filled again; the arena keeps its capacity
+  inline void reset() {
+    have_ = want_;
+    arena_.clear();
+    spans_.clear();
+  }
+  // Copy s to the arena (NUL-terminated) and remember where it went
+  inline void addToArena(const char* s, size_t len) {
+    spans_.push_back({arena_.size(), len});
+    arena_.insert(arena_.end(), s, s + len);
+    arena_.push_back('\0');
+  }
+  inline const char* arenaData() const { return arena_.data(); }
+  inline const std::vector<ArenaSpan>& arenaSpans() const { return spans_; }
+
+  // Where the reads come from: the index of their input file (or file
+  // pair), and the position in it of the first read of the chunk
+  inline void setOrigin(uint32_t file, uint64_t firstRead) {
+    file_ = file;
+    firstRead_ = firstRead;
+  }
+  inline uint32_t file() const { return file_; }
+  inline uint64_t firstRead() const { return firstRead_; }
+
 private:
   std::vector<T> group_;
   size_t want_;
   size_t have_;
+  uint32_t file_{0};
+  uint64_t firstRead_{0};
+  // only used by chunks of arena-backed records (ReadSeqView, ReadPairView)
+  std::vector<char> arena_;
+  std::vector<ArenaSpan> spans_;
 };
 
 template <typename T> class ReadGroup {
@@ -99,6 +155,8 @@ public:
   inline void have(size_t num) { chunk_->have(num); }
   inline size_t size() { return chunk_->size(); }
   inline size_t want() const { return chunk_->want(); }
+  inline uint32_t file() const { return chunk_->file(); }
+  inline uint64_t firstRead() const { return chunk_->firstRead(); }
   T& operator[](size_t i) { return (*chunk_)[i]; }
   typename std::vector<T>::iterator begin() { return chunk_->begin(); }
   typename std::vector<T>::iterator end() {
@@ -123,6 +181,18 @@ public:
               uint32_t chunkSize = 1000);
 
   ~FastxParser();
+
+  /**
+   * Streaming mode, for input that arrives over time (stdin, a FIFO): a
+   * chunk is handed to the consumers as soon as the input stalls, or once
+   * its first read has waited maxLatency, rather than only once it is full,
+   * so chunks shrink when reads arrive slowly.  Call before start().
+   **/
+  void setMaxLatency(std::chrono::milliseconds maxLatency) {
+    streaming_ = true;
+    maxLatency_ = maxLatency;
+  }
+
   bool start();
   bool stop();
   ReadGroup<T> getReadGroup();
@@ -130,12 +200,19 @@ public:
   void finishedWithGroup(ReadGroup<T>& s);
 
 private:
+  // (templates so that only the one matching T gets instantiated)
+  template <typename U = T> bool startSingle_();
+  template <typename U = T> bool startPaired_();
   moodycamel::ProducerToken getProducerToken_();
   moodycamel::ConsumerToken getConsumerToken_();
 
   std::vector<std::string> inputStreams_;
   std::vector<std::string> inputStreams2_;
   uint32_t numParsers_;
+  // threads inflating each BGZF input file (see InputStream)
+  uint32_t numDecompressors_;
+  bool streaming_{false};
+  std::chrono::milliseconds maxLatency_{0};
   std::atomic<uint32_t> numParsing_;
 
   // NOTE: Would like to use std::future<int> here instead, but that
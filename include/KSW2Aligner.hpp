@@ -100,6 +100,26 @@ public:
   int operator()(const uint8_t* const queryOriginal, const int queryLength,
                  const uint8_t* const targetOriginal, const int targetLength);
 
+  /**
+   * Set the query once, to then align it against any number of targets
+   * with align().  The query is transformed (for the char variant) and
+   * reversed (as the global SIMD kernel wants it) only here, rather than
+   * for every target.  The CIGAR buffer of the internal result, like the
+   * kalloc pool the kernels draw their scratch space from, is kept across
+   * alignments.
+   **/
+  void setQuery(const char* const query, const int queryLength);
+  void setQuery(const uint8_t* const query, const int queryLength);
+
+  int align(const uint8_t* const target, const int targetLength, ksw_extz_t* ez,
+            EnumToType<KSW2AlignmentType::GLOBAL>);
+  int align(const uint8_t* const target, const int targetLength, ksw_extz_t* ez,
+            EnumToType<KSW2AlignmentType::EXTENSION>);
+  int align(const uint8_t* const target, const int targetLength,
+            EnumToType<KSW2AlignmentType::GLOBAL>);
+  int align(const uint8_t* const target, const int targetLength,
+            EnumToType<KSW2AlignmentType::EXTENSION>);
+
   KSW2Config& config() { return config_; }
   const ksw_extz_t& result() { return result_; }
   void freeCIGAR(ksw_extz_t* ez) {
@@ -117,7 +137,10 @@ public:
 private:
   std::vector<uint8_t> query_;
   std::vector<uint8_t> target_;
-  ksw_extz_t result_;
+  // the query set by setQuery(), and its reverse
+  std::vector<uint8_t> setQuery_;
+  std::vector<uint8_t> setQueryRev_;
+  ksw_extz_t result_{};
   std::unique_ptr<void, KallocDeleter> kalloc_allocator_{nullptr,
                                                          KallocDeleter()};
   std::vector<int8_t> mat_;
@@ -0,0 +1,166 @@
+#ifndef __MAPPING_RECORD_HPP__
+#define __MAPPING_RECORD_HPP__
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+/**
+ * The compact binary output of `pufferfish align --binaryOut`, and a reader
+ * for it.  This header has no other pufferfish dependencies, so that
+ * downstream tools (quantifiers, classifiers) can include it on its own.
+ *
+ * Layout (all integers little-endian):
+ *
+ *   file header   "PUFFMAP\0", version, flags (isPaired), number of
+ *                 references, then for each reference the length of its
+ *                 name, the name and its length.  Reference ids in the
+ *                 records index this table.
+ *   chunks        one per chunk of reads mapped by a worker thread:
+ *                 a MappingChunkHeader followed by, for each read, its
+ *                 number of mappings (uint32) and that many MappingRecords.
+ *
+ * Reads are not named.  A read is identified by the index of its input
+ * file (or file pair, in the order given on the command line) and its
+ * position in that file.  The parser assigns these, so they don't depend
+ * on the (nondeterministic) order in which chunks are written.
+ **/
+namespace pufferfish {
+
+constexpr char mappingFileMagic[8] = {'P', 'U', 'F', 'F', 'M', 'A', 'P', '\0'};
+constexpr uint32_t mappingFileVersion = 2;
+constexpr uint32_t mappingFilePaired = 0x1;
+
+// MappingRecord::flags
+constexpr uint8_t mappingFwd = 0x1;
+constexpr uint8_t mappingMateFwd = 0x2;
+
+struct MappingChunkHeader {
+  uint32_t numReads;
+  uint32_t numMappings;
+  // bytes of the chunk after this header
+  uint64_t length;
+  // the chunk holds reads firstRead, firstRead + 1, ... of input file `file`
+  uint64_t firstRead;
+  uint32_t file;
+  uint32_t reserved;
+};
+
+struct MappingRecord {
+  uint32_t refID;
+  // leftmost position of the read (of the first mate, if paired)
+  int32_t pos;
+  // leftmost position of the second mate (0 if single-end)
+  int32_t matePos;
+  int32_t fragLen;
+  // alignment score of a read pair; the coverage of the read(s) when only
+  // mapping (--justMap), and for single-end reads, which aren't aligned
+  int32_t score;
+  uint8_t flags;
+  // a util::MateStatus
+  uint8_t mateStatus;
+  uint16_t reserved;
+
+  bool isFwd() const { return flags & mappingFwd; }
+  bool mateIsFwd() const { return flags & mappingMateFwd; }
+};
+
+static_assert(sizeof(MappingChunkHeader) == 32, "unexpected MappingChunkHeader padding");
+static_assert(sizeof(MappingRecord) == 24, "unexpected MappingRecord padding");
+
+/**
+ * Reads the mappings of a --binaryOut file, one read at a time.
+ **/
+class MappingReader {
+public:
+  explicit MappingReader(const std::string& fname) : in_(fname, std::ios::binary) {
+    char magic[sizeof(mappingFileMagic)];
+    uint32_t version{0}, numRefs{0};
+    in_.read(magic, sizeof(magic));
+    get_(version);
+    get_(flags_);
+    get_(numRefs);
+    if (!in_ or std::memcmp(magic, mappingFileMagic, sizeof(magic)) != 0 or
+        version != mappingFileVersion) {
+      good_ = false;
+      return;
+    }
+    refNames_.resize(numRefs);
+    refLengths_.resize(numRefs);
+    for (uint32_t i = 0; i < numRefs and in_; ++i) {
+      uint32_t nameLen{0};
+      get_(nameLen);
+      refNames_[i].resize(nameLen);
+      in_.read(&refNames_[i][0], nameLen);
+      get_(refLengths_[i]);
+    }
+    good_ = static_cast<bool>(in_);
+  }
+
+  // false if the file could not be opened, isn't a mapping file, or is
+  // truncated
+  bool good() const { return good_; }
+  bool isPaired() const { return flags_ & mappingFilePaired; }
+  const std::vector<std::string>& refNames() const { return refNames_; }
+  const std::vector<uint32_t>& refLengths() const { return refLengths_; }
+
+  // The mappings of the next read (empty if it didn't map), its input file
+  // and its position in that file; false at the end of the file
+  bool nextRead(std::vector<MappingRecord>& mappings, uint32_t& file, uint64_t& readID) {
+    mappings.clear();
+    while (readsLeft_ == 0) {
+      MappingChunkHeader h;
+      if (!good_ or !in_.read(reinterpret_cast<char*>(&h), sizeof(h))) { return false; }
+      chunk_.resize(h.length);
+      if (!in_.read(chunk_.data(), h.length)) {
+        good_ = false;
+        return false;
+      }
+      readsLeft_ = h.numReads;
+      file_ = h.file;
+      nextReadID_ = h.firstRead;
+      pos_ = 0;
+    }
+    uint32_t n;
+    if (!take_(&n, sizeof(n))) { return false; }
+    mappings.resize(n);
+    if (!take_(mappings.data(), n * sizeof(MappingRecord))) { return false; }
+    --readsLeft_;
+    file = file_;
+    readID = nextReadID_++;
+    return true;
+  }
+
+private:
+  template <typename T>
+  void get_(T& v) { in_.read(reinterpret_cast<char*>(&v), sizeof(T)); }
+
+  bool take_(void* dest, size_t n) {
+    if (n == 0) { return true; }
+    if (pos_ + n > chunk_.size()) {
+      good_ = false;
+      return false;
+    }
+    std::memcpy(dest, chunk_.data() + pos_, n);
+    pos_ += n;
+    return true;
+  }
+
+  std::ifstream in_;
+  bool good_{true};
+  uint32_t flags_{0};
+  std::vector<std::string> refNames_;
+  std::vector<uint32_t> refLengths_;
+  std::vector<char> chunk_;
+  size_t pos_{0};
+  uint32_t readsLeft_{0};
+  // the origin of the next read of the current chunk
+  uint32_t file_{0};
+  uint64_t nextReadID_{0};
+};
+
+} // namespace pufferfish
+
+#endif // __MAPPING_RECORD_HPP__
@@ -0,0 +1,102 @@
+#ifndef __MAPPING_RECORD_WRITER_HPP__
+#define __MAPPING_RECORD_WRITER_HPP__
+
+#include <cstring>
+#include <vector>
+
+#include "spdlog/fmt/fmt.h"
+
+#include "MappingRecord.hpp"
+#include "Util.hpp"
+
+/**
+ * Writers for the compact binary output (--binaryOut); the format is
+ * described in MappingRecord.hpp.
+ **/
+
+template <typename IndexT>
+inline void writeMappingHeader(IndexT& pfi, fmt::MemoryWriter& out, bool isPaired) {
+  auto put = [&out](uint32_t v) {
+    auto p = reinterpret_cast<const char*>(&v);
+    out.buffer().append(p, p + sizeof(v));
+  };
+  auto& txpNames = pfi.getRefNames();
+  auto& txpLens = pfi.getRefLengths();
+  out.buffer().append(pufferfish::mappingFileMagic,
+                      pufferfish::mappingFileMagic + sizeof(pufferfish::mappingFileMagic));
+  put(pufferfish::mappingFileVersion);
+  put(isPaired ? pufferfish::mappingFilePaired : 0);
+  put(static_cast<uint32_t>(txpNames.size()));
+  for (size_t i = 0; i < txpNames.size(); ++i) {
+    put(static_cast<uint32_t>(txpNames[i].length()));
+    out.buffer().append(txpNames[i].data(), txpNames[i].data() + txpNames[i].length());
+    put(static_cast<uint32_t>(txpLens[i]));
+  }
+}
+
+namespace pufferfish {
+
+/**
+ * Builds the chunk of binary output for the reads of one parser chunk
+ * (all of which have to be added, mapped or not).  The chunk header goes
+ * in front of the first read added and is filled in by finish().
+ **/
+class MappingChunkWriter {
+public:
+  // The origin of the reads added next (see fastx_parser::ReadGroup)
+  void setOrigin(uint32_t file, uint64_t firstRead) {
+    file_ = file;
+    firstRead_ = firstRead;
+  }
+
+  void addRead(const std::vector<util::QuasiAlignment>& hits, fmt::MemoryWriter& out) {
+    if (numReads_ == 0) {
+      start_ = out.size();
+      MappingChunkHeader h{0, 0, 0, 0, 0, 0};
+      append_(out, &h, sizeof(h));
+    }
+    uint32_t n = static_cast<uint32_t>(hits.size());
+    append_(out, &n, sizeof(n));
+    for (auto& qa : hits) {
+      MappingRecord rec;
+      rec.refID = qa.tid;
+      rec.pos = qa.pos;
+      rec.matePos = qa.matePos;
+      rec.fragLen = static_cast<int32_t>(qa.fragLen);
+      rec.score = qa.alnScore;
+      rec.flags = (qa.fwd ? mappingFwd : 0) | (qa.mateIsFwd ? mappingMateFwd : 0);
+      rec.mateStatus = static_cast<uint8_t>(qa.mateStatus);
+      rec.reserved = 0;
+      append_(out, &rec, sizeof(rec));
+    }
+    ++numReads_;
+    numMappings_ += n;
+  }
+
+  // Complete the chunk (if any read was added) before out is written
+  void finish(fmt::MemoryWriter& out) {
+    if (numReads_ == 0) { return; }
+    MappingChunkHeader h{numReads_, numMappings_,
+                         out.size() - start_ - sizeof(MappingChunkHeader),
+                         firstRead_, file_, 0};
+    std::memcpy(&out.buffer()[start_], &h, sizeof(h));
+    numReads_ = 0;
+    numMappings_ = 0;
+  }
+
+private:
+  static inline void append_(fmt::MemoryWriter& out, const void* p, size_t n) {
+    auto c = static_cast<const char*>(p);
+    out.buffer().append(c, c + n);
+  }
+
+  size_t start_{0};
+  uint32_t file_{0};
+  uint64_t firstRead_{0};
+  uint32_t numReads_{0};
+  uint32_t numMappings_{0};
+};
+
+} // namespace pufferfish
+
+#endif // __MAPPING_RECORD_WRITER_HPP__
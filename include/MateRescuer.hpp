@@ -0,0 +1,290 @@
+#ifndef __MATE_RESCUER_HPP__
+#define __MATE_RESCUER_HPP__
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include <sparsepp/spp.h>
+
+#include "EditDistance.hpp"
+#include "EncodedRead.hpp"
+#include "KSW2Aligner.hpp"
+#include "ReadKmerTable.hpp"
+#include "RefSeqConstructor.hpp"
+#include "Util.hpp"
+
+namespace util {
+  // The placement of a mate that was recovered by MateRescuer.
+  struct RescuedMate {
+    size_t pos{0};
+    bool isFw{true};
+    int score{std::numeric_limits<int>::min()};
+    size_t fragmentLen{0};
+    PackedCigar cigar;
+  };
+}
+
+/**
+ * Mate rescue: given a confident cluster of one mate on reference `tid`,
+ * look for the other mate in the stretch of the reference where a
+ * concordant mate would have to lie (at most maxFragmentLength, but no more
+ * than maxWindowLength, away from the anchor, on the opposite strand).
+ *
+ * The mate is set once (setMate) for all of the anchors of one strand, so
+ * its seeds and its (reversed) alignment query are built once per read
+ * rather than once per anchor.
+ *
+ * The reference window is spelled out by walking the contigs of `tid` with
+ * the RefSeqConstructor, starting from the anchor's outermost uni-MEM.  The
+ * mate is then placed in the window by voting over the diagonals of its
+ * short seed matches, and verified with a banded global (SIMD) KSW2
+ * alignment against the window slice at the winning diagonal.  Slices whose
+ * edit distance to the mate already rules out minScore are rejected before
+ * running KSW2.
+ **/
+template <typename PufferfishIndexT>
+class MateRescuer {
+public:
+  // length of the seeds used to locate the mate inside the window
+  static constexpr uint32_t seedLen = 15;
+  // minimum number of seeds that have to agree on a diagonal
+  static constexpr uint32_t minVotes = 2;
+  // band used for the verification alignment
+  static constexpr int bandwidth = 15;
+  // longest fragment searched for the mate: the default maxFragmentLength
+  // is far beyond any real library, and every base of the window is
+  // spelled out and seeded
+  static constexpr uint32_t maxWindowLength = 1000;
+
+  MateRescuer(PufferfishIndexT* pfi,
+              RefSeqConstructor<PufferfishIndexT>* refSeqConstructor,
+              spp::sparse_hash_map<uint32_t, util::ContigBlock>* contigSeqCache,
+              ksw2pp::KSW2Aligner* aligner,
+              pufferfish::MyersEditDistance* editDistance)
+    : pfi_(pfi), refSeqConstructor_(refSeqConstructor),
+      contigSeqCache_(contigSeqCache), aligner_(aligner),
+      editDistance_(editDistance) {}
+
+  /**
+   * Set the mate to be placed next to the anchors passed to operator()
+   * from now on, in the orientation it has to have: anchors on the other
+   * strand of mateIsFw.
+   **/
+  void setMate(const pufferfish::EncodedRead& mate, bool mateIsFw) {
+    mate_ = &mate;
+    mateIsFw_ = mateIsFw;
+    mateTable_.fill(mate, seedLen);
+    aligner_->setQuery(mateIsFw ? mate.fw() : mate.rc(), static_cast<int>(mate.length()));
+  }
+
+  /**
+   * Try to place the mate concordantly with the cluster `anchor` of the
+   * other mate on reference `tid`.  Returns true (and fills `res`, whose
+   * CIGAR is appended to cigarOps) if an alignment with a score of at
+   * least minScore was found.
+   **/
+  bool operator()(size_t tid,
+                  const util::MemCluster& anchor,
+                  uint32_t maxFragmentLength,
+                  int minScore,
+                  std::vector<uint32_t>& cigarOps,
+                  util::RescuedMate& res) {
+    auto& mate = *mate_;
+    if (anchor.mems.empty() or anchor.isFw == mateIsFw_ or mate.length() < seedLen) {
+      return false;
+    }
+    size_t windowStart{0};
+    uint32_t maxWindow = maxFragmentLength;
+    if (maxWindow > maxWindowLength) { maxWindow = maxWindowLength; }
+    if (!fetchWindow_(tid, anchor, maxWindow, windowStart)) {
+      return false;
+    }
+    bool mateIsFw = mateIsFw_;
+    int32_t diag{0};
+    if (!locate_(mateIsFw, diag)) {
+      return false;
+    }
+
+    int32_t mateLen = static_cast<int32_t>(mate.length());
+    int32_t windowLen = static_cast<int32_t>(windowRead_.length());
+    int32_t sliceStart = std::max(diag, 0);
+    int32_t sliceEnd = std::min(diag + mateLen, windowLen);
+    if (sliceEnd <= sliceStart) {
+      return false;
+    }
+
+    const uint8_t* mateCodes = mateIsFw ? mate.fw() : mate.rc();
+    const uint8_t* slice = windowRead_.fw() + sliceStart;
+    int sliceLen = sliceEnd - sliceStart;
+    int maxDist = editDistance_->maxDistance(mateLen, sliceLen, minScore);
+    if (maxDist < 0 or (*editDistance_)(mateCodes, mateLen, slice, sliceLen, maxDist) < 0) {
+      return false;
+    }
+    auto& config = aligner_->config();
+    auto prevBandwidth = config.bandwidth;
+    config.bandwidth = bandwidth;
+    int score = aligner_->align(slice, sliceLen,
+                                ksw2pp::EnumToType<ksw2pp::KSW2AlignmentType::GLOBAL>());
+    config.bandwidth = prevBandwidth;
+    if (score < minScore) {
+      return false;
+    }
+
+    res.pos = windowStart + sliceStart;
+    res.isFw = mateIsFw;
+    res.score = score;
+    if (anchor.isFw) {
+      res.fragmentLen = res.pos + mateLen - anchor.firstRefPos();
+    } else {
+      res.fragmentLen = anchor.lastRefPos() + anchor.lastMemLen() - res.pos;
+    }
+    auto& ez = aligner_->result();
+    res.cigar.reset(cigarOps);
+    res.cigar.append(ez.cigar, ez.cigar + ez.n_cigar);
+    return true;
+  }
+
+private:
+  util::ContigBlock& contigBlock_(std::vector<util::UniMemInfo>::iterator memInfo) {
+    auto it = contigSeqCache_->find(memInfo->cid);
+    if (it == contigSeqCache_->end()) {
+      (*contigSeqCache_)[memInfo->cid] = {memInfo->cid, memInfo->cGlobalPos, memInfo->clen,
+                                          pfi_->getSeqStr(memInfo->cGlobalPos, memInfo->clen)};
+    }
+    return (*contigSeqCache_)[memInfo->cid];
+  }
+
+  /**
+   * Spell out (into window_) the part of the reference where a concordant
+   * mate can be found.  If the anchor is forward, this is the
+   * sequence starting at its last uni-MEM and extending downstream;
+   * otherwise it is the sequence ending with its first uni-MEM.  It is
+   * read from the index's reference store if there is one (and the window
+   * has no Ns), and spelled out from the contigs otherwise.
+   **/
+  bool fetchWindow_(size_t tid, const util::MemCluster& anchor,
+                    uint32_t maxWindow, size_t& windowStart) {
+    util::ContigBlock dummy = {std::numeric_limits<uint64_t>::max(),0,0,"",true};
+    size_t refLen = pfi_->refLength(tid);
+    window_.clear();
+    if (anchor.isFw) {
+      auto& mem = anchor.mems.back();
+      auto memInfo = mem.memInfo;
+      if (mem.tpos + memInfo->memlen > refLen) { return false; }
+      size_t windowLen = std::min(static_cast<size_t>(maxWindow), refLen - mem.tpos);
+      if (pfi_->hasRefSeq() and pfi_->getRefWindow(tid, mem.tpos, windowLen, true, window_)) {
+        windowStart = mem.tpos;
+        return true;
+      }
+      bool contigDirWRTref = memInfo->cIsFw == anchor.isFw;
+      window_ = pfi_->getSeqStr(memInfo->cGlobalPos + memInfo->cpos, memInfo->memlen, contigDirWRTref);
+      if (windowLen > memInfo->memlen) {
+        // copied, since the walk may add to (and so rearrange) the contig cache
+        util::ContigBlock scb = contigBlock_(memInfo);
+        uint32_t cstart = contigDirWRTref ? (memInfo->cpos + memInfo->memlen - 1) : memInfo->cpos;
+        ext_.clear();
+        Task res = refSeqConstructor_->fillSeq(tid, mem.tpos + memInfo->memlen - 1,
+                                               contigDirWRTref, scb, cstart, dummy, 0,
+                                               contigDirWRTref, windowLen - memInfo->memlen, ext_);
+        if (res != Task::SUCCESS) { return false; }
+        window_ += ext_;
+      }
+      windowStart = mem.tpos;
+    } else {
+      auto& mem = anchor.mems.front();
+      auto memInfo = mem.memInfo;
+      size_t memEnd = mem.tpos + memInfo->memlen;
+      if (memEnd > refLen) { return false; }
+      size_t windowLen = std::min(static_cast<size_t>(maxWindow), memEnd);
+      if (pfi_->hasRefSeq() and pfi_->getRefWindow(tid, memEnd - windowLen, windowLen, true, window_)) {
+        windowStart = memEnd - windowLen;
+        return true;
+      }
+      bool contigDirWRTref = memInfo->cIsFw == anchor.isFw;
+      ext_.clear();
+      if (windowLen > memInfo->memlen) {
+        util::ContigBlock ecb = contigBlock_(memInfo);
+        uint32_t cend = contigDirWRTref ? memInfo->cpos : (memInfo->cpos + memInfo->memlen - 1);
+        Task res = refSeqConstructor_->fillSeq(tid, mem.tpos - (windowLen - memInfo->memlen) - 1,
+                                               contigDirWRTref, dummy, 0, ecb, cend,
+                                               contigDirWRTref, windowLen - memInfo->memlen, ext_);
+        if (res != Task::SUCCESS) { return false; }
+      }
+      window_ = ext_ + pfi_->getSeqStr(memInfo->cGlobalPos + memInfo->cpos, memInfo->memlen, contigDirWRTref);
+      windowStart = memEnd - window_.length();
+    }
+    return true;
+  }
+
+  /**
+   * Find the diagonal (window position - mate position) supported by the
+   * largest number of exact seed matches between the oriented mate and the
+   * window.
+   **/
+  bool locate_(bool mateIsFw, int32_t& diag) {
+    windowRead_.encode(window_);
+    windowTable_.fill(windowRead_, seedLen);
+
+    windowSeeds_.clear();
+    for (int32_t p = windowTable_.nextValid(0); p < windowTable_.end();
+         p = windowTable_.advance(p, 1)) {
+      windowSeeds_.emplace_back(windowTable_.fwWord(p), p);
+    }
+    if (windowSeeds_.empty()) { return false; }
+    std::sort(windowSeeds_.begin(), windowSeeds_.end());
+
+    diags_.clear();
+    int32_t nk = mateTable_.numKmers();
+    for (int32_t m = 0; m < nk; ++m) {
+      // position (in the forward mate) of the k-mer at position m of the oriented mate
+      int32_t i = mateIsFw ? m : (nk - 1 - m);
+      if (!mateTable_.isValid(i)) { continue; }
+      uint64_t w = mateIsFw ? mateTable_.fwWord(i) : mateTable_.rcWord(i);
+      auto range = std::equal_range(windowSeeds_.begin(), windowSeeds_.end(),
+                                    std::make_pair(w, std::numeric_limits<int32_t>::min()),
+                                    [](const std::pair<uint64_t, int32_t>& a,
+                                       const std::pair<uint64_t, int32_t>& b) -> bool {
+                                      return a.first < b.first;
+                                    });
+      for (auto it = range.first; it != range.second; ++it) {
+        diags_.push_back(it->second - m);
+      }
+    }
+    if (diags_.empty()) { return false; }
+    std::sort(diags_.begin(), diags_.end());
+    uint32_t bestVotes{0};
+    for (size_t s = 0; s < diags_.size();) {
+      size_t e = s;
+      while (e < diags_.size() and diags_[e] == diags_[s]) { ++e; }
+      if (e - s > bestVotes) {
+        bestVotes = static_cast<uint32_t>(e - s);
+        diag = diags_[s];
+      }
+      s = e;
+    }
+    return bestVotes >= minVotes;
+  }
+
+  PufferfishIndexT* pfi_;
+  RefSeqConstructor<PufferfishIndexT>* refSeqConstructor_;
+  spp::sparse_hash_map<uint32_t, util::ContigBlock>* contigSeqCache_;
+  ksw2pp::KSW2Aligner* aligner_;
+  pufferfish::MyersEditDistance* editDistance_;
+
+  // set by setMate()
+  const pufferfish::EncodedRead* mate_{nullptr};
+  bool mateIsFw_{true};
+
+  std::string window_;
+  std::string ext_;
+  pufferfish::EncodedRead windowRead_;
+  pufferfish::ReadKmerTable windowTable_;
+  pufferfish::ReadKmerTable mateTable_;
+  std::vector<std::pair<uint64_t, int32_t>> windowSeeds_;
+  std::vector<int32_t> diags_;
+};
+
+#endif // __MATE_RESCUER_HPP__
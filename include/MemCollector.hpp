@@ -4,6 +4,8 @@
 #include "CommonTypes.hpp"
 #include "CanonicalKmer.hpp"
 #include "CanonicalKmerIterator.hpp"
+#include "EncodedRead.hpp"
+#include "ReadKmerTable.hpp"
 #include "PufferfishIndex.hpp"
 #include "PufferfishSparseIndex.hpp"
 #include "Util.hpp"
@@ -13,6 +15,7 @@
 #include <algorithm>
 #include <iostream>
 #include <iterator>
+#include <limits>
 #include <sparsepp/spp.h>
 // using spp:sparse_hash_map;
 
@@ -25,6 +28,11 @@ template <typename PufferfishIndexT> class MemCollector {
 public:
   MemCollector(PufferfishIndexT* pfi) : pfi_(pfi) { k = pfi_->k(); }
 
+  // uni-MEMs occurring this many times or more in the references are
+  // considered repetitive (see clusterMems).
+  void setMaxRefOcc(uint32_t maxRefOcc) { maxRefOcc_ = maxRefOcc; }
+  uint32_t maxRefOcc() const { return maxRefOcc_; }
+
   bool clusterMems(std::vector<std::pair<int, util::ProjectedHits>>& hits,
                    spp::sparse_hash_map<pufferfish::common_types::ReferenceID, std::vector<util::MemCluster>>& memClusters,
                    uint32_t maxSpliceGap, std::vector<util::UniMemInfo>& memCollection, bool verbose = false) {
@@ -36,6 +44,24 @@ public:
       return false;
     }
 
+    // Hits in highly repetitive contigs are deferred: they are only projected
+    // if the read has no informative (i.e. low occurrence) hit at all, and in
+    // that case only the ones with the fewest occurrences are used.  This
+    // bounds the projection / clustering work for reads in repeats without
+    // dropping them entirely.
+    bool haveInformative{false};
+    size_t minDeferredOcc{std::numeric_limits<size_t>::max()};
+    for (auto& hit : hits) {
+      size_t occ = static_cast<size_t>(hit.second.refRange.size());
+      if (occ < maxRefOcc_) {
+        haveInformative = true;
+        break;
+      }
+      minDeferredOcc = std::min(minDeferredOcc, occ);
+    }
+    // hits with fewer occurrences than this are projected
+    size_t occLimit = haveInformative ? maxRefOcc_ : minDeferredOcc + 1;
+
     // Map from (reference id, orientation) pair to a cluster of MEMs.
     std::map<std::pair<ReferenceID, bool>, std::vector<util::MemInfo>>
         trMemMap;
@@ -46,7 +72,7 @@ public:
       // NOTE: here we rely on internal members of the ProjectedHit (i.e., member variables ending in "_").
       // Maybe we want to change the interface (make these members public or provide accessors)?
       auto& refs = projHits.refRange;
-      if (refs.size() < 200) {
+      if (static_cast<size_t>(refs.size()) < occLimit) {
         memCollection.emplace_back(projHits.contigIdx_, projHits.contigOrientation_,
                                    readPos, projHits.k_, projHits.contigPos_,
                                    projHits.globalPos_-projHits.contigPos_, projHits.contigLen_);
@@ -158,8 +184,37 @@ public:
     return true;
   }
 
+  /**
+   * Fast path for a read that is matched end-to-end by a single uni-MEM
+   * (i.e. the first k-mer of the read hits a contig and the expansion
+   * reaches the end of the read).  Every reference position of the contig
+   * is then an equally perfect placement, so we project them directly into
+   * single-MEM clusters, without the (tid, orientation) map and the sorting
+   * that clusterMems needs for the general case.  Since this is the only
+   * hit of the read, it is projected even if it is repetitive.
+   **/
+  void projectPerfectHit(util::ProjectedHits& projHits,
+                         spp::sparse_hash_map<size_t, std::vector<util::MemCluster>>& memClusters,
+                         std::vector<util::UniMemInfo>& memCollection) {
+    auto& refs = projHits.refRange;
+    memCollection.reserve(1);
+    memCollection.emplace_back(projHits.contigIdx_, projHits.contigOrientation_,
+                               0, projHits.k_, projHits.contigPos_,
+                               projHits.globalPos_-projHits.contigPos_, projHits.contigLen_);
+    auto memItr = std::prev(memCollection.end());
+    for (auto& posIt : refs) {
+      auto refPosOri = projHits.decodeHit(posIt);
+      auto& clusts = memClusters[posIt.transcript_id()];
+      clusts.emplace_back(refPosOri.isFW);
+      clusts.back().addMem(memItr, refPosOri.pos);
+    }
+  }
+
+  // readPos is the read position of the k-mer that produced hit; on return
+  // it holds the read position from which the k-mer search should resume.
   size_t expandHitEfficient(util::ProjectedHits& hit,
-                            pufferfish::CanonicalKmerIterator& kit,
+                            const pufferfish::EncodedRead& read,
+                            int32_t& readPos,
 			    ExpansionTerminationType& et,
                             bool verbose) {
 
@@ -179,9 +234,8 @@ public:
       cCurrPos += k;
     }
 
-    int currReadStart = kit->second + 1;
-    auto readSeqView = kit.seq();
-    auto readSeqLen = readSeqView.size();
+    int currReadStart = readPos + 1;
+    auto readSeqLen = read.length();
     auto readSeqStart = currReadStart;
     auto readSeqOffset = currReadStart + k - 1;
     int fastNextReadCode{0};
@@ -200,8 +254,8 @@ public:
         uint64_t fk = allContigs.get_int(2 * (cCurrPos), 2 * baseCnt);
         cCurrPos += baseCnt;
         for (size_t i = 0; i < baseCnt && readSeqOffset < readSeqLen; i++) {
-          // be dirty and peek into the underlying read
-          fastNextReadCode = kmers::codeForChar(readSeqView[readSeqOffset]);
+          // the read is already encoded, so just compare codes
+          fastNextReadCode = read.fwCode(readSeqOffset);
           int contigCode = (fk >> (2 * i)) & 0x3;
           if (fastNextReadCode != contigCode) {
             stillMatch = false;
@@ -219,8 +273,8 @@ public:
         uint64_t fk = allContigs.get_int(2 * (cCurrPos - baseCnt), 2 * baseCnt);
         cCurrPos -= baseCnt;
         for (int i = baseCnt - 1; i >= 0 && readSeqOffset < readSeqLen; i--) {
-          // be dirty and peek into the underlying read
-          fastNextReadCode = kmers::codeForChar(kmers::complement(readSeqView[readSeqOffset]));
+          // compare against the complement of the read base
+          fastNextReadCode = read.rcCodeAt(readSeqOffset);
           int contigCode = (fk >> (2 * i)) & 0x3;
           if (fastNextReadCode != contigCode) {
             stillMatch = false;
@@ -251,11 +305,21 @@ public:
       
     }
     //std::cout << "after updating coverage: " << hit.k_ << "\n";
-    kit.jumpTo(readSeqStart);
+    readPos = readSeqStart;
     return currReadStart;
   }
 
-  bool operator()(std::string& read,
+  bool operator()(stx::string_view read,
+                  spp::sparse_hash_map<size_t, std::vector<util::MemCluster>>& memClusters,
+                  uint32_t maxSpliceGap,
+                  util::MateStatus mateStatus,
+                  util::QueryCache& qc,
+                  bool verbose=false) {
+    encodedRead_.encode(read);
+    return operator()(encodedRead_, memClusters, maxSpliceGap, mateStatus, qc, verbose);
+  }
+
+  bool operator()(const pufferfish::EncodedRead& read,
                   spp::sparse_hash_map<size_t, std::vector<util::MemCluster>>& memClusters,
                   uint32_t maxSpliceGap,
                   util::MateStatus mateStatus,
@@ -266,13 +330,18 @@ public:
     if (verbose) {
       std::cout << (mateStatus == util::MateStatus::PAIRED_END_RIGHT) << "\n";
     }
+    bool isRight = (mateStatus == util::MateStatus::PAIRED_END_RIGHT);
 
     util::ProjectedHits phits;
     std::vector<std::pair<int, util::ProjectedHits>> rawHits;
 
     CanonicalKmer::k(k);
-    pufferfish::CanonicalKmerIterator kit_end;
-    pufferfish::CanonicalKmerIterator kit1(read);
+    // all of the read's k-mers are extracted up front, so skipping ahead
+    // (after an expansion or by the heuristic below) is just index arithmetic
+    kmerTable_.fill(read, k);
+    auto kmersEnd = kmerTable_.end();
+    int32_t kpos = kmerTable_.nextValid(0);
+    CanonicalKmer kmer;
 
     /**
      *  Testing heuristic.  If we just succesfully matched a k-mer, and extended it to a uni-MEM, then
@@ -290,28 +359,37 @@ public:
     int32_t basesSinceLastHit{signedK};
     ExpansionTerminationType et {ExpansionTerminationType::MISMATCH};
 
-    while (kit1 != kit_end) {
-      auto phits = pfi_->getRefPos(kit1->first, qc);
+    while (kpos < kmersEnd) {
+      kmerTable_.getKmer(kpos, kmer);
+      auto phits = pfi_->getRefPos(kmer, qc);
       skip = (basesSinceLastHit >= signedK) ? 1 : altSkip;
       if (!phits.empty()) {
-        // kit1 gets updated inside expandHitEfficient function
+        // kpos gets updated inside expandHitEfficient function
         // stamping the reasPos
-        size_t readPosOld = kit1->second ;
+        size_t readPosOld = kpos ;
         if(verbose){
           std::cout<< "Index "<< phits.contigID() << " ContigLen "<<phits.contigLen_<< " GlobalPos " << phits.globalPos_ << " ore " << phits.contigOrientation_ << " ref size " << phits.refRange.size() <<"\n\n\n" ;
-          std::cout<<kit1->first.to_str() << "\n" ;
+          std::cout<<kmer.to_str() << "\n" ;
           for(auto& posIt : phits.refRange){
             auto refPosOri = phits.decodeHit(posIt);
             std::cout << posIt.transcript_id() << "\t" <<  refPosOri.isFW << "\t" << refPosOri.pos << "\n" ;
           } 
         }
-        expandHitEfficient(phits, kit1, et, verbose);
+        expandHitEfficient(phits, read, kpos, et, verbose);
+        kpos = kmerTable_.nextValid(kpos);
         if(verbose) std::cout<<"len after expansion: "<<phits.k_<<"\n" ;
+
+        // the very first k-mer extended over the whole read; nothing else
+        // in the read can do better, so report all of its placements.
+        if (rawHits.empty() and readPosOld == 0 and phits.k_ == read.length()) {
+          projectPerfectHit(phits, memClusters, isRight ? memCollectionRight : memCollectionLeft);
+          return true;
+        }
         
         rawHits.push_back(std::make_pair(readPosOld, phits));
         basesSinceLastHit = 1;
         skip = (et == ExpansionTerminationType::MISMATCH) ? altSkip : 1;
-        kit1 += (skip-1);
+        kpos = kmerTable_.advance(kpos, skip-1);
        //} else {
        //  ++kit1;
        //}
@@ -319,7 +397,7 @@ public:
       } else {
        // ++pos;
        basesSinceLastHit += skip;
-       kit1 += skip;
+       kpos = kmerTable_.advance(kpos, skip);
        //++kit1;
       }
     }
@@ -343,8 +421,12 @@ public:
 private:
   PufferfishIndexT* pfi_;
   size_t k;
+  uint32_t maxRefOcc_{200};
   //AlignerEngine ae_;
   std::vector<util::UniMemInfo> memCollectionLeft;
   std::vector<util::UniMemInfo> memCollectionRight;
+  // used only when we are handed a raw string rather than an EncodedRead
+  pufferfish::EncodedRead encodedRead_;
+  pufferfish::ReadKmerTable kmerTable_;
 };
 #endif
@@ -64,6 +64,7 @@ private:
   pufg::Graph semiCG;
 
   size_t fillContigInfoMap_();
+  std::pair<uint8_t, uint8_t> linkEdges_(uint64_t cid, bool ore, uint64_t nextcid, bool nextore);
   bool is_number(const std::string& s);
   void encodeSeq(sdsl::int_vector<2>& seqVec, size_t offset,
                  stx::string_view str);
@@ -82,6 +83,8 @@ public:
   spp::sparse_hash_map<std::string, std::string>& getContigIDMap();
   // spp::sparse_hash_map<uint32_t, std::string>& getRefIDs();
   std::vector<std::string>& getRefIDs();
+  // the length of each reference path, in the order of getRefIDs()
+  std::vector<uint32_t>& getRefLengths();
   std::map<std::pair<std::string, bool>, bool, util::cmpByPair>& getPathStart();
   std::map<std::pair<std::string, bool>, bool, util::cmpByPair>& getPathEnd();
   std::vector<std::pair<std::string, std::string>>& getNewSegments();
@@ -99,6 +102,7 @@ public:
   void mapContig2Pos();
   void clearContigTable();
   void serializeContigTable(const std::string& odir);
+  void serializeNeighborTable(const std::string& odir);
   void deserializeContigTable();
   // void writeFile(std::string fileName);
 };
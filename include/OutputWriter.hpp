@@ -0,0 +1,96 @@
+#ifndef __OUTPUT_WRITER_HPP__
+#define __OUTPUT_WRITER_HPP__
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "concurrentqueue.h"
+#include "spdlog/fmt/fmt.h"
+
+namespace pufferfish {
+
+/**
+ * Writes the mapping output of all the worker threads from a single
+ * writer thread.
+ *
+ * Each worker formats its records into a buffer it got from acquire(),
+ * and once a chunk of reads is done hands it over with submit(), getting
+ * an empty buffer back (so each worker double buffers: it fills one
+ * buffer while the writer thread drains the other).  The writer thread
+ * writes whatever buffers are pending with a single writev(2), clears
+ * them and returns them to the pool.  Both hand-offs go through
+ * lock-free queues, and the pool has a fixed number of buffers, so
+ * workers that get ahead of the output simply wait for a buffer to be
+ * freed instead of queueing up an unbounded amount of text.
+ *
+ * For BAM output (bgzf), submit() also compresses the buffer into BGZF
+ * blocks, so compression runs in parallel on the worker threads and the
+ * writer thread only writes the compressed blocks.
+ **/
+class OutputWriter {
+public:
+  // write to fname, or to stdout if fname is empty; numBuffers is the
+  // size of the buffer pool (at least 2 per worker thread).  If bgzf, the
+  // output is BGZF compressed (and ends with the BGZF EOF marker).
+  OutputWriter(const std::string& fname, size_t numBuffers, bool bgzf = false);
+  ~OutputWriter();
+
+  OutputWriter(const OutputWriter&) = delete;
+  OutputWriter& operator=(const OutputWriter&) = delete;
+
+  // Returns false if the output could not be opened
+  bool good() const { return fd_ >= 0; }
+
+  // Write buf right away from the calling thread; only for output that
+  // has to come before everything submitted (i.e. the header)
+  bool write(const fmt::MemoryWriter& buf);
+
+  // A buffer to format output into, waiting for one to be freed if they
+  // are all in use
+  fmt::MemoryWriter* acquire();
+  // Hand buf over to the writer thread (compressing it first, if bgzf), and
+  // return an empty buffer in its place
+  fmt::MemoryWriter* submit(fmt::MemoryWriter* buf);
+  // Return a buffer without writing it (e.g. when a worker is done)
+  void release(fmt::MemoryWriter* buf);
+
+  // Write everything submitted so far and stop the writer thread.
+  // Returns false if any write failed.
+  bool close();
+
+private:
+  // the most buffers written by a single writev
+  static constexpr size_t maxBatch = 64;
+
+  // the most bytes of input in a BGZF block, so that even incompressible
+  // input fits the 64K block limit
+  static constexpr size_t bgzfBlockInput = 0xff00;
+
+  void run_();
+  bool writeBatch_(fmt::MemoryWriter** bufs, size_t n);
+  bool writeRaw_(const char* data, size_t len);
+  // the BGZF blocks of buf (into its slot's compressed buffer)
+  static void compress_(const fmt::MemoryWriter& buf, std::vector<char>& out);
+
+  int fd_{-1};
+  bool ownsFd_{false};
+  bool bgzf_{false};
+  std::vector<std::unique_ptr<fmt::MemoryWriter>> buffers_;
+  // the compressed contents of each buffer, if bgzf
+  std::vector<std::vector<char>> compressed_;
+  // position of each buffer in buffers_ (filled once, then only read)
+  std::unordered_map<const fmt::MemoryWriter*, size_t> slot_;
+  moodycamel::ConcurrentQueue<fmt::MemoryWriter*> freeQueue_;
+  moodycamel::ConcurrentQueue<fmt::MemoryWriter*> writeQueue_;
+  std::atomic<bool> done_{false};
+  std::atomic<bool> failed_{false};
+  std::thread writer_;
+};
+
+} // namespace pufferfish
+
+#endif // __OUTPUT_WRITER_HPP__
@@ -46,6 +46,9 @@ struct PairedAlignmentFormatter {
   char buff2[1000];
   util::FixedWriter cigarStr1;
   util::FixedWriter cigarStr2;
+  // binary CIGARs of the current records (BAM output)
+  std::vector<uint32_t> cigarOps1;
+  std::vector<uint32_t> cigarOps2;
 };
 
 #endif //__PAIR_ALIGNMENT_FORMATTER_HPP__
@@ -12,6 +12,8 @@ public:
   bool isSparse{false};
   uint32_t extensionSize{4};
   uint32_t sampleSize{9};
+  bool buildNeighborTable{false};
+  bool storeRefSeq{false};
 };
 
 class TestOptions {
@@ -35,6 +37,7 @@ public:
   bool singleEnd{false};
   uint32_t numThreads{1};
   uint32_t maxNumHits{200};
+  uint32_t maxRefOcc{200};
   uint32_t maxSpliceGap{100};
   uint32_t maxFragmentLength{100000};
   double scoreRatio{0.5};
@@ -48,8 +51,19 @@ public:
   bool consistentHits{false};
   bool quiet{false};
 	bool writeOrphans{false} ;
+  bool mateRescue{false};
   bool justMap{false};
   bool krakOut{false};
+  bool bamOut{false};
+  bool binaryOut{false};
+  bool eqClasses{false};
+  bool pseudo{false};
+  bool sortOutput{false};
+  // memory (in MB) for the records being sorted before they spill to disk
+  uint32_t sortMemory{2048};
+  bool streaming{false};
+  // when streaming, the longest (in ms) a parsed read waits to be mapped
+  uint32_t streamLatency{100};
 };
 
 
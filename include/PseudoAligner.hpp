@@ -0,0 +1,231 @@
+#ifndef __PSEUDO_ALIGNER_HPP__
+#define __PSEUDO_ALIGNER_HPP__
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__SSSE3__)
+#include <immintrin.h>
+#endif
+
+#include "CanonicalKmer.hpp"
+#include "EncodedRead.hpp"
+#include "ReadKmerTable.hpp"
+#include "Util.hpp"
+
+namespace pufferfish {
+
+namespace setops {
+
+#if defined(__SSSE3__)
+// For each 4-bit mask of matching lanes, the byte shuffle that packs the
+// matching 32-bit lanes to the front
+struct LaneShuffles {
+  __m128i masks[16];
+  LaneShuffles() {
+    for (int m = 0; m < 16; ++m) {
+      alignas(16) uint8_t b[16];
+      std::fill(b, b + 16, 0x80);
+      int out{0};
+      for (int lane = 0; lane < 4; ++lane) {
+        if (m & (1 << lane)) {
+          for (int j = 0; j < 4; ++j) { b[4 * out + j] = static_cast<uint8_t>(4 * lane + j); }
+          ++out;
+        }
+      }
+      masks[m] = _mm_load_si128(reinterpret_cast<const __m128i*>(b));
+    }
+  }
+};
+#endif
+
+/**
+ * out = [a, a + na) intersected with [b, b + nb); both inputs are sorted
+ * and free of duplicates (as the equivalence class labels are).  With
+ * SSSE3, blocks of 4 elements of each input are compared all-against-all
+ * (4 rotations of one block) and the matches are packed with a byte
+ * shuffle, as in Lemire et al.'s "SIMD compression and the intersection
+ * of sorted integers"; the tails are merged one element at a time.
+ **/
+inline void intersect(const uint32_t* a, size_t na, const uint32_t* b, size_t nb,
+                      std::vector<uint32_t>& out) {
+  // the vector loop stores 4 lanes at a time, so leave room for them
+  out.resize(std::min(na, nb) + 4);
+  uint32_t* c = out.data();
+  size_t n{0}, i{0}, j{0};
+#if defined(__SSSE3__)
+  static const LaneShuffles shuffles;
+  size_t na4 = na & ~static_cast<size_t>(3);
+  size_t nb4 = nb & ~static_cast<size_t>(3);
+  while (i < na4 and j < nb4) {
+    __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+    __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + j));
+    __m128i cmp = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi32(va, vb),
+                     _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1)))),
+        _mm_or_si128(_mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2))),
+                     _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3)))));
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(cmp));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(c + n), _mm_shuffle_epi8(va, shuffles.masks[mask]));
+    n += __builtin_popcount(mask);
+    uint32_t aMax = a[i + 3];
+    uint32_t bMax = b[j + 3];
+    if (aMax <= bMax) { i += 4; }
+    if (bMax <= aMax) { j += 4; }
+  }
+#endif
+  while (i < na and j < nb) {
+    if (a[i] < b[j]) {
+      ++i;
+    } else if (b[j] < a[i]) {
+      ++j;
+    } else {
+      c[n++] = a[i];
+      ++i;
+      ++j;
+    }
+  }
+  out.resize(n);
+}
+
+} // namespace setops
+
+/**
+ * Pseudoalignment (--pseudo): the set of references a read (pair) is
+ * compatible with, i.e. the intersection of the equivalence class labels
+ * of the contigs its k-mers hit, without projecting any hit to reference
+ * positions.
+ *
+ * Once a k-mer hits a contig, we jump straight to the last read k-mer
+ * that could still lie on that contig and only step through the k-mers
+ * in between if that one isn't on it.  The labels are intersected
+ * smallest first, so the running set is small from the start; since many
+ * reads hit the same few pairs of classes, the intersection of the two
+ * smallest is cached (one cache per worker).
+ **/
+template <typename PufferfishIndexT>
+class PseudoAligner {
+public:
+  explicit PseudoAligner(PufferfishIndexT* pfi, size_t cacheCapacity = 1 << 16)
+      : pfi_(pfi), cacheCapacity_(cacheCapacity) {}
+
+  // label gets the (sorted) references compatible with read; returns
+  // false if none of its k-mers is in the index
+  bool operator()(const EncodedRead& read, util::QueryCache& qc, std::vector<uint32_t>& label) {
+    eqIDs_.clear();
+    collectClasses_(read, qc);
+    return intersectClasses_(label);
+  }
+
+  // The same for a read pair: the references compatible with both ends
+  // (or with the only end that hits the index)
+  bool operator()(const EncodedRead& left, const EncodedRead& right,
+                  util::QueryCache& qc, std::vector<uint32_t>& label) {
+    eqIDs_.clear();
+    collectClasses_(left, qc);
+    collectClasses_(right, qc);
+    return intersectClasses_(label);
+  }
+
+  size_t cacheHits() const { return cacheHits_; }
+
+private:
+  // append the classes of the contigs hit by the k-mers of read to eqIDs_
+  void collectClasses_(const EncodedRead& read, util::QueryCache& qc) {
+    uint32_t k = pfi_->k();
+    CanonicalKmer::k(k);
+    kmerTable_.fill(read, k);
+    auto kmersEnd = kmerTable_.end();
+    int32_t kpos = kmerTable_.nextValid(0);
+    CanonicalKmer kmer;
+    uint32_t lastContig = std::numeric_limits<uint32_t>::max();
+    // the contig on which a jump already failed (so we step along it)
+    uint32_t steppingOn = std::numeric_limits<uint32_t>::max();
+    while (kpos < kmersEnd) {
+      kmerTable_.getKmer(kpos, kmer);
+      auto phits = pfi_->getRefPos(kmer, qc);
+      if (phits.empty()) {
+        kpos = kmerTable_.advance(kpos, 1);
+        continue;
+      }
+      uint32_t cid = phits.contigID();
+      if (cid != lastContig) {
+        eqIDs_.push_back(pfi_->getEqClassID(cid));
+        lastContig = cid;
+      }
+      // how many more read k-mers can be on this contig
+      int32_t ahead = phits.contigOrientation_
+                        ? static_cast<int32_t>(phits.contigLen_ - k - phits.contigPos_)
+                        : static_cast<int32_t>(phits.contigPos_);
+      int32_t target = std::min(kpos + ahead, kmersEnd - 1);
+      if (cid != steppingOn and target > kpos and kmerTable_.isValid(target)) {
+        kmerTable_.getKmer(target, kmer);
+        auto thits = pfi_->getRefPos(kmer, qc);
+        if (!thits.empty() and thits.contigID() == cid) {
+          kpos = kmerTable_.advance(target, 1);
+          continue;
+        }
+        steppingOn = cid;
+      }
+      kpos = kmerTable_.advance(kpos, 1);
+    }
+  }
+
+  bool intersectClasses_(std::vector<uint32_t>& label) {
+    label.clear();
+    if (eqIDs_.empty()) { return false; }
+    std::sort(eqIDs_.begin(), eqIDs_.end());
+    eqIDs_.erase(std::unique(eqIDs_.begin(), eqIDs_.end()), eqIDs_.end());
+    if (eqIDs_.size() == 1) {
+      auto& l = labelOf_(eqIDs_.front());
+      label.assign(l.begin(), l.end());
+      return true;
+    }
+    // the smallest labels first (ties by class id, so that the cache key
+    // below doesn't depend on the order of the hits)
+    std::sort(eqIDs_.begin(), eqIDs_.end(), [this](uint32_t a, uint32_t b) {
+        auto sa = labelOf_(a).size();
+        auto sb = labelOf_(b).size();
+        return sa != sb ? sa < sb : a < b;
+      });
+    // the first pair comes from the cache when we can
+    uint64_t key = (static_cast<uint64_t>(std::min(eqIDs_[0], eqIDs_[1])) << 32) |
+                   std::max(eqIDs_[0], eqIDs_[1]);
+    auto it = pairCache_.find(key);
+    if (it != pairCache_.end()) {
+      ++cacheHits_;
+      label = it->second;
+    } else {
+      auto& l1 = labelOf_(eqIDs_[0]);
+      auto& l2 = labelOf_(eqIDs_[1]);
+      setops::intersect(l1.data(), l1.size(), l2.data(), l2.size(), label);
+      if (pairCache_.size() >= cacheCapacity_) { pairCache_.clear(); }
+      pairCache_.emplace(key, label);
+    }
+    for (size_t i = 2; i < eqIDs_.size() and !label.empty(); ++i) {
+      auto& l = labelOf_(eqIDs_[i]);
+      setops::intersect(label.data(), label.size(), l.data(), l.size(), tmp_);
+      label.swap(tmp_);
+    }
+    return true;
+  }
+
+  inline const std::vector<uint32_t>& labelOf_(uint32_t eqID) {
+    return pfi_->getEqLabel(eqID);
+  }
+
+  PufferfishIndexT* pfi_;
+  ReadKmerTable kmerTable_;
+  std::vector<uint32_t> eqIDs_;
+  std::vector<uint32_t> tmp_;
+  std::unordered_map<uint64_t, std::vector<uint32_t>> pairCache_;
+  size_t cacheCapacity_;
+  size_t cacheHits_{0};
+};
+
+} // namespace pufferfish
+
+#endif // __PSEUDO_ALIGNER_HPP__
@@ -37,6 +37,15 @@ private:
   sdsl::bit_vector::select_1_type contigSelect_;
   sdsl::int_vector<2> seq_;
   sdsl::int_vector<8> edge_;
+  // optional CSR table of the contig across each edge (see getNeighbor)
+  sdsl::int_vector<> nbrOffsets_;
+  sdsl::int_vector<> nbrs_;
+  // optional 2-bit packed reference sequences, and the offset of each one
+  sdsl::int_vector<2> refSeq_;
+  std::vector<uint64_t> refAccumLengths_;
+  // the [start, end) offsets of the runs of non-ACGT bases in refSeq_,
+  // flattened and sorted
+  std::vector<uint64_t> refNRuns_;
   //sdsl::int_vector<8> revedge_;
   sdsl::int_vector<> pos_;
   std::unique_ptr<boophf_t> hash_{nullptr};
@@ -58,6 +67,9 @@ public:
   // the contig).
   const EqClassLabel& getEqClassLabel(uint32_t contigID);
 
+  // Get the label of the equivalence class with the given ID.
+  const EqClassLabel& getEqLabel(EqClassID eqID) { return eqLabels_[eqID]; }
+
   // Get the k value with which this index was built.
   uint32_t k();
   // Get the list of reference sequences & positiosn corresponding to a contig
@@ -103,6 +115,25 @@ public:
   //sdsl::int_vector<8>& getRevEdge() {return revedge_;}
 
   uint8_t getEdgeEntry(uint64_t contigRank) {return edge_[contigRank];}
+
+  // Returns true if the index was built with the contig neighbor table
+  bool hasNeighborTable() const { return nbrOffsets_.size() > 0; }
+  // Returns the contig across edge `bit` of contig contigRank (bits as in
+  // getEdgeEntry, which must have that bit set) as
+  // (contig rank << 1) | (whether it has the same orientation); only valid
+  // if hasNeighborTable()
+  uint64_t getNeighbor(uint64_t contigRank, uint32_t bit) {
+    uint32_t below = static_cast<uint32_t>(edge_[contigRank]) & ((1u << bit) - 1);
+    return nbrs_[nbrOffsets_[contigRank] + __builtin_popcount(below)];
+  }
+
+  // Returns true if the index was built with the reference sequences
+  bool hasRefSeq() const { return !refAccumLengths_.empty(); }
+  // Appends to out the len bases of reference tid starting at start,
+  // reverse-complemented if isFw is false.  Returns false (leaving out
+  // as it was) if the window does not lie within the reference, if it
+  // overlaps a run of non-ACGT bases, or if !hasRefSeq()
+  bool getRefWindow(uint32_t tid, uint64_t start, uint32_t len, bool isFw, std::string& out);
   std::vector<CanonicalKmer> getNextKmerOnGraph(uint64_t cid, util::Direction dir, bool isCurContigFwd);
 
   //uint8_t getRevEdgeEntry(uint64_t contigRank) {return revedge_[contigRank];}
@@ -0,0 +1,229 @@
+#ifndef __READ_KMER_TABLE_HPP__
+#define __READ_KMER_TABLE_HPP__
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__AVX2__) || defined(__SSSE3__)
+#include <immintrin.h>
+#endif
+
+#include "CanonicalKmer.hpp"
+#include "EncodedRead.hpp"
+
+namespace pufferfish {
+
+/**
+ * All of the k-mers of a read, computed in bulk.
+ *
+ * Rather than rolling a CanonicalKmer one character at a time (and
+ * rescanning k characters after every jump), fill() packs both strands of
+ * an EncodedRead 2 bits per base and then extracts every forward and
+ * reverse-complement k-mer word with a handful of vector shifts: with
+ * AVX2, four consecutive k-mers share the same source bytes and differ
+ * only in their shift, so they come out of a single broadcast load;
+ * with SSE4.1 we do two k-mers per instruction; otherwise we fall back to
+ * the same computation one word at a time.
+ *
+ * The words use the same layout as CanonicalKmer (first base in the low
+ * bits of the forward word), so getKmer() produces exactly the k-mer the
+ * iterator would have built at that position.  Validity (i.e. no N in the
+ * k-mer) and "next valid position" queries are O(1) via the last N seen
+ * at or before each read position.
+ *
+ * Buffers are kept across calls to fill(), so one table per worker does
+ * not allocate in steady state.
+ **/
+class ReadKmerTable {
+public:
+  void fill(const EncodedRead& read, uint32_t k) {
+    k_ = static_cast<int32_t>(k);
+    len_ = static_cast<int32_t>(read.length());
+    numKmers_ = (len_ >= k_) ? (len_ - k_ + 1) : 0;
+    mask_ = (k_ >= 32) ? ~0ULL : ((1ULL << (2 * k_)) - 1);
+    hasN_ = read.hasN();
+    if (numKmers_ == 0) {
+      return;
+    }
+
+    pack_(read.fw(), packedFw_);
+    pack_(read.rc(), packedRc_);
+    // round up so that the vector loops never write past the end
+    size_t nwords = (static_cast<size_t>(numKmers_) + 7) & ~static_cast<size_t>(7);
+    fw_.resize(nwords);
+    rcWin_.resize(nwords);
+    extractWords_(packedFw_, fw_.data());
+    extractWords_(packedRc_, rcWin_.data());
+
+    if (hasN_) {
+      lastN_.resize(len_);
+      int32_t last{-1};
+      for (int32_t j = 0; j < len_; ++j) {
+        if (read.isN(j)) {
+          last = j;
+        }
+        lastN_[j] = last;
+      }
+    }
+  }
+
+  inline int32_t numKmers() const { return numKmers_; }
+  inline int32_t end() const { return numKmers_; }
+
+  // true if the k-mer starting at read position i contains no N
+  inline bool isValid(int32_t i) const {
+    return i >= 0 and i < numKmers_ and (!hasN_ or lastN_[i + k_ - 1] < i);
+  }
+
+  // The first position >= i holding a valid k-mer, or end() if there is none.
+  inline int32_t nextValid(int32_t i) const {
+    if (i < 0) {
+      i = 0;
+    }
+    if (!hasN_) {
+      return (i < numKmers_) ? i : numKmers_;
+    }
+    while (i < numKmers_) {
+      auto ln = lastN_[i + k_ - 1];
+      if (ln < i) {
+        return i;
+      }
+      i = ln + 1;
+    }
+    return numKmers_;
+  }
+
+  // Advance from the valid position i over `n` valid k-mers
+  // (the equivalent of `kit += n` on a CanonicalKmerIterator).
+  inline int32_t advance(int32_t i, uint32_t n) const {
+    if (!hasN_) {
+      i += static_cast<int32_t>(n);
+      return (i < numKmers_) ? i : numKmers_;
+    }
+    while (n > 0 and i < numKmers_) {
+      i = nextValid(i + 1);
+      --n;
+    }
+    return i;
+  }
+
+  inline uint64_t fwWord(int32_t i) const { return fw_[i]; }
+  inline uint64_t rcWord(int32_t i) const { return rcWin_[numKmers_ - 1 - i]; }
+  inline uint64_t canonicalWord(int32_t i) const {
+    auto f = fwWord(i);
+    auto r = rcWord(i);
+    return (f < r) ? f : r;
+  }
+  inline bool isFwCanonical(int32_t i) const { return fwWord(i) < rcWord(i); }
+
+  inline void getKmer(int32_t i, CanonicalKmer& km) const {
+    km.fromWords(fwWord(i), rcWord(i));
+  }
+
+private:
+  // Pack one code per byte into 2 bits per base (base j at bit 2*(j%4) of
+  // byte j/4).  N (code 4) is packed as A; k-mers covering it are reported
+  // as invalid anyway.  The output is padded so that 64-bit loads starting
+  // at any k-mer's first byte, and the byte 8 after it, stay in bounds.
+  inline void pack_(const uint8_t* codes, std::vector<uint64_t>& packed) {
+    size_t nbytes = (static_cast<size_t>(len_) + 3) / 4;
+    packed.assign((nbytes + 7) / 8 + 3, 0);
+    uint8_t* out = reinterpret_cast<uint8_t*>(packed.data());
+    int32_t j = 0;
+#if defined(__SSSE3__)
+    // 16 codes -> 4 bytes: c0 + 4c1 (maddubs), then + 16(c2 + 4c3) (madd),
+    // then gather the low byte of each 32-bit lane.
+    const __m128i three = _mm_set1_epi8(0x3);
+    const __m128i w1 = _mm_set1_epi16(0x0401);
+    const __m128i w2 = _mm_set1_epi32(0x00100001);
+    const __m128i gather = _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1,
+                                         -1, -1, -1, -1, -1, -1, -1, -1);
+    for (; j + 16 <= len_; j += 16) {
+      __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(codes + j));
+      c = _mm_and_si128(c, three);
+      __m128i pairs = _mm_maddubs_epi16(c, w1);
+      __m128i quads = _mm_madd_epi16(pairs, w2);
+      __m128i bytes = _mm_shuffle_epi8(quads, gather);
+      uint32_t v = static_cast<uint32_t>(_mm_cvtsi128_si32(bytes));
+      std::memcpy(out + (j >> 2), &v, sizeof(v));
+    }
+#endif
+    for (; j < len_; ++j) {
+      out[j >> 2] |= static_cast<uint8_t>((codes[j] & 0x3) << (2 * (j & 0x3)));
+    }
+  }
+
+  static inline uint64_t load64_(const uint8_t* p) {
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+  }
+
+  // out[i] = the 2k bits of the packed sequence starting at base i, for all
+  // i < numKmers_ (and possibly a few more, into the padding).
+  inline void extractWords_(const std::vector<uint64_t>& packed, uint64_t* out) const {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(packed.data());
+    int32_t i = 0;
+#if defined(__AVX2__)
+    // positions i..i+3 (i % 4 == 0) all start in byte i/4 at bit offsets
+    // 0, 2, 4, 6.  A left shift by 64 yields 0, which is what we want for
+    // the lane that needs no bits from the next word.
+    const __m256i shr = _mm256_setr_epi64x(0, 2, 4, 6);
+    const __m256i shl = _mm256_setr_epi64x(64, 62, 60, 58);
+    const __m256i mask = _mm256_set1_epi64x(static_cast<long long>(mask_));
+    for (; i < numKmers_; i += 4) {
+      const uint8_t* b = p + (i >> 2);
+      __m256i lo = _mm256_set1_epi64x(static_cast<long long>(load64_(b)));
+      __m256i hi = _mm256_set1_epi64x(static_cast<long long>(load64_(b + 8)));
+      __m256i w = _mm256_or_si256(_mm256_srlv_epi64(lo, shr), _mm256_sllv_epi64(hi, shl));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_and_si256(w, mask));
+    }
+#elif defined(__SSE4_1__)
+    // positions i+t and i+4+t (i % 8 == 0) start in bytes i/4 and i/4+1 at
+    // the same bit offset 2t, so they can share a (uniform) shift.
+    const __m128i mask = _mm_set1_epi64x(static_cast<long long>(mask_));
+    for (; i < numKmers_; i += 8) {
+      const uint8_t* b = p + (i >> 2);
+      __m128i lo = _mm_set_epi64x(static_cast<long long>(load64_(b + 1)),
+                                  static_cast<long long>(load64_(b)));
+      __m128i hi = _mm_set_epi64x(static_cast<long long>(load64_(b + 9)),
+                                  static_cast<long long>(load64_(b + 8)));
+      for (int t = 0; t < 4; ++t) {
+        __m128i w = _mm_or_si128(_mm_srl_epi64(lo, _mm_cvtsi32_si128(2 * t)),
+                                 _mm_sll_epi64(hi, _mm_cvtsi32_si128(64 - 2 * t)));
+        w = _mm_and_si128(w, mask);
+        out[i + t] = static_cast<uint64_t>(_mm_cvtsi128_si64(w));
+        out[i + 4 + t] = static_cast<uint64_t>(_mm_extract_epi64(w, 1));
+      }
+    }
+#endif
+    for (; i < numKmers_; ++i) {
+      const uint8_t* b = p + (i >> 2);
+      uint32_t s = 2 * (i & 0x3);
+      uint64_t w = load64_(b) >> s;
+      if (s > 0) {
+        w |= load64_(b + 8) << (64 - s);
+      }
+      out[i] = w & mask_;
+    }
+  }
+
+  int32_t k_{0};
+  int32_t len_{0};
+  int32_t numKmers_{0};
+  uint64_t mask_{0};
+  bool hasN_{false};
+  std::vector<uint64_t> packedFw_;
+  std::vector<uint64_t> packedRc_;
+  std::vector<uint64_t> fw_;
+  // rcWin_[m] is the forward word of the reverse-complemented read at
+  // position m; the rc word of the k-mer at read position i is
+  // rcWin_[numKmers_ - 1 - i].
+  std::vector<uint64_t> rcWin_;
+  std::vector<int32_t> lastN_;
+};
+
+} // namespace pufferfish
+
+#endif // __READ_KMER_TABLE_HPP__
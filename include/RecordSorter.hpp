@@ -0,0 +1,93 @@
+#ifndef __RECORD_SORTER_HPP__
+#define __RECORD_SORTER_HPP__
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "spdlog/fmt/fmt.h"
+
+#include "OutputWriter.hpp"
+
+namespace pufferfish {
+
+/**
+ * Sorts the alignment records of a run by (reference id, position) while
+ * the reads are being mapped.
+ *
+ * Records are BAM alignment records (as written by BAMWriter).  Each
+ * mapping thread appends its records to its own Run; once a run holds
+ * more than its share of the memory budget, the thread that owns it sorts
+ * it and spills it to a temporary file, so runs are sorted in parallel and
+ * without locking.  When mapping is done, merge() does a k-way merge of
+ * the spilled runs and of what is left in memory, and hands the records in
+ * order to the caller, which formats them (as SAM or BAM) for the
+ * OutputWriter.  Unmapped records (reference id -1) go last.
+ **/
+class RecordSorter {
+public:
+  using Key = std::pair<uint64_t, uint64_t>;
+
+  class Run {
+  public:
+    // Move the records of buf into this run (buf is cleared)
+    void add(fmt::MemoryWriter& buf);
+
+  private:
+    friend class RecordSorter;
+    Run(RecordSorter* sorter, size_t id) : sorter_(sorter), id_(id) {}
+    // sort the records in memory, by key and then by arrival
+    void sort_();
+    void spill_();
+
+    RecordSorter* sorter_;
+    size_t id_;
+    std::vector<char> data_;
+    // (sort key, offset of the record in data_)
+    std::vector<Key> index_;
+    std::vector<std::string> spills_;
+  };
+
+  // Temporary files are named tmpPrefix.<run>.<spill>; memBudget (in bytes)
+  // is shared by the numRuns runs
+  RecordSorter(const std::string& tmpPrefix, size_t memBudget, uint32_t numRuns);
+  ~RecordSorter();
+
+  RecordSorter(const RecordSorter&) = delete;
+  RecordSorter& operator=(const RecordSorter&) = delete;
+
+  // A run for the calling (mapping) thread; each thread should take one
+  Run* nextRun();
+
+  // Pass every record (BAM record, starting with its block size) to emit,
+  // in order, formatting into a buffer of out.  Returns false if a
+  // temporary file could not be written or read back.
+  bool merge(OutputWriter& out,
+             const std::function<void(const char*, size_t, fmt::MemoryWriter&)>& emit);
+
+  static inline uint64_t key(const char* rec) {
+    int32_t refID, pos;
+    std::memcpy(&refID, rec + 4, sizeof(refID));
+    std::memcpy(&pos, rec + 8, sizeof(pos));
+    // refID -1 (unmapped) becomes the largest id, pos -1 the smallest position
+    return (static_cast<uint64_t>(static_cast<uint32_t>(refID)) << 32) |
+           static_cast<uint32_t>(pos + 1);
+  }
+
+private:
+  std::string tmpPrefix_;
+  size_t runBudget_;
+  std::vector<std::unique_ptr<Run>> runs_;
+  std::atomic<uint32_t> nextRun_{0};
+  std::atomic<bool> failed_{false};
+};
+
+} // namespace pufferfish
+
+#endif // __RECORD_SORTER_HPP__
@@ -35,11 +35,31 @@ struct strInfo {
 };
 
 
+/**
+ * Spells out the reference sequence between (or next to) uni-MEMs by walking
+ * the contigs of the de Bruijn graph along reference tid.
+ *
+ * The walk is a depth-first search with an explicit stack; each level of the
+ * stack only remembers how long the output was when it was entered, so
+ * backtracking is a truncation.  Sequence is appended to the output directly
+ * from the cached contigs (reverse-complementing on the fly), and the
+ * successors / predecessors of a contig are resolved through the index only
+ * the first time they are needed.  All scratch space is kept across calls,
+ * so one instance per worker thread does not allocate in steady state.
+ **/
 template <typename PufferfishIndexT>
 class RefSeqConstructor {
 
 public:
   RefSeqConstructor(PufferfishIndexT* pfi, spp::sparse_hash_map<uint32_t, util::ContigBlock>* contigSeqCache);
+  /**
+   * Append to refSeq the txpDist bases of reference tid that follow position
+   * tpos (i.e. that lie in (tpos, tpos + txpDist]).  startp is the position
+   * in curContig of the base at tpos, and endp that in endContig of the base
+   * at tpos + txpDist + 1.  Either contig may be a dummy, for the overhangs
+   * before the first and after the last uni-MEM of a read.  If the index
+   * stores the reference sequences, they are read from there instead.
+   **/
   Task fillSeq(size_t tid,
                size_t tpos,
                                                bool isCurContigFw,
@@ -97,28 +117,53 @@ private:
 
 
 
+  // one level of the depth-first search
+  struct DFSFrame {
+    // length of the output before this level's contig was appended
+    size_t seqLen;
+    // this level's candidates for the next contig, in children_
+    size_t childBegin;
+    size_t childNext;
+    size_t childEnd;
+    // bases still to be fetched after this level's contig
+    uint32_t txpDist;
+  };
+
   size_t remainingLen(util::ContigBlock& contig, size_t startp, bool isCurContigFw, bool fromTheEnd, bool verbose=false);
   void append(std::string& seq, util::ContigBlock& contig, size_t startp, size_t endp, bool isCurContigFw, bool verbose=false);
   void appendByLen(std::string& refSeq, util::ContigBlock& contig, size_t startp, size_t len, bool isCurContigFw, bool appendSuffix, bool verbose=false);
-  //TODO 
-  //void prependByLen(std::string& seq, util::ContigBlock& contig, size_t startp, size_t len, bool isCurContigFw, bool appendSuffix);
-  std::string getRemSeq(util::ContigBlock& contig, size_t len, bool isCurContigFw, bool appendSuffix, bool verbose=false);
-  void cutoff(std::string& seq, size_t len, bool verbose=false);
-  std::string rc(std::string str, bool verbose=false);
+  // append contig[pos, pos + len), reverse complemented if !isFw
+  void appendRange(std::string& seq, util::ContigBlock& contig, size_t pos, size_t len, bool isFw);
+  // the i-th of the len bases at the end (if fromTheEnd) or the start of the
+  // contig, in reference orientation
+  char remBase(util::ContigBlock& contig, size_t len, bool isCurContigFw, bool fromTheEnd, size_t i);
+  bool sameRemSeq(util::ContigBlock& contig1, bool isContig1Fw, bool fromTheEnd1,
+                  util::ContigBlock& contig2, bool isContig2Fw, bool fromTheEnd2,
+                  size_t len);
   char rev(const char& c);
-  std::vector<nextCompatibleStruct> fetchSuccessors(util::ContigBlock& contig,
-                                                 bool isCurContigFw,
-                                                 size_t tid,
-                                                    size_t tpos,
-                                                    uint32_t txpDist,
-                                                    bool verbose=false);
-
-  std::vector<nextCompatibleStruct> fetchPredecessors(util::ContigBlock& contig,
-                                                    bool isCurContigFw,
-                                                    size_t tid,
-                                                        size_t tpos,
-                                                      uint32_t txpDist,
-                                                      bool verbose=false);
+  // push onto children_ the contigs that follow (or precede) contig on tid,
+  // whose last (or first) base is at tpos
+  void fetchNext(util::ContigBlock& contig,
+                 bool isCurContigFw,
+                 size_t tid,
+                 size_t tpos,
+                 SearchType searchType,
+                 bool verbose=false);
+  // push onto children_ contig nid (of length clen) if one of its
+  // occurrences refs on tid is next to tpos
+  template <typename PosRangeT>
+  void pushIfNext(uint64_t nid, uint32_t clen, PosRangeT& refs,
+                  size_t tid, size_t tpos, SearchType searchType);
+
+  std::vector<DFSFrame> frames_;
+  std::vector<nextCompatibleStruct> children_;
+  // the backward walk is built reverse complemented, then flipped into the output
+  std::string revSeq_;
+  // the index hit of the k-mer one edge away from a contig, keyed on
+  // (contig id, edge bit); it is emptied whenever it reaches
+  // maxCachedNextHits entries, so it can't grow with the size of the graph
+  static constexpr size_t maxCachedNextHits = 1 << 16;
+  spp::sparse_hash_map<uint64_t, util::ProjectedHits> nextHitCache_;
 };
 
 #endif
@@ -5,6 +5,24 @@
 #include "PufferfishSparseIndex.hpp"
 #include "Util.hpp"
 
+// Write a read name or sequence (which may be a view into a read chunk);
+// a template so that string literals don't convert to views
+template <typename Traits>
+inline fmt::Writer& operator<<(fmt::Writer& out, stx::basic_string_view<char, Traits> s) {
+  return out << fmt::StringRef(s.data(), s.size());
+}
+
+// The part of a read name to print: up to its first space, and without a
+// trailing /1 or /2
+inline stx::string_view trimReadName(stx::string_view readName) {
+  size_t splitPos = readName.find(' ');
+  if (splitPos < readName.length()) { readName = readName.substr(0, splitPos); }
+  if (readName.length() > 2 and readName[readName.length() - 2] == '/') {
+    readName.remove_suffix(2);
+  }
+  return readName;
+}
+
 inline void getSamFlags(const util::QuasiAlignment& qaln, uint16_t& flags) {
   /*
     constexpr uint16_t pairedInSeq = 0x1;
@@ -80,23 +98,19 @@ inline void getSamFlags(const util::QuasiAlignment& qaln, bool peInput,
 }
 
 template <typename IndexT>
-inline void writeKrakOutHeader(IndexT& pfi, std::shared_ptr<spdlog::logger> out, AlignmentOpts* mopts) {
-  fmt::MemoryWriter hd;
+inline void writeKrakOutHeader(IndexT& pfi, fmt::MemoryWriter& hd, AlignmentOpts* mopts) {
   hd.write("#\t");
   if (mopts->singleEnd) {
     hd.write("LT:S");
   } else {
     hd.write("LT:P");
   }
-  hd.write("\tNT:{}", pfi.getRefLengths().size());
-  std::string headerStr(hd.str());
-  out->info(headerStr);
+  hd.write("\tNT:{}\n", pfi.getRefLengths().size());
 }
 
 template <typename IndexT>
-inline void writeSAMHeader(IndexT& pfi, std::shared_ptr<spdlog::logger> out) {
-  fmt::MemoryWriter hd;
-  hd.write("@HD\tVN:1.0\tSO:unknown\n");
+inline void writeSAMHeader(IndexT& pfi, fmt::MemoryWriter& hd, bool sorted = false) {
+  hd.write("@HD\tVN:1.0\tSO:{}\n", sorted ? "coordinate" : "unknown");
 
   auto& txpNames = pfi.getRefNames();
   auto& txpLens = pfi.getRefLengths();
@@ -113,10 +127,6 @@ inline void writeSAMHeader(IndexT& pfi, std::shared_ptr<spdlog::logger> out) {
   // will think about it later
   std::string version = "0.1.0";
   hd.write("@PG\tID:rapmap\tPN:rapmap\tVN:{}\n", version);
-  std::string headerStr(hd.str());
-  // Don't include the last '\n', since the logger will do it for us.
-  headerStr.pop_back();
-  out->info(headerStr);
 }
 
 // Declarations for functions dealing with SAM formatting and output
@@ -146,6 +156,22 @@ inline void adjustOverhang(int32_t& pos, uint32_t readLen, uint32_t txpLen,
   }
 }
 
+// Write a packed CIGAR as text, merging adjacent operations of the same
+// kind (and dropping empty ones); an empty CIGAR is written as '*'.
+inline void writeCigar(const util::PackedCigar& cigar, fmt::Writer& out) {
+  if (cigar.empty()) {
+    out << '*';
+    return;
+  }
+  const uint32_t* op = cigar.begin();
+  while (op != cigar.end()) {
+    uint32_t code = *op & 0xf;
+    uint32_t len{0};
+    for (; op != cigar.end() and (*op & 0xf) == code; ++op) { len += *op >> 4; }
+    if (len > 0) { out << len << "MID"[code]; }
+  }
+}
+
 inline void adjustOverhang(util::QuasiAlignment& qa, uint32_t txpLen,
                            util::FixedWriter& cigarStr1,
                            util::FixedWriter& cigarStr2) {
@@ -172,21 +198,10 @@ inline uint32_t writeAlignmentsToKrakenDump(ReadT& r,
                                    PairedAlignmentFormatter<IndexT>& formatter,
                                    std::vector<util::JointMems>& validJointHits,
                                    fmt::MemoryWriter& sstream) {
-  auto& readName = r.first.name;
-  // If the read name contains multiple space-separated parts,
-  // print only the first
-  size_t splitPos = readName.find(' ');
-  if (splitPos < readName.length()) {
-    readName[splitPos] = '\0';
-  } else {
-    splitPos = readName.length();
-  }
-  
-  if (splitPos > 2 and readName[splitPos - 2] == '/') {
-    readName[splitPos - 2] = '\0';
-  }
+  // print only the first space-separated part of the name
+  auto readName = trimReadName(r.first.name);
 
-  sstream << readName.c_str() << "\t" << validJointHits.size() << "\t" << r.first.seq.length() << "\t" << r.second.seq.length() << "\n";
+  sstream << readName << "\t" << validJointHits.size() << "\t" << r.first.seq.length() << "\t" << r.second.seq.length() << "\n";
 
   for (auto& qa : validJointHits) {
     auto& refName = formatter.index->refName(qa.tid);
@@ -209,19 +224,8 @@ inline uint32_t writeAlignmentsToKrakenDump(ReadT& r,
                                    PairedAlignmentFormatter<IndexT>& formatter,
                                    std::vector<std::pair<uint32_t, std::vector<util::MemCluster>::iterator>>& validHits,
                                    fmt::MemoryWriter& sstream) {
-  auto& readName = r.name;
-  // If the read name contains multiple space-separated parts,
-  // print only the first
-  size_t splitPos = readName.find(' ');
-  if (splitPos < readName.length()) {
-    readName[splitPos] = '\0';
-  } else {
-    splitPos = readName.length();
-  } 
-  
-  if (splitPos > 2 and readName[splitPos - 2] == '/') {
-    readName[splitPos - 2] = '\0';
-  }
+  // print only the first space-separated part of the name
+  auto readName = trimReadName(r.name);
 
   //uint32_t readLength{static_cast<uint32_t>(r.seq.length())};
   //uint32_t effectiveLen{static_cast<uint32_t>(r.seq.length())};
@@ -259,7 +263,7 @@ inline uint32_t writeAlignmentsToKrakenDump(ReadT& r,
       effReadLens[memIdx] -= readLength-maxIdx;
     } 
   }  */
-  sstream << readName.c_str() << "\t" << validHits.size() << "\t" << r.seq.length() << "\n";
+  sstream << readName << "\t" << validHits.size() << "\t" << r.seq.length() << "\n";
 
   for (auto& qa : validHits) {
     auto& refName = formatter.index->refName(qa.first);
@@ -295,26 +299,14 @@ inline uint32_t writeUnmappedAlignmentsToStreamSingle(
 	//std::cerr << cigarStr1.c_str() << "\n";
 
 	//uint16_t flags1;
-	auto& readName = r.name;
-
-    // If the read name contains multiple space-separated parts,
-    // print only the first
-    size_t splitPos = readName.find(' ');
-    if (splitPos < readName.length()) {
-      readName[splitPos] = '\0';
-    } else {
-      splitPos = readName.length();
-    }
-
-    if (splitPos > 2 and readName[splitPos - 2] == '/') {
-      readName[splitPos - 2] = '\0';
-    }
+	// print only the first space-separated part of the name
+	auto readName = trimReadName(r.name);
 
-    std::string* readSeq1 = &(r.seq);
+    stx::string_view readSeq1 = r.seq;
 
     std::string numHitFlag = fmt::format("NH:i:0", jointHits.size());
 
-    sstream << readName.c_str() << '\t' // QNAME
+    sstream << readName << '\t' // QNAME
             << 4 << '\t'               // FLAGS
             << "*\t"                    // RNAME
             << 0 << '\t'                // POS (1-based)
@@ -324,7 +316,7 @@ inline uint32_t writeUnmappedAlignmentsToStreamSingle(
             << '=' << '\t'       // RNEXT
             << 0 << '\t'         // PNEXT
             << 0 << '\t'         // TLEN
-            << *readSeq1 << '\t' // SEQ
+            << readSeq1 << '\t' // SEQ
             << "*\t"             // QUAL
             << numHitFlag << '\n';
     return 0;
@@ -350,40 +342,17 @@ inline uint32_t writeUnmappedAlignmentsToStream(
 	//std::cerr << cigarStr1.c_str() << "\n";
 	//uint16_t flags1, flags2;
 
-	auto& readName = r.first.name;
-	// If the read name contains multiple space-separated parts,
-	// print only the first
-	size_t splitPos = readName.find(' ');
-	if (splitPos < readName.length()) {
-		readName[splitPos] = '\0';
-	} else {
-		splitPos = readName.length();
-	}
-
-	if (splitPos > 2 and readName[splitPos - 2] == '/') {
-		readName[splitPos - 2] = '\0';
-	}
-
-	auto& mateName = r.second.name;
-	// If the read name contains multiple space-separated parts,
-	// print only the first
-	splitPos = mateName.find(' ');
-	if (splitPos < mateName.length()) {
-		mateName[splitPos] = '\0';
-	} else {
-		splitPos = mateName.length();
-	}
-
-	// trim /2 from the pe read
-	if (splitPos > 2 and mateName[splitPos - 2] == '/') {
-		mateName[splitPos - 2] = '\0';
-	}
-      std::string* readSeq1 = &(r.first.seq);
-      std::string* readSeq2 = &(r.second.seq);
+	// print only the first space-separated part of the name
+	auto readName = trimReadName(r.first.name);
+
+	// print only the first space-separated part of the name
+	auto mateName = trimReadName(r.second.name);
+      stx::string_view readSeq1 = r.first.seq;
+      stx::string_view readSeq2 = r.second.seq;
 
      std::string numHitFlag = fmt::format("NH:i:0", jointHits.size());
 
-      sstream << readName.c_str() << '\t'                    // QNAME
+      sstream << readName << '\t'                    // QNAME
               << 77 << '\t'                              // FLAGS
               << "*\t"                             // RNAME
               << 0 << '\t'                          // POS (1-based)
@@ -393,11 +362,11 @@ inline uint32_t writeUnmappedAlignmentsToStream(
               << '=' << '\t'                                 // RNEXT
               << 0 << '\t'                      // PNEXT
               << 0 << '\t' // TLEN
-              << *readSeq1 << '\t'                           // SEQ
+              << readSeq1 << '\t'                           // SEQ
               << "*\t"                                       // QUAL
               << numHitFlag << '\n';
 
-      sstream << mateName.c_str() << '\t'                    // QNAME
+      sstream << mateName << '\t'                    // QNAME
               << 141 << '\t'                              // FLAGS
               << "*\t"                             // RNAME
               << 0 << '\t'                      // POS (1-based)
@@ -407,7 +376,7 @@ inline uint32_t writeUnmappedAlignmentsToStream(
               << '=' << '\t'                                 // RNEXT
               << 0 << '\t'                          // PNEXT
               << 0 << '\t' // TLEN
-              << *readSeq2 << '\t'                           // SEQ
+              << readSeq2 << '\t'                           // SEQ
               << "*\t"                                       // QUAL
               << numHitFlag << '\n';
 
@@ -434,19 +403,8 @@ inline uint32_t writeAlignmentsToStreamSingle(
   //std::cerr << cigarStr1.c_str() << "\n";
   uint16_t flags1;
 
-  auto& readName = r.name;
-  // If the read name contains multiple space-separated parts,
-  // print only the first
-  size_t splitPos = readName.find(' ');
-  if (splitPos < readName.length()) {
-    readName[splitPos] = '\0';
-  } else {
-    splitPos = readName.length();
-  }
-
-  if (splitPos > 2 and readName[splitPos - 2] == '/') {
-    readName[splitPos - 2] = '\0';
-  }
+  // print only the first space-separated part of the name
+  auto readName = trimReadName(r.name);
 
   std::string numHitFlag = fmt::format("NH:i:{}", jointHits.size());
   uint32_t alnCtr{0};
@@ -469,14 +427,14 @@ inline uint32_t writeAlignmentsToStreamSingle(
 
       // Reverse complement the read and reverse
       // the quality string if we need to
-      std::string* readSeq1 = &(r.seq);
+      stx::string_view readSeq1 = r.seq;
       // std::string* qstr1 = &(r.first.qual);
       if (!qa.fwd) {
         if (!haveRev1) {
-          util::reverseRead(*readSeq1, read1Temp);
+          util::reverseRead(readSeq1, read1Temp);
           haveRev1 = true;
         }
-        readSeq1 = &(read1Temp);
+        readSeq1 = read1Temp;
         // qstr1 = &(qual1Temp);
       }
 
@@ -491,16 +449,17 @@ inline uint32_t writeAlignmentsToStreamSingle(
       // get the fragment length as a signed int
       const int32_t fragLen = static_cast<int32_t>(qa.fragLen);
 
-      sstream << readName.c_str() << '\t'                    // QNAME
+      sstream << readName << '\t'                    // QNAME
               << flags1 << '\t'                              // FLAGS
               << refName << '\t'                             // RNAME
               << qa.pos + 1 << '\t'                          // POS (1-based)
-              << 1 << '\t'                                   // MAPQ
-              << (justMappings ? cigarStr1.c_str() : qa.cigar) << '\t'                   // CIGAR
+              << 1 << '\t';                                  // MAPQ
+      if (justMappings) { sstream << cigarStr1.c_str(); } else { writeCigar(qa.cigar, sstream); } // CIGAR
+      sstream << '\t'
               << '=' << '\t'                                 // RNEXT
               << 0 << '\t'                      // PNEXT
               << ((read1First) ? fragLen : -fragLen) << '\t' // TLEN
-              << *readSeq1 << '\t'                           // SEQ
+              << readSeq1 << '\t'                           // SEQ
               << "*\t"                                       // QUAL
               << numHitFlag << '\n';
 
@@ -528,34 +487,11 @@ inline uint32_t writeAlignmentsToStream(
   //std::cerr << cigarStr1.c_str() << "\n";
   uint16_t flags1, flags2;
 
-  auto& readName = r.first.name;
-  // If the read name contains multiple space-separated parts,
-  // print only the first
-  size_t splitPos = readName.find(' ');
-  if (splitPos < readName.length()) {
-    readName[splitPos] = '\0';
-  } else {
-    splitPos = readName.length();
-  }
-
-  if (splitPos > 2 and readName[splitPos - 2] == '/') {
-    readName[splitPos - 2] = '\0';
-  }
-
-  auto& mateName = r.second.name;
-  // If the read name contains multiple space-separated parts,
-  // print only the first
-  splitPos = mateName.find(' ');
-  if (splitPos < mateName.length()) {
-    mateName[splitPos] = '\0';
-  } else {
-    splitPos = mateName.length();
-  }
+  // print only the first space-separated part of the name
+  auto readName = trimReadName(r.first.name);
 
-  // trim /2 from the pe read
-  if (splitPos > 2 and mateName[splitPos - 2] == '/') {
-    mateName[splitPos - 2] = '\0';
-  }
+  // print only the first space-separated part of the name
+  auto mateName = trimReadName(r.second.name);
 
   std::string numHitFlag = fmt::format("NH:i:{}", jointHits.size());
   uint32_t alnCtr{0};
@@ -582,25 +518,25 @@ inline uint32_t writeAlignmentsToStream(
       adjustOverhang(qa, txpLen, cigarStr1, cigarStr2);
       // Reverse complement the read and reverse
       // the quality string if we need to
-      std::string* readSeq1 = &(r.first.seq);
+      stx::string_view readSeq1 = r.first.seq;
       // std::string* qstr1 = &(r.first.qual);
       if (!qa.fwd) {
         if (!haveRev1) {
-          util::reverseRead(*readSeq1, read1Temp);
+          util::reverseRead(readSeq1, read1Temp);
           haveRev1 = true;
         }
-        readSeq1 = &(read1Temp);
+        readSeq1 = read1Temp;
         // qstr1 = &(qual1Temp);
       }
 
-      std::string* readSeq2 = &(r.second.seq);
+      stx::string_view readSeq2 = r.second.seq;
       // std::string* qstr2 = &(r.second.qual);
       if (!qa.mateIsFwd) {
         if (!haveRev2) {
-          util::reverseRead(*readSeq2, read2Temp);
+          util::reverseRead(readSeq2, read2Temp);
           haveRev2 = true;
         }
-        readSeq2 = &(read2Temp);
+        readSeq2 = read2Temp;
         // qstr2 = &(qual2Temp);
       }
       // If the fragment overhangs the right end of the reference
@@ -616,31 +552,31 @@ inline uint32_t writeAlignmentsToStream(
       // get the fragment length as a signed int
       const int32_t fragLen = static_cast<int32_t>(qa.fragLen);
 
-      sstream << readName.c_str() << '\t'                    // QNAME
+      sstream << readName << '\t'                    // QNAME
               << flags1 << '\t'                              // FLAGS
               << refName << '\t'                             // RNAME
               << qa.pos + 1 << '\t'                          // POS (1-based)
-              << 1 << '\t'                                   // MAPQ
-              << (justMappings ? cigarStr1.c_str() : qa.cigar) << '\t'                   // CIGAR
-              //<< qa.cigar << '\t'                   // CIGAR
+              << 1 << '\t';                                  // MAPQ
+      if (justMappings) { sstream << cigarStr1.c_str(); } else { writeCigar(qa.cigar, sstream); } // CIGAR
+      sstream << '\t'
               << '=' << '\t'                                 // RNEXT
               << qa.matePos + 1 << '\t'                      // PNEXT
               << ((read1First) ? fragLen : -fragLen) << '\t' // TLEN
-              << *readSeq1 << '\t'                           // SEQ
+              << readSeq1 << '\t'                           // SEQ
               << "*\t"                                       // QUAL
               << numHitFlag << '\n';
 
-      sstream << mateName.c_str() << '\t'                    // QNAME
+      sstream << mateName << '\t'                    // QNAME
               << flags2 << '\t'                              // FLAGS
               << refName << '\t'                             // RNAME
               << qa.matePos + 1 << '\t'                      // POS (1-based)
-              << 1 << '\t'                                   // MAPQ
-              << (justMappings ? cigarStr2.c_str() : qa.mateCigar) << '\t'                   // CIGAR
-        //<< qa.mateCigar << '\t'                   // CIGAR
+              << 1 << '\t';                                  // MAPQ
+      if (justMappings) { sstream << cigarStr2.c_str(); } else { writeCigar(qa.mateCigar, sstream); } // CIGAR
+      sstream << '\t'
               << '=' << '\t'                                 // RNEXT
               << qa.pos + 1 << '\t'                          // PNEXT
               << ((read1First) ? -fragLen : fragLen) << '\t' // TLEN
-              << *readSeq2 << '\t'                           // SEQ
+              << readSeq2 << '\t'                           // SEQ
               << "*\t"                                       // QUAL
               << numHitFlag << '\n';
 
@@ -659,13 +595,13 @@ inline uint32_t writeAlignmentsToStream(
       // Reverse complement the read and reverse
       // the quality string if we need to
 
-	  std::string* readSeq{nullptr} ;
-	  std::string* unalignedSeq{nullptr} ;
+	  stx::string_view readSeq ;
+	  stx::string_view unalignedSeq ;
 
 	  uint32_t flags, unalignedFlags ;
 
-	  std::string* alignedName{nullptr} ;
-	  std::string* unalignedName{nullptr} ;
+	  stx::string_view alignedName ;
+	  stx::string_view unalignedName ;
 	  std::string* readTemp{nullptr} ;
 
 	  auto& cigarStr = formatter.cigarStr1;
@@ -674,11 +610,11 @@ inline uint32_t writeAlignmentsToStream(
 
 	  //logic for assigning orphans
 	  if(qa.mateStatus == util::MateStatus::PAIRED_END_LEFT){ //left read
-		alignedName = &readName ;
-		unalignedName = &mateName ;
+		alignedName = readName ;
+		unalignedName = mateName ;
 
-		readSeq = &(r.first.seq) ;
-		unalignedSeq = &(r.second.seq) ;
+		readSeq = r.first.seq ;
+		unalignedSeq = r.second.seq ;
 
 		flags = flags1 ;
 		unalignedFlags = flags2 ;
@@ -686,11 +622,11 @@ inline uint32_t writeAlignmentsToStream(
 		haveRev = &haveRev1 ;
 		readTemp = &read1Temp ;
 	  }else{
-		alignedName = &mateName ;
-		unalignedName = &readName ;
+		alignedName = mateName ;
+		unalignedName = readName ;
 
-		readSeq = &(r.second.seq) ;
-		unalignedSeq = &(r.first.seq) ;
+		readSeq = r.second.seq ;
+		unalignedSeq = r.first.seq ;
 
 		flags = flags2 ;
 		unalignedFlags = flags2 ;
@@ -704,10 +640,10 @@ inline uint32_t writeAlignmentsToStream(
       // std::string* qstr1 = &(r.first.qual);
       if (!qa.fwd) {
         if (!*haveRev) {
-          util::reverseRead(*readSeq, *readTemp);
+          util::reverseRead(readSeq, *readTemp);
           *haveRev = true;
         }
-        readSeq = readTemp;
+        readSeq = *readTemp;
       }
 
       // If the fragment overhangs the right end of the reference
@@ -723,7 +659,7 @@ inline uint32_t writeAlignmentsToStream(
       // get the fragment length as a signed int
       const int32_t fragLen = static_cast<int32_t>(qa.fragLen);
 
-      sstream << alignedName->c_str() << '\t'                    // QNAME
+      sstream << alignedName << '\t'                    // QNAME
               << flags << '\t'                              // FLAGS
               << refName << '\t'                             // RNAME
               << qa.pos + 1 << '\t'                          // POS (1-based)
@@ -732,11 +668,11 @@ inline uint32_t writeAlignmentsToStream(
               << '=' << '\t'                                 // RNEXT
               << qa.matePos + 1 << '\t'                      // PNEXT
               << ((read1First) ? fragLen : -fragLen) << '\t' // TLEN
-              << *readSeq << '\t'                           // SEQ
+              << readSeq << '\t'                           // SEQ
               << "*\t"                                       // QUAL
               << numHitFlag << '\n';
 
-      sstream << unalignedName->c_str() << '\t'                    // QNAME
+      sstream << unalignedName << '\t'                    // QNAME
               << unalignedFlags << '\t'                              // FLAGS
               << refName << '\t'                             // RNAME
               << qa.pos + 1 << '\t'                      // POS (1-based)
@@ -745,7 +681,7 @@ inline uint32_t writeAlignmentsToStream(
               << '=' << '\t'                                 // RNEXT
               << qa.pos + 1 << '\t'                          // PNEXT
               << ((read1First) ? -fragLen : fragLen) << '\t' // TLEN
-              << *unalignedSeq << '\t'                           // SEQ
+              << unalignedSeq << '\t'                           // SEQ
               << "*\t"                                       // QUAL
               << numHitFlag << '\n';
 
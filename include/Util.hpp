@@ -80,7 +80,7 @@ using namespace std;
  // Adapted from
  // https://github.com/mengyao/Complete-Striped-Smith-Waterman-Library/blob/8c9933a1685e0ab50c7d8b7926c9068bc0c9d7d2/src/main.c#L36
  // Don't modify the qual
- inline void reverseRead(std::string& seq,
+ inline void reverseRead(stx::string_view seq,
          std::string& readWork) {
 
      readWork.resize(seq.length(), 'A');
@@ -236,6 +236,38 @@ enum class MateStatus : uint8_t {
     MemInfo(std::vector<UniMemInfo>::iterator uniMemInfoIn, size_t tposIn):memInfo(uniMemInfoIn), tpos(tposIn) {}
   };
 
+  // A CIGAR in KSW2's packed form (length << 4 | op, with op indexing "MID"),
+  // kept as a range of a per-thread arena of operations that is reused for
+  // every read; it only becomes text when the SAM record is written.
+  // Adjacent operations of the same kind are not merged here (see
+  // SAMWriter's writeCigar).
+  struct PackedCigar {
+    std::vector<uint32_t>* ops{nullptr};
+    uint32_t offset{0};
+    uint32_t length{0};
+
+    static inline uint32_t opCode(char op) { return op == 'M' ? 0 : (op == 'I' ? 1 : 2); }
+
+    // start an empty CIGAR at the end of arena
+    void reset(std::vector<uint32_t>& arena) {
+      ops = &arena;
+      offset = static_cast<uint32_t>(arena.size());
+      length = 0;
+    }
+    // the appends below require this to be the last CIGAR of its arena
+    void push(uint32_t len, char op) {
+      ops->push_back((len << 4) | opCode(op));
+      ++length;
+    }
+    void append(const uint32_t* first, const uint32_t* last) {
+      ops->insert(ops->end(), first, last);
+      length += static_cast<uint32_t>(last - first);
+    }
+    const uint32_t* begin() const { return ops ? ops->data() + offset : nullptr; }
+    const uint32_t* end() const { return begin() + length; }
+    bool empty() const { return length == 0; }
+  };
+
   struct MemCluster {
     // second element is the transcript position
     std::vector<MemInfo> mems;
@@ -243,8 +275,8 @@ enum class MateStatus : uint8_t {
     bool isVisited = false;
     uint32_t coverage{0};
     std::vector<std::pair<std::string,std::string>> alignableStrings; //NOTE we don't need it [cigar on the fly]
-    int score ;
-    std::string cigar ;
+    int score{0};
+    PackedCigar cigar ;
     //bool isValid = true;
     MemCluster(bool isFwIn): isFw(isFwIn) {}
     /*MemCluster(bool isFwIn, MemInfo memIn): isFw(isFwIn) {
@@ -326,7 +358,7 @@ struct QuasiAlignment {
 		isPaired(false){}
 
         QuasiAlignment(uint32_t tidIn, int32_t posIn,
-                       bool fwdIn, uint32_t readLenIn, std::string cigarIn, //NOTE can we make it uint32?
+                       bool fwdIn, uint32_t readLenIn, PackedCigar cigarIn,
                 uint32_t fragLenIn = 0,
                 bool isPairedIn = false) :
             tid(tidIn), pos(posIn), fwd(fwdIn),
@@ -388,10 +420,13 @@ struct QuasiAlignment {
         uint32_t mateLen;
         // Is this a paired *alignment* or not
         bool isPaired;
+        // The alignment score (of both mates), or the coverage of the
+        // mapping when alignments aren't validated
+        int32_t alnScore{0};
 
 
-  std::string cigar;
-  std::string mateCigar;
+  PackedCigar cigar;
+  PackedCigar mateCigar;
 
         MateStatus mateStatus;
   bool active = true;
@@ -507,6 +542,10 @@ struct HitCounters {
   std::atomic<uint64_t> totHits{0};
   std::atomic<uint64_t> numReads{0};
   std::atomic<uint64_t> tooManyHits{0};
+  std::atomic<uint64_t> rescuedPairs{0};
+  // lookups of the workers' gap alignment caches
+  std::atomic<uint64_t> alnCacheHits{0};
+  std::atomic<uint64_t> alnCacheMisses{0};
   std::atomic<uint64_t> lastPrint{0};
   std::atomic<uint64_t> totAlignment{0};
   std::atomic<uint64_t> correctAlignment{0};
@@ -0,0 +1,393 @@
+#include "FastxInputStream.hpp"
+#include "FastxParserThreadUtils.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+namespace fastx_parser {
+
+namespace {
+// the fixed part of a gzip member header, up to and including XLEN
+constexpr size_t gzipHeaderLen = 12;
+constexpr size_t gzipFooterLen = 8;
+// compressed bytes gathered into one BGZF batch (whole blocks, each
+// inflating to at most 64K)
+constexpr size_t bgzfBatchInput = 256 * 1024;
+// bytes inflated at a time from a plain gzip file
+constexpr size_t gzipBatchOutput = 4 * 1024 * 1024;
+constexpr size_t gzipBatches = 4;
+// bytes read at a time from a pipe
+constexpr size_t streamReadSize = 64 * 1024;
+
+inline uint32_t getLE(const unsigned char* p, size_t n) {
+  uint32_t v{0};
+  for (size_t i = 0; i < n; ++i) { v |= static_cast<uint32_t>(p[i]) << (8 * i); }
+  return v;
+}
+
+inline bool isGzip(const unsigned char* p) { return p[0] == 0x1f and p[1] == 0x8b; }
+
+// The length of the BGZF block whose header starts at p, where p holds
+// the fixed header and all of its extra field; 0 if it isn't a BGZF block
+size_t bgzfBlockLength(const unsigned char* p) {
+  if (!isGzip(p) or p[2] != 8 or !(p[3] & 0x4)) { return 0; }
+  size_t xlen = getLE(p + 10, 2);
+  const unsigned char* x = p + gzipHeaderLen;
+  // the BSIZE subfield ("BC") holds the block length minus 1
+  for (size_t i = 0; i + 4 <= xlen;) {
+    size_t slen = getLE(x + i + 2, 2);
+    if (x[i] == 'B' and x[i + 1] == 'C' and slen == 2 and i + 6 <= xlen) {
+      size_t len = getLE(x + i + 4, 2) + 1;
+      return (len >= gzipHeaderLen + xlen + gzipFooterLen) ? len : 0;
+    }
+    i += 4 + slen;
+  }
+  return 0;
+}
+
+// read exactly n bytes unless the file ends first; returns the number read
+// (or -1 on error)
+ssize_t readFully(int fd, char* p, size_t n) {
+  size_t got{0};
+  while (got < n) {
+    ssize_t r = ::read(fd, p + got, n - got);
+    if (r < 0) {
+      if (errno == EINTR) { continue; }
+      return -1;
+    }
+    if (r == 0) { break; }
+    got += r;
+  }
+  return static_cast<ssize_t>(got);
+}
+
+// true if fd has input (or its end) that can be read without blocking,
+// waiting up to timeout milliseconds for it
+bool inputPending(int fd, int timeout) {
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  return ::poll(&pfd, 1, timeout) > 0;
+}
+
+// a raw inflate stream, set up once per thread and reset for every block
+struct Inflater {
+  z_stream zs;
+  Inflater() {
+    std::memset(&zs, 0, sizeof(zs));
+    inflateInit2(&zs, -15);
+  }
+  ~Inflater() { inflateEnd(&zs); }
+};
+}
+
+constexpr int InputStream::Batch::Free;
+constexpr int InputStream::Batch::Compressed;
+constexpr int InputStream::Batch::Ready;
+
+InputStream::InputStream(const std::string& fname, uint32_t numThreads) {
+  fd_ = (fname == "-") ? ::dup(STDIN_FILENO) : ::open(fname.c_str(), O_RDONLY);
+  if (fd_ < 0) { return; }
+  good_ = true;
+  struct stat st;
+  if (::fstat(fd_, &st) == 0 and S_ISREG(st.st_mode)) {
+    unsigned char hd[gzipHeaderLen + 6];
+    ssize_t n = ::pread(fd_, hd, sizeof(hd), 0);
+    if (n < 2 or !isGzip(hd)) {
+      // an uncompressed file; if it can't be mapped, zlib reads it as is
+      kind_ = Kind::Mapped;
+      if (openMapped_(static_cast<size_t>(st.st_size))) { return; }
+      kind_ = Kind::Gzip;
+    } else {
+      kind_ = (n == sizeof(hd) and bgzfBlockLength(hd) > 0) ? Kind::BGZF : Kind::Gzip;
+    }
+  } else {
+    kind_ = Kind::Stream;
+  }
+
+  if (kind_ == Kind::BGZF) {
+    numThreads = std::max(numThreads, 1u);
+    for (size_t i = 0; i < 2 * numThreads + 2; ++i) { ring_.emplace_back(new Batch); }
+    threads_.emplace_back(&InputStream::readBGZF_, this);
+    for (uint32_t i = 0; i < numThreads; ++i) {
+      threads_.emplace_back(&InputStream::inflateBGZF_, this);
+    }
+  } else {
+    for (size_t i = 0; i < gzipBatches; ++i) { ring_.emplace_back(new Batch); }
+    if (kind_ == Kind::Stream) {
+      threads_.emplace_back(&InputStream::readStream_, this);
+    } else {
+      threads_.emplace_back(&InputStream::readGzip_, this);
+    }
+  }
+}
+
+InputStream::~InputStream() {
+  stop_ = true;
+  for (auto& t : threads_) { t.join(); }
+  if (map_ != nullptr) { ::munmap(const_cast<char*>(map_), mapSize_); }
+  if (fd_ >= 0) { ::close(fd_); }
+}
+
+bool InputStream::openMapped_(size_t size) {
+  mapSize_ = size;
+  if (size == 0) { return true; }
+  void* p = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd_, 0);
+  if (p == MAP_FAILED) { return false; }
+  ::madvise(p, size, MADV_SEQUENTIAL);
+  map_ = static_cast<const char*>(p);
+  return true;
+}
+
+int InputStream::read(char* buf, int len) {
+  if (!good_) { return -1; }
+  if (kind_ == Kind::Mapped) {
+    size_t n = std::min(static_cast<size_t>(len), mapSize_ - mapPos_);
+    if (n > 0) { std::memcpy(buf, map_ + mapPos_, n); }
+    mapPos_ += n;
+    return static_cast<int>(n);
+  }
+  size_t curMaxDelay = thread_utils::MIN_BACKOFF_ITERS;
+  bool stalled{false};
+  while (true) {
+    if (cur_ == nullptr) {
+      Batch& b = *ring_[next_ % ring_.size()];
+      if (b.state.load(std::memory_order_acquire) != Batch::Ready) {
+        if (readerDone_ and next_ >= numBatches_) { return readFailed_ ? -1 : 0; }
+        if (!stalled and onStall_) {
+          stalled = true;
+          onStall_();
+          continue;
+        }
+        thread_utils::backoffOrYield(curMaxDelay);
+        continue;
+      }
+      cur_ = &b;
+      curPos_ = 0;
+    }
+    if (cur_->failed) { return -1; }
+    size_t n = std::min(static_cast<size_t>(len), cur_->out.size() - curPos_);
+    if (n > 0) {
+      std::memcpy(buf, cur_->out.data() + curPos_, n);
+      curPos_ += n;
+      return static_cast<int>(n);
+    }
+    // done with this batch; its slot can take batch next_ + ring_.size()
+    cur_->state.store(Batch::Free, std::memory_order_release);
+    cur_ = nullptr;
+    ++next_;
+  }
+}
+
+bool InputStream::waitForFree_(Batch& b) {
+  size_t curMaxDelay = thread_utils::MIN_BACKOFF_ITERS;
+  while (b.state.load(std::memory_order_acquire) != Batch::Free) {
+    if (stop_) { return false; }
+    thread_utils::backoffOrYield(curMaxDelay);
+  }
+  return !stop_;
+}
+
+void InputStream::readBGZF_() {
+  size_t id{0};
+  bool atEnd{false};
+  while (!atEnd) {
+    Batch& b = *ring_[id % ring_.size()];
+    if (!waitForFree_(b)) { break; }
+    b.in.clear();
+    b.out.clear();
+    b.failed = false;
+    // gather whole blocks
+    while (b.in.size() < bgzfBatchInput) {
+      size_t start = b.in.size();
+      b.in.resize(start + gzipHeaderLen);
+      ssize_t n = readFully(fd_, &b.in[start], gzipHeaderLen);
+      size_t xlen = (n == static_cast<ssize_t>(gzipHeaderLen))
+        ? getLE(reinterpret_cast<unsigned char*>(&b.in[start + 10]), 2) : 0;
+      if (n == static_cast<ssize_t>(gzipHeaderLen)) {
+        b.in.resize(start + gzipHeaderLen + xlen);
+        n += readFully(fd_, &b.in[start + gzipHeaderLen], xlen);
+      }
+      size_t blockLen = (n == static_cast<ssize_t>(gzipHeaderLen + xlen))
+        ? bgzfBlockLength(reinterpret_cast<unsigned char*>(&b.in[start])) : 0;
+      if (blockLen > 0) {
+        b.in.resize(start + blockLen);
+        size_t rest = blockLen - gzipHeaderLen - xlen;
+        if (readFully(fd_, &b.in[start + gzipHeaderLen + xlen], rest) ==
+            static_cast<ssize_t>(rest)) {
+          continue;
+        }
+      }
+      // the end of the file, or a truncated or foreign block
+      if (n != 0) { readFailed_ = true; }
+      b.in.resize(start);
+      atEnd = true;
+      break;
+    }
+    if (b.in.empty()) { break; }
+    b.state.store(Batch::Compressed, std::memory_order_release);
+    inflateQueue_.enqueue(id);
+    ++id;
+  }
+  numBatches_ = id;
+  readerDone_ = true;
+}
+
+void InputStream::inflateBGZF_() {
+  size_t curMaxDelay = thread_utils::MIN_BACKOFF_ITERS;
+  size_t id;
+  while (!stop_) {
+    if (inflateQueue_.try_dequeue(id)) {
+      Batch& b = *ring_[id % ring_.size()];
+      b.failed = !inflateBatch_(b);
+      b.state.store(Batch::Ready, std::memory_order_release);
+      curMaxDelay = thread_utils::MIN_BACKOFF_ITERS;
+    } else if (readerDone_ and inflateQueue_.size_approx() == 0) {
+      // the reader enqueues its last batch before it is done
+      break;
+    } else {
+      thread_utils::backoffOrYield(curMaxDelay);
+    }
+  }
+}
+
+bool InputStream::inflateBatch_(Batch& b) {
+  thread_local Inflater inflater;
+  auto& zs = inflater.zs;
+  const unsigned char* in = reinterpret_cast<const unsigned char*>(b.in.data());
+  size_t pos{0};
+  while (pos < b.in.size()) {
+    size_t blockLen = bgzfBlockLength(in + pos);
+    size_t dataStart = gzipHeaderLen + getLE(in + pos + 10, 2);
+    uint32_t isize = getLE(in + pos + blockLen - 4, 4);
+    if (isize == 0) {
+      // an empty block (e.g. the EOF marker) has nothing to inflate, and
+      // would hand zlib a null output buffer
+      if (getLE(in + pos + blockLen - 8, 4) != 0) { return false; }
+      pos += blockLen;
+      continue;
+    }
+    size_t outStart = b.out.size();
+    b.out.resize(outStart + isize);
+    if (inflateReset(&zs) != Z_OK) { return false; }
+    zs.next_in = const_cast<unsigned char*>(in + pos + dataStart);
+    zs.avail_in = static_cast<uInt>(blockLen - dataStart - gzipFooterLen);
+    zs.next_out = reinterpret_cast<unsigned char*>(&b.out[outStart]);
+    zs.avail_out = isize;
+    if (inflate(&zs, Z_FINISH) != Z_STREAM_END or zs.total_out != isize) { return false; }
+    pos += blockLen;
+  }
+  return true;
+}
+
+void InputStream::readGzip_() {
+  // zlib closes the descriptor it is given, so give it its own
+  gzFile fp = gzdopen(::dup(fd_), "r");
+  if (fp == nullptr) {
+    readFailed_ = true;
+    readerDone_ = true;
+    return;
+  }
+  gzbuffer(fp, 1 << 17);
+  size_t id{0};
+  while (true) {
+    Batch& b = *ring_[id % ring_.size()];
+    if (!waitForFree_(b)) { break; }
+    b.out.resize(gzipBatchOutput);
+    int n = gzread(fp, b.out.data(), gzipBatchOutput);
+    if (n <= 0) {
+      if (n < 0) { readFailed_ = true; }
+      break;
+    }
+    b.out.resize(n);
+    b.failed = false;
+    b.state.store(Batch::Ready, std::memory_order_release);
+    ++id;
+  }
+  gzclose(fp);
+  numBatches_ = id;
+  readerDone_ = true;
+}
+
+void InputStream::readStream_() {
+  std::vector<unsigned char> in(streamReadSize);
+  z_stream zs;
+  std::memset(&zs, 0, sizeof(zs));
+  bool started{false}, compressed{false};
+  // true between the start and the end of a gzip member
+  bool inMember{false};
+  size_t id{0};
+  bool atEnd{false};
+  while (!atEnd) {
+    Batch& b = *ring_[id % ring_.size()];
+    if (!waitForFree_(b)) { break; }
+    b.out.clear();
+    b.failed = false;
+    // take what arrives until the batch is full, but hand it over as soon
+    // as there is nothing more to read right away
+    while (b.out.size() < gzipBatchOutput) {
+      if (!b.out.empty() and !inputPending(fd_, 0)) { break; }
+      // wait for input, but not past the destruction of the stream
+      while (!stop_ and !inputPending(fd_, 100)) {}
+      if (stop_) {
+        atEnd = true;
+        break;
+      }
+      ssize_t n = ::read(fd_, in.data(), in.size());
+      if (n < 0 and errno == EINTR) { continue; }
+      if (n <= 0) {
+        if (n < 0 or inMember) { readFailed_ = true; }
+        atEnd = true;
+        break;
+      }
+      if (!started) {
+        started = true;
+        compressed = n >= 2 and isGzip(in.data());
+        // gzip only (not zlib), and continue across concatenated members
+        if (compressed and inflateInit2(&zs, 15 + 16) != Z_OK) {
+          readFailed_ = true;
+          atEnd = true;
+          break;
+        }
+      }
+      if (!compressed) {
+        b.out.insert(b.out.end(), in.data(), in.data() + n);
+        continue;
+      }
+      zs.next_in = in.data();
+      zs.avail_in = static_cast<uInt>(n);
+      while (zs.avail_in > 0) {
+        inMember = true;
+        size_t used = b.out.size();
+        b.out.resize(used + 4 * streamReadSize);
+        zs.next_out = reinterpret_cast<unsigned char*>(&b.out[used]);
+        zs.avail_out = static_cast<uInt>(4 * streamReadSize);
+        int ret = inflate(&zs, Z_NO_FLUSH);
+        b.out.resize(b.out.size() - zs.avail_out);
+        if (ret == Z_STREAM_END) {
+          inMember = false;
+          inflateReset(&zs);
+        } else if (ret != Z_OK and ret != Z_BUF_ERROR) {
+          readFailed_ = true;
+          atEnd = true;
+          break;
+        }
+      }
+    }
+    if (b.out.empty()) { break; }
+    b.state.store(Batch::Ready, std::memory_order_release);
+    ++id;
+  }
+  if (compressed) { inflateEnd(&zs); }
+  numBatches_ = id;
+  readerDone_ = true;
+}
+
+} // namespace fastx_parser
@@ -1,10 +1,13 @@
 #include "FastxParser.hpp"
+#include "FastxInputStream.hpp"
 #include "FastxParserThreadUtils.hpp"
 
 #include "fcntl.h"
 #include "unistd.h"
 #include <sstream>
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
 #include <stdexcept>
@@ -12,10 +15,12 @@
 #include <poll.h>
 #include <thread>
 #include <vector>
-#include <zlib.h>
 
 // STEP 1: declare the type of file handler and the read() function
-KSEQ_INIT(gzFile, gzread)
+static inline int readInput(fastx_parser::InputStream* in, unsigned char* buf, int len) {
+  return in->read(reinterpret_cast<char*>(buf), len);
+}
+KSEQ_INIT(fastx_parser::InputStream*, readInput)
 
 namespace fastx_parser {
 template <typename T>
@@ -39,6 +44,8 @@ FastxParser<T>::FastxParser(std::vector<std::string> files,
     numParsers = files.size();
   }
   numParsers_ = numParsers;
+  // enough threads to inflate BGZF input as fast as the consumers map it
+  numDecompressors_ = std::max(1u, std::min(8u, numConsumers / 8));
 
   // nobody is parsing yet
   numParsing_ = 0;
@@ -138,9 +145,69 @@ inline void copyRecord(kseq_t* seq, ReadSeq* s) {
   s->name.assign(seq->name.s, seq->name.l);
 }
 
+// Copy the name, sequence and quality of the record into the chunk's arena
+template <typename T> inline void copyToArena(kseq_t* seq, ReadChunk<T>& chunk) {
+  chunk.addToArena(seq->name.s, seq->name.l);
+  chunk.addToArena(seq->seq.s, seq->seq.l);
+  chunk.addToArena(seq->qual.s, seq->qual.l);
+}
+
+// Store the i-th record of the file(s) being parsed in chunk
+inline void fillRecord(ReadChunk<ReadSeq>& chunk, size_t i, kseq_t* seq) {
+  copyRecord(seq, &chunk[i]);
+}
+
+inline void fillRecord(ReadChunk<ReadPair>& chunk, size_t i, kseq_t* seq,
+                       kseq_t* seq2) {
+  copyRecord(seq, &chunk[i].first);
+  copyRecord(seq2, &chunk[i].second);
+}
+
+inline void fillRecord(ReadChunk<ReadSeqView>& chunk, size_t, kseq_t* seq) {
+  copyToArena(seq, chunk);
+}
+
+inline void fillRecord(ReadChunk<ReadPairView>& chunk, size_t, kseq_t* seq,
+                       kseq_t* seq2) {
+  copyToArena(seq, chunk);
+  copyToArena(seq2, chunk);
+}
+
+inline void bindRecord(ReadSeqView& r, const char* arena, const ArenaSpan*& span) {
+  r.name = stx::string_view(arena + span[0].offset, span[0].length);
+  r.seq = stx::string_view(arena + span[1].offset, span[1].length);
+  r.qual = stx::string_view(arena + span[2].offset, span[2].length);
+  span += 3;
+}
+
+/**
+ * Called before a chunk holding num records is handed to the consumers.
+ * Owning records are complete once they are filled in; arena-backed ones
+ * are pointed at their bytes only now, since the arena may have moved
+ * while it grew.
+ **/
+template <typename T> inline void sealChunk(ReadChunk<T>&, size_t) {}
+
+inline void sealChunk(ReadChunk<ReadSeqView>& chunk, size_t num) {
+  const ArenaSpan* span = chunk.arenaSpans().data();
+  for (size_t i = 0; i < num; ++i) {
+    bindRecord(chunk[i], chunk.arenaData(), span);
+  }
+}
+
+inline void sealChunk(ReadChunk<ReadPairView>& chunk, size_t num) {
+  const ArenaSpan* span = chunk.arenaSpans().data();
+  for (size_t i = 0; i < num; ++i) {
+    bindRecord(chunk[i].first, chunk.arenaData(), span);
+    bindRecord(chunk[i].second, chunk.arenaData(), span);
+  }
+}
+
 template <typename T>
 int parseReads(
-    std::vector<std::string>& inputStreams, std::atomic<uint32_t>& numParsing,
+    std::vector<std::string>& inputStreams, uint32_t numDecompressors,
+    bool streaming, std::chrono::milliseconds maxLatency,
+    std::atomic<uint32_t>& numParsing,
     moodycamel::ConsumerToken* cCont, moodycamel::ProducerToken* pRead,
     moodycamel::ConcurrentQueue<uint32_t>& workQueue,
     moodycamel::ConcurrentQueue<std::unique_ptr<ReadChunk<T>>>&
@@ -150,7 +217,6 @@ int parseReads(
   using fastx_parser::thread_utils::MIN_BACKOFF_ITERS;
   auto curMaxDelay = MIN_BACKOFF_ITERS;
   kseq_t* seq;
-  T* s;
   uint32_t fn{0};
   while (workQueue.try_dequeue(fn)) {
     auto file = inputStreams[fn];
@@ -160,35 +226,61 @@ int parseReads(
       // Think of a way to do this that wouldn't be loud (or would allow a user-definable logging mechanism)
       // std::cerr << "couldn't dequeue read chunk\n";
     }
+    local->reset();
     size_t numObtained{local->size()};
     // open the file and init the parser
-    auto fp = gzopen(file.c_str(), "r");
+    InputStream fp(file, numDecompressors);
+    if (!fp.good()) {
+      --numParsing;
+      return -3;
+    }
 
     // The number of reads we have in the local vector
     size_t numWaiting{0};
+    // and the number handed to the consumers before them
+    uint64_t numDumped{0};
+    // when the first of them was parsed (only tracked when streaming)
+    std::chrono::steady_clock::time_point oldest;
+
+    // Hand the reads in local to the consumers, and get an empty chunk
+    auto dumpChunk = [&]() {
+      local->have(numWaiting);
+      local->setOrigin(fn, numDumped);
+      numDumped += numWaiting;
+      sealChunk(*local, numWaiting);
+      curMaxDelay = MIN_BACKOFF_ITERS;
+      while (!readQueue_.try_enqueue(std::move(local))) {
+        fastx_parser::thread_utils::backoffOrYield(curMaxDelay);
+      }
+      numWaiting = 0;
+      numObtained = 0;
+      // And get more empty reads
+      curMaxDelay = MIN_BACKOFF_ITERS;
+      while (!seqContainerQueue_.try_dequeue(*cCont, local)) {
+        fastx_parser::thread_utils::backoffOrYield(curMaxDelay);
+      }
+      local->reset();
+      numObtained = local->size();
+    };
+    // When streaming, the reads parsed so far are dumped as soon as a piped
+    // input stalls (even in the middle of a record), rather than held back
+    // until the chunk is full; files only stall on decompression
+    if (streaming and fp.isStream()) {
+      fp.setStallHandler([&]() { if (numWaiting > 0) { dumpChunk(); } });
+    }
 
-    seq = kseq_init(fp);
+    seq = kseq_init(&fp);
     int ksv = kseq_read(seq);
 
     while (ksv >= 0) {
-      s = &((*local)[numWaiting++]);
-
-      copyRecord(seq, s);
-
-      // If we've filled the local vector, then dump to the concurrent queue
-      if (numWaiting == numObtained) {
-        curMaxDelay = MIN_BACKOFF_ITERS;
-        while (!readQueue_.try_enqueue(std::move(local))) {
-          fastx_parser::thread_utils::backoffOrYield(curMaxDelay);
-        }
-        numWaiting = 0;
-        numObtained = 0;
-        // And get more empty reads
-        curMaxDelay = MIN_BACKOFF_ITERS;
-        while (!seqContainerQueue_.try_dequeue(*cCont, local)) {
-          fastx_parser::thread_utils::backoffOrYield(curMaxDelay);
-        }
-        numObtained = local->size();
+      fillRecord(*local, numWaiting++, seq);
+      if (streaming and numWaiting == 1) { oldest = std::chrono::steady_clock::now(); }
+
+      // If we've filled the local vector (or, when streaming, the oldest
+      // read has waited long enough), then dump to the concurrent queue
+      if (numWaiting == numObtained or
+          (streaming and std::chrono::steady_clock::now() - oldest >= maxLatency)) {
+        dumpChunk();
       }
       ksv = kseq_read(seq);
     }
@@ -202,15 +294,16 @@ int parseReads(
     // then dump them here.
     if (numWaiting > 0) {
       local->have(numWaiting);
+      local->setOrigin(fn, numDumped);
+      sealChunk(*local, numWaiting);
       curMaxDelay = MIN_BACKOFF_ITERS;
       while (!readQueue_.try_enqueue(*pRead, std::move(local))) {
         fastx_parser::thread_utils::backoffOrYield(curMaxDelay);
       }
       numWaiting = 0;
     }
-    // destroy the parser and close the file
+    // destroy the parser (the file is closed when fp goes out of scope)
     kseq_destroy(seq);
-    gzclose(fp);
   }
 
   --numParsing;
@@ -220,7 +313,9 @@ int parseReads(
 template <typename T>
 int parseReadPair(
     std::vector<std::string>& inputStreams,
-    std::vector<std::string>& inputStreams2, std::atomic<uint32_t>& numParsing,
+    std::vector<std::string>& inputStreams2, uint32_t numDecompressors,
+    bool streaming, std::chrono::milliseconds maxLatency,
+    std::atomic<uint32_t>& numParsing,
     moodycamel::ConsumerToken* cCont, moodycamel::ProducerToken* pRead,
     moodycamel::ConcurrentQueue<uint32_t>& workQueue,
     moodycamel::ConcurrentQueue<std::unique_ptr<ReadChunk<T>>>&
@@ -231,7 +326,6 @@ int parseReadPair(
   size_t curMaxDelay = MIN_BACKOFF_ITERS;
   kseq_t* seq;
   kseq_t* seq2;
-  T* s;
 
   uint32_t fn{0};
   while (workQueue.try_dequeue(fn)) {
@@ -245,39 +339,67 @@ int parseReadPair(
       // Think of a way to do this that wouldn't be loud (or would allow a user-definable logging mechanism)
       // std::cerr << "couldn't dequeue read chunk\n";
     }
+    local->reset();
     size_t numObtained{local->size()};
     // open the file and init the parser
-    auto fp = gzopen(file.c_str(), "r");
-    auto fp2 = gzopen(file2.c_str(), "r");
+    InputStream fp(file, numDecompressors);
+    InputStream fp2(file2, numDecompressors);
+    if (!fp.good() or !fp2.good()) {
+      --numParsing;
+      return -3;
+    }
 
     // The number of reads we have in the local vector
     size_t numWaiting{0};
+    // and the number handed to the consumers before them
+    uint64_t numDumped{0};
+    // when the first of them was parsed (only tracked when streaming)
+    std::chrono::steady_clock::time_point oldest;
 
-    seq = kseq_init(fp);
-    seq2 = kseq_init(fp2);
+    // Hand the reads in local to the consumers, and get an empty chunk
+    auto dumpChunk = [&]() {
+      local->have(numWaiting);
+      local->setOrigin(fn, numDumped);
+      numDumped += numWaiting;
+      sealChunk(*local, numWaiting);
+      curMaxDelay = MIN_BACKOFF_ITERS;
+      while (!readQueue_.try_enqueue(std::move(local))) {
+        fastx_parser::thread_utils::backoffOrYield(curMaxDelay);
+      }
+      numWaiting = 0;
+      numObtained = 0;
+      // And get more empty reads
+      curMaxDelay = MIN_BACKOFF_ITERS;
+      while (!seqContainerQueue_.try_dequeue(*cCont, local)) {
+        fastx_parser::thread_utils::backoffOrYield(curMaxDelay);
+      }
+      local->reset();
+      numObtained = local->size();
+    };
+    // When streaming, the pairs parsed so far are dumped as soon as either
+    // piped input stalls (even in the middle of a record), rather than held
+    // back until the chunk is full; files only stall on decompression
+    if (streaming) {
+      auto onStall = [&]() { if (numWaiting > 0) { dumpChunk(); } };
+      if (fp.isStream()) { fp.setStallHandler(onStall); }
+      if (fp2.isStream()) { fp2.setStallHandler(onStall); }
+    }
+
+    seq = kseq_init(&fp);
+    seq2 = kseq_init(&fp2);
 
     int ksv = kseq_read(seq);
     int ksv2 = kseq_read(seq2);
     while (ksv >= 0 and ksv2 >= 0) {
 
-      s = &((*local)[numWaiting++]);
-      copyRecord(seq, &s->first);
-      copyRecord(seq2, &s->second);
+      fillRecord(*local, numWaiting++, seq, seq2);
+      if (streaming and numWaiting == 1) { oldest = std::chrono::steady_clock::now(); }
 
-      // If we've filled the local vector, then dump to the concurrent queue
-      if (numWaiting == numObtained) {
-        curMaxDelay = MIN_BACKOFF_ITERS;
-        while (!readQueue_.try_enqueue(std::move(local))) {
-          fastx_parser::thread_utils::backoffOrYield(curMaxDelay);
-        }
-        numWaiting = 0;
-        numObtained = 0;
-        // And get more empty reads
-        curMaxDelay = MIN_BACKOFF_ITERS;
-        while (!seqContainerQueue_.try_dequeue(*cCont, local)) {
-          fastx_parser::thread_utils::backoffOrYield(curMaxDelay);
-        }
-        numObtained = local->size();
+      // If we've filled the local vector (or, when streaming, the oldest
+      // pair has waited long enough), then dump to the concurrent queue
+      if (numWaiting == numObtained or
+          (streaming and std::chrono::steady_clock::now() - oldest >= maxLatency)) {
+        dumpChunk();
       }
       ksv = kseq_read(seq);
       ksv2 = kseq_read(seq2);
@@ -295,24 +417,24 @@ int parseReadPair(
     // then dump them here.
     if (numWaiting > 0) {
       local->have(numWaiting);
+      local->setOrigin(fn, numDumped);
+      sealChunk(*local, numWaiting);
       curMaxDelay = MIN_BACKOFF_ITERS;
       while (!readQueue_.try_enqueue(*pRead, std::move(local))) {
         fastx_parser::thread_utils::backoffOrYield(curMaxDelay);
       }
       numWaiting = 0;
     }
-    // destroy the parser and close the file
+    // destroy the parsers (the files are closed when fp and fp2 go out of scope)
     kseq_destroy(seq);
-    gzclose(fp);
     kseq_destroy(seq2);
-    gzclose(fp2);
   }
 
   --numParsing;
   return 0;
 }
 
-template <> bool FastxParser<ReadSeq>::start() {
+template <typename T> template <typename U> bool FastxParser<T>::startSingle_() {
   if (numParsing_ == 0) {
     isActive_ = true;
     threadResults_.resize(numParsers_);
@@ -320,7 +442,8 @@ template <> bool FastxParser<ReadSeq>::start() {
     for (size_t i = 0; i < numParsers_; ++i) {
       ++numParsing_;
       parsingThreads_.emplace_back(new std::thread([this, i]() {
-        this->threadResults_[i] = parseReads(this->inputStreams_, this->numParsing_,
+        this->threadResults_[i] = parseReads(this->inputStreams_, this->numDecompressors_,
+                   this->streaming_, this->maxLatency_, this->numParsing_,
                    this->consumeContainers_[i].get(),
                    this->produceReads_[i].get(), this->workQueue_,
                    this->seqContainerQueue_, this->readQueue_);
@@ -332,7 +455,7 @@ template <> bool FastxParser<ReadSeq>::start() {
   }
 }
 
-template <> bool FastxParser<ReadPair>::start() {
+template <typename T> template <typename U> bool FastxParser<T>::startPaired_() {
   if (numParsing_ == 0) {
     isActive_ = true;
     // Some basic checking to ensure the read files look "sane".
@@ -356,6 +479,7 @@ template <> bool FastxParser<ReadPair>::start() {
       ++numParsing_;
       parsingThreads_.emplace_back(new std::thread([this, i]() {
             this->threadResults_[i] = parseReadPair(this->inputStreams_, this->inputStreams2_,
+                      this->numDecompressors_, this->streaming_, this->maxLatency_,
                       this->numParsing_, this->consumeContainers_[i].get(),
                       this->produceReads_[i].get(), this->workQueue_,
                       this->seqContainerQueue_, this->readQueue_);
@@ -367,6 +491,11 @@ template <> bool FastxParser<ReadPair>::start() {
   }
 }
 
+template <> bool FastxParser<ReadSeq>::start() { return startSingle_(); }
+template <> bool FastxParser<ReadSeqView>::start() { return startSingle_(); }
+template <> bool FastxParser<ReadPair>::start() { return startPaired_(); }
+template <> bool FastxParser<ReadPairView>::start() { return startPaired_(); }
+
 template <typename T> bool FastxParser<T>::refill(ReadGroup<T>& seqs) {
   finishedWithGroup(seqs);
   auto curMaxDelay = fastx_parser::thread_utils::MIN_BACKOFF_ITERS;
@@ -389,4 +518,6 @@ template <typename T> void FastxParser<T>::finishedWithGroup(ReadGroup<T>& s) {
 
 template class FastxParser<ReadSeq>;
 template class FastxParser<ReadPair>;
+template class FastxParser<ReadSeqView>;
+template class FastxParser<ReadPairView>;
 }
@@ -1,4 +1,5 @@
 #include "FastxParser.hpp"
+#include <algorithm>
 #include <cmath>
 #include <iostream>
 #include <iterator>
@@ -15,7 +16,9 @@
 #include "ScopedTimer.hpp"
 #include "Util.hpp"
 #include "PufferfishConfig.hpp"
+#include "cereal/archives/binary.hpp"
 #include "cereal/archives/json.hpp"
+#include "cereal/types/vector.hpp"
 #include "jellyfish/mer_dna.hpp"
 #include "sdsl/int_vector.hpp"
 #include "sdsl/rank_support.hpp"
@@ -193,6 +196,102 @@ uint32_t getEncodedExtension(sdsl::int_vector<2>& seqVec, uint64_t firstSampPos,
   return encodedNucs;
 }
 
+// Packs the sequences of the references in rfile, in the order of refNames
+// (i.e. by reference id), into refseq.bin, and writes the offset of each one
+// (and the total length, last) into refAccumLengths.bin.  Anything other
+// than A, C, G or T is stored as an A, and the runs of such bases are
+// written (as start, end pairs of offsets) into refNRuns.bin.  Returns
+// false if a reference is missing from rfile, or its length there differs
+// from that of its path in the graph (refLengths).
+bool storeRefSeqs(const std::string& rfile, const std::vector<std::string>& refNames,
+                  const std::vector<uint32_t>& refLengths,
+                  const std::string& outdir, std::shared_ptr<spdlog::logger> console) {
+  spp::sparse_hash_map<std::string, uint32_t> refIDs;
+  for (size_t i = 0; i < refNames.size(); ++i) {
+    refIDs[refNames[i]] = i;
+  }
+
+  // first pass; find the length of each reference
+  std::vector<uint64_t> refAccumLengths(refNames.size() + 1, 0);
+  {
+    fastx_parser::FastxParser<fastx_parser::ReadSeq> parser({rfile}, 1, 1);
+    parser.start();
+    auto rg = parser.getReadGroup();
+    while (parser.refill(rg)) {
+      for (auto& rp : rg) {
+        auto it = refIDs.find(rp.name);
+        if (it != refIDs.end()) {
+          refAccumLengths[it->second + 1] = rp.seq.length();
+        }
+      }
+    }
+    parser.stop();
+  }
+  // the aligner reads windows of the store at graph coordinates, so the
+  // two have to agree on every reference
+  size_t numMismatched{0};
+  for (size_t i = 0; i < refNames.size(); ++i) {
+    if (refAccumLengths[i + 1] != refLengths[i]) {
+      if (numMismatched == 0) {
+        console->error("reference {} is {} bases long in {}, but {} in the GFA file",
+                       refNames[i], refAccumLengths[i + 1], rfile, refLengths[i]);
+      }
+      ++numMismatched;
+    }
+    refAccumLengths[i + 1] += refAccumLengths[i];
+  }
+  if (numMismatched > 0) {
+    console->error("{} of the references in the GFA file don't match their sequence in {}; "
+                   "not storing the reference sequences", numMismatched, rfile);
+    return false;
+  }
+
+  // second pass; pack them
+  sdsl::int_vector<2> refSeqVec(refAccumLengths.back(), 0);
+  std::vector<std::pair<uint64_t, uint64_t>> nRuns;
+  {
+    fastx_parser::FastxParser<fastx_parser::ReadSeq> parser({rfile}, 1, 1);
+    parser.start();
+    auto rg = parser.getReadGroup();
+    while (parser.refill(rg)) {
+      for (auto& rp : rg) {
+        auto it = refIDs.find(rp.name);
+        if (it == refIDs.end()) { continue; }
+        uint64_t offset = refAccumLengths[it->second];
+        for (size_t i = 0; i < rp.seq.length(); ++i) {
+          auto c = kmers::codeForChar(rp.seq[i]);
+          if (kmers::isValidNuc(c)) {
+            refSeqVec[offset + i] = c;
+          } else if (!nRuns.empty() and nRuns.back().second == offset + i) {
+            ++nRuns.back().second;
+          } else {
+            nRuns.emplace_back(offset + i, offset + i + 1);
+          }
+        }
+      }
+    }
+    parser.stop();
+  }
+  std::cerr << "refSeqSize = " << sdsl::size_in_mega_bytes(refSeqVec) << "\n";
+  sdsl::store_to_file(refSeqVec, outdir + "/refseq.bin");
+  std::ofstream rl(outdir + "/refAccumLengths.bin");
+  cereal::BinaryOutputArchive rlAr(rl);
+  rlAr(refAccumLengths);
+
+  // the references are read in file order, not by id
+  std::sort(nRuns.begin(), nRuns.end());
+  std::vector<uint64_t> nRunBounds;
+  nRunBounds.reserve(2 * nRuns.size());
+  for (auto& r : nRuns) {
+    nRunBounds.push_back(r.first);
+    nRunBounds.push_back(r.second);
+  }
+  std::ofstream nr(outdir + "/refNRuns.bin");
+  cereal::BinaryOutputArchive nrAr(nr);
+  nrAr(nRunBounds);
+  return true;
+}
+
 int pufferfishIndex(IndexOptions& indexOpts) {
   uint32_t k = indexOpts.k;
   std::string gfa_file = indexOpts.gfa_file;
@@ -220,6 +319,11 @@ int pufferfishIndex(IndexOptions& indexOpts) {
   // std::exit(1);
   pf.mapContig2Pos();
   pf.serializeContigTable(outdir);
+  if (indexOpts.storeRefSeq) {
+    if (!storeRefSeqs(rfile, pf.getRefIDs(), pf.getRefLengths(), outdir, console)) {
+      return 1;
+    }
+  }
   pf.clearContigTable();
 
   {
@@ -282,6 +386,9 @@ int pufferfishIndex(IndexOptions& indexOpts) {
   sdsl::store_to_file(rankVec, outdir + "/rank.bin");
   sdsl::store_to_file(edgeVec, outdir + "/edge.bin");
   //sdsl::store_to_file(edgeVec2, outdir + "/revedge.bin");
+  if (indexOpts.buildNeighborTable) {
+    pf.serializeNeighborTable(outdir);
+  }
 
   // size_t slen = seqVec.size();
   //#ifndef PUFFER_DEBUG
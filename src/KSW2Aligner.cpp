@@ -256,4 +256,53 @@ int KSW2Aligner::operator()(const uint8_t* const query_, const int queryLength,
                           EnumToType<KSW2AlignmentType::EXTENSION>());
 }
 
+void KSW2Aligner::setQuery(const char* const query, const int queryLength) {
+  setQuery_.resize(queryLength);
+  for (int i = 0; i < queryLength; ++i) {
+    setQuery_[i] = seq_nt4_table_loc[static_cast<uint8_t>(query[i])];
+  }
+  setQueryRev_.assign(setQuery_.rbegin(), setQuery_.rend());
+}
+
+void KSW2Aligner::setQuery(const uint8_t* const query, const int queryLength) {
+  setQuery_.assign(query, query + queryLength);
+  setQueryRev_.assign(setQuery_.rbegin(), setQuery_.rend());
+}
+
+int KSW2Aligner::align(const uint8_t* const target, const int targetLength,
+                       ksw_extz_t* ez, EnumToType<KSW2AlignmentType::GLOBAL>) {
+  int qlen = static_cast<int>(setQuery_.size());
+  int q = config_.gapo;
+  int e = config_.gape;
+  int w = config_.bandwidth;
+  ez->score =
+      (config_.flag & KSW_EZ_SCORE_ONLY)
+          ? ksw_gg2(kalloc_allocator_.get(), qlen, setQuery_.data(), targetLength,
+                    target, config_.alphabetSize, mat_.data(), q, e, w, 0, 0, 0)
+          : ksw_gg2_sse_qr(kalloc_allocator_.get(), qlen, setQueryRev_.data(),
+                           targetLength, target, config_.alphabetSize,
+                           mat_.data(), q, e, w, &ez->m_cigar, &ez->n_cigar,
+                           &ez->cigar);
+  return ez->score;
+}
+
+int KSW2Aligner::align(const uint8_t* const target, const int targetLength,
+                       ksw_extz_t* ez, EnumToType<KSW2AlignmentType::EXTENSION>) {
+  return this->operator()(setQuery_.data(), static_cast<int>(setQuery_.size()),
+                          target, targetLength, ez,
+                          EnumToType<KSW2AlignmentType::EXTENSION>());
+}
+
+int KSW2Aligner::align(const uint8_t* const target, const int targetLength,
+                       EnumToType<KSW2AlignmentType::GLOBAL>) {
+  return align(target, targetLength, &result_,
+               EnumToType<KSW2AlignmentType::GLOBAL>());
+}
+
+int KSW2Aligner::align(const uint8_t* const target, const int targetLength,
+                       EnumToType<KSW2AlignmentType::EXTENSION>) {
+  return align(target, targetLength, &result_,
+               EnumToType<KSW2AlignmentType::EXTENSION>());
+}
+
 } // namespace ksw2pp
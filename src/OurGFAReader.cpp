@@ -158,6 +158,42 @@ sdsl::int_vector<8>& PosFinder::getEdgeVec() { return edgeVec_; }
 //sdsl::int_vector<8>& PosFinder::getEdgeVec2() { return edgeVec2_; }
 
 
+// The edge bits that the link cid(ore) -> nextcid(nextore) of a path sets on
+// the two contigs.  k has to be the k-mer length when this is called.
+std::pair<uint8_t, uint8_t> PosFinder::linkEdges_(uint64_t cid, bool ore, uint64_t nextcid, bool nextore) {
+  CanonicalKmer lastKmerInContig;
+  CanonicalKmer firstKmerInNextContig;
+  Direction contigDirection;
+  Direction nextContigDirection;
+  // If a is in the forward orientation, the last k-mer comes from the end, otherwise it is the reverse complement of the first k-mer
+  if (ore) {
+    lastKmerInContig.fromNum(seqVec_.get_int(2 * (contigid2seq[cid].offset + contigid2seq[cid].length - k), 2 * k));
+    contigDirection = Direction::APPEND;
+  } else {
+    lastKmerInContig.fromNum(seqVec_.get_int(2 * contigid2seq[cid].offset, 2*k));
+    lastKmerInContig.swap();
+    contigDirection = Direction::PREPEND;
+  }
+
+  // If a is in the forward orientation, the first k-mer comes from the beginning, otherwise it is the reverse complement of the last k-mer
+  if (nextore) {
+    firstKmerInNextContig.fromNum(seqVec_.get_int(2 * contigid2seq[nextcid].offset, 2*k));
+    nextContigDirection = Direction::PREPEND;
+  } else {
+    firstKmerInNextContig.fromNum(seqVec_.get_int(2 * (contigid2seq[nextcid].offset + contigid2seq[nextcid].length - k), 2 * k));
+    firstKmerInNextContig.swap();
+    nextContigDirection = Direction::APPEND;
+  }
+
+  // The character to append / prepend to contig to get to next contig
+  const char contigChar = firstKmerInNextContig.to_str()[k-1];
+  // The character to prepend / append to next contig to get to contig
+  const char nextContigChar = lastKmerInContig.to_str()[0];
+
+  return std::make_pair(encodeEdge(contigChar, contigDirection),
+                        encodeEdge(nextContigChar, nextContigDirection));
+}
+
 void PosFinder::parseFile() {
   size_t total_len = fillContigInfoMap_();
   file.reset(new zstr::ifstream(filename_));
@@ -250,7 +286,7 @@ void PosFinder::parseFile() {
       auto nextcid = contigs[i+1].first ;
       bool nextore = contigs[i+1].second ;
 
-      bool nextForder = contigid2seq[nextcid].fileOrder ;
+      size_t nextForder = contigid2seq[nextcid].fileOrder ;
       // a+,b+ end kmer of a , start kmer of b
       // a+,b- end kmer of a , rc(end kmer of b)
       // a-,b+ rc(start kmer of a) , start kmer of b
@@ -263,37 +299,9 @@ void PosFinder::parseFile() {
        */
         
 
-      CanonicalKmer lastKmerInContig;
-      CanonicalKmer firstKmerInNextContig;
-      Direction contigDirection;
-      Direction nextContigDirection;
-      // If a is in the forward orientation, the last k-mer comes from the end, otherwise it is the reverse complement of the first k-mer
-      if (ore) {
-        lastKmerInContig.fromNum(seqVec_.get_int(2 * (contigid2seq[cid].offset + contigid2seq[cid].length - k), 2 * k));
-        contigDirection = Direction::APPEND;
-      } else {
-        lastKmerInContig.fromNum(seqVec_.get_int(2 * contigid2seq[cid].offset, 2*k));
-        lastKmerInContig.swap();
-        contigDirection = Direction::PREPEND;
-      }
-
-      // If a is in the forward orientation, the first k-mer comes from the beginning, otherwise it is the reverse complement of the last k-mer
-      if (nextore) {
-        firstKmerInNextContig.fromNum(seqVec_.get_int(2 * contigid2seq[nextcid].offset, 2*k));
-        nextContigDirection = Direction::PREPEND;
-      } else {
-        firstKmerInNextContig.fromNum(seqVec_.get_int(2 * (contigid2seq[nextcid].offset + contigid2seq[nextcid].length - k), 2 * k));
-        firstKmerInNextContig.swap();
-        nextContigDirection = Direction::APPEND;
-      }
-
-      // The character to append / prepend to contig to get to next contig
-      const char contigChar = firstKmerInNextContig.to_str()[k-1];
-      // The character to prepend / append to next contig to get to contig
-      const char nextContigChar = lastKmerInContig.to_str()[0];
-
-      edgeVec_[forder] |= encodeEdge(contigChar, contigDirection);
-      edgeVec_[nextForder] |= encodeEdge(nextContigChar, nextContigDirection);
+      auto edges = linkEdges_(cid, ore, nextcid, nextore);
+      edgeVec_[forder] |= edges.first;
+      edgeVec_[nextForder] |= edges.second;
 
       //////////// ========== Old implementation
       /*
@@ -393,6 +401,8 @@ spp::sparse_hash_map<uint32_t, std::string>& PosFinder::getRefIDs() {
 */
 std::vector<std::string>& PosFinder::getRefIDs() { return refMap; }
 
+std::vector<uint32_t>& PosFinder::getRefLengths() { return refLengths; }
+
 std::map<std::pair<std::string, bool>, bool, util::cmpByPair>&
 PosFinder::getPathStart() {
   return pathStart;
@@ -570,6 +580,59 @@ void PosFinder::serializeContigTable(const std::string& odir) {
   */
 }
 
+// Write the contig on the other side of every edge in edgeVec_, so that
+// graph walks don't have to look the neighboring k-mers up in the index.
+// The table is in CSR form: nbr_offsets.bin holds, for each contig, the
+// index in nbr.bin of its first neighbor, and the neighbors of a contig
+// follow in the order of its edge bits.  Each entry is
+// (contig id << 1) | (whether it has the same orientation as the contig).
+// Note : We assume that odir is the name of a valid (i.e., existing) directory.
+void PosFinder::serializeNeighborTable(const std::string& odir) {
+  k = k + 1;
+  CanonicalKmer::k(k);
+
+  // the neighbor across each edge, keyed on (file order << 3 | edge bit)
+  spp::sparse_hash_map<uint64_t, uint64_t> nbrMap;
+  for (auto const& ent : path) {
+    const std::vector<std::pair<uint64_t, bool>>& contigs = ent.second;
+    for (size_t i = 0; i + 1 < contigs.size(); i++) {
+      auto cid = contigs[i].first;
+      bool ore = contigs[i].second;
+      auto nextcid = contigs[i+1].first;
+      bool nextore = contigs[i+1].second;
+      uint64_t forder = contigid2seq[cid].fileOrder;
+      uint64_t nextForder = contigid2seq[nextcid].fileOrder;
+      bool sameOri = (ore == nextore);
+      auto edges = linkEdges_(cid, ore, nextcid, nextore);
+      nbrMap[(forder << 3) | __builtin_ctz(edges.first)] = (nextForder << 1) | sameOri;
+      nbrMap[(nextForder << 3) | __builtin_ctz(edges.second)] = (forder << 1) | sameOri;
+    }
+  }
+  k = k - 1;
+
+  size_t numContigs = contigid2seq.size();
+  size_t numEdges{0};
+  for (size_t i = 0; i < numContigs; ++i) {
+    numEdges += __builtin_popcount(static_cast<uint32_t>(edgeVec_[i]));
+  }
+  sdsl::int_vector<> nbrOffsets(numContigs + 1, 0, std::log2(numEdges + 1) + 1);
+  sdsl::int_vector<> nbrs(numEdges, 0, std::log2(numContigs + 1) + 2);
+  size_t j{0};
+  for (size_t i = 0; i < numContigs; ++i) {
+    nbrOffsets[i] = j;
+    uint8_t edges = edgeVec_[i];
+    for (uint64_t bit = 0; bit < 8; ++bit) {
+      if (edges & (1 << bit)) {
+        nbrs[j++] = nbrMap[(i << 3) | bit];
+      }
+    }
+  }
+  nbrOffsets[numContigs] = j;
+  std::cerr << "nbrTableSize = " << sdsl::size_in_mega_bytes(nbrOffsets) + sdsl::size_in_mega_bytes(nbrs) << "\n";
+  sdsl::store_to_file(nbrOffsets, odir + "/nbr_offsets.bin");
+  sdsl::store_to_file(nbrs, odir + "/nbr.bin");
+}
+
 void PosFinder::deserializeContigTable() {
   // TODO read the file in the same order as you've written it down.
 }
@@ -0,0 +1,202 @@
+#include "OutputWriter.hpp"
+#include "FastxParserThreadUtils.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <zlib.h>
+
+namespace pufferfish {
+
+namespace {
+// the empty block that marks the end of a BGZF file
+const char bgzfEOF[28] = {'\x1f', '\x8b', '\x08', '\x04', 0, 0, 0, 0, 0, '\xff', '\x06', 0,
+                          'B', 'C', '\x02', 0, '\x1b', 0, '\x03', 0, 0, 0, 0, 0, 0, 0, 0, 0};
+constexpr size_t bgzfHeaderLen = 18;
+constexpr size_t bgzfFooterLen = 8;
+
+// a raw deflate stream, set up once per thread and reset for every block
+struct Deflater {
+  z_stream zs;
+  Deflater() {
+    std::memset(&zs, 0, sizeof(zs));
+    deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+  }
+  ~Deflater() { deflateEnd(&zs); }
+};
+
+inline void putLE(char* p, uint32_t v, size_t n) {
+  for (size_t i = 0; i < n; ++i) { p[i] = static_cast<char>((v >> (8 * i)) & 0xff); }
+}
+}
+
+constexpr size_t OutputWriter::maxBatch;
+constexpr size_t OutputWriter::bgzfBlockInput;
+
+OutputWriter::OutputWriter(const std::string& fname, size_t numBuffers, bool bgzf)
+    : bgzf_(bgzf), freeQueue_(numBuffers), writeQueue_(numBuffers) {
+  if (fname.empty()) {
+    fd_ = STDOUT_FILENO;
+  } else {
+    fd_ = ::open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ownsFd_ = true;
+  }
+  if (fd_ < 0) { return; }
+  buffers_.reserve(numBuffers);
+  compressed_.resize(bgzf_ ? numBuffers : 0);
+  for (size_t i = 0; i < numBuffers; ++i) {
+    buffers_.emplace_back(new fmt::MemoryWriter);
+    slot_[buffers_.back().get()] = i;
+    freeQueue_.enqueue(buffers_.back().get());
+  }
+  writer_ = std::thread(&OutputWriter::run_, this);
+}
+
+OutputWriter::~OutputWriter() { close(); }
+
+fmt::MemoryWriter* OutputWriter::acquire() {
+  fmt::MemoryWriter* buf{nullptr};
+  size_t curMaxDelay = fastx_parser::thread_utils::MIN_BACKOFF_ITERS;
+  // every buffer is either being filled or waiting to be written, so the
+  // output can't keep up; wait for the writer thread to free one
+  while (!freeQueue_.try_dequeue(buf)) {
+    fastx_parser::thread_utils::backoffOrYield(curMaxDelay);
+  }
+  return buf;
+}
+
+fmt::MemoryWriter* OutputWriter::submit(fmt::MemoryWriter* buf) {
+  if (buf->size() == 0) { return buf; }
+  if (bgzf_) { compress_(*buf, compressed_[slot_.at(buf)]); }
+  writeQueue_.enqueue(buf);
+  return acquire();
+}
+
+void OutputWriter::release(fmt::MemoryWriter* buf) {
+  buf->clear();
+  freeQueue_.enqueue(buf);
+}
+
+bool OutputWriter::write(const fmt::MemoryWriter& buf) {
+  if (!bgzf_) { return writeRaw_(buf.data(), buf.size()); }
+  std::vector<char> out;
+  compress_(buf, out);
+  return writeRaw_(out.data(), out.size());
+}
+
+bool OutputWriter::writeRaw_(const char* data, size_t left) {
+  while (left > 0) {
+    ssize_t n = ::write(fd_, data, left);
+    if (n < 0) {
+      if (errno == EINTR) { continue; }
+      failed_ = true;
+      return false;
+    }
+    data += n;
+    left -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+void OutputWriter::compress_(const fmt::MemoryWriter& buf, std::vector<char>& out) {
+  thread_local Deflater deflater;
+  z_stream& zs = deflater.zs;
+  out.clear();
+  const char* data = buf.data();
+  size_t left = buf.size();
+  while (left > 0) {
+    size_t len = std::min(left, bgzfBlockInput);
+    size_t start = out.size();
+    out.resize(start + bgzfHeaderLen + deflateBound(&zs, len) + bgzfFooterLen);
+    deflateReset(&zs);
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    zs.avail_in = static_cast<uInt>(len);
+    zs.next_out = reinterpret_cast<Bytef*>(&out[start + bgzfHeaderLen]);
+    zs.avail_out = static_cast<uInt>(out.size() - start - bgzfHeaderLen - bgzfFooterLen);
+    deflate(&zs, Z_FINISH);
+    size_t blockLen = bgzfHeaderLen + zs.total_out + bgzfFooterLen;
+    char* block = &out[start];
+    // gzip header with the BC extra field holding the block size - 1
+    std::memcpy(block, bgzfEOF, 16);
+    putLE(block + 16, static_cast<uint32_t>(blockLen - 1), 2);
+    char* footer = block + bgzfHeaderLen + zs.total_out;
+    uLong crc = crc32(crc32(0L, Z_NULL, 0), reinterpret_cast<const Bytef*>(data), static_cast<uInt>(len));
+    putLE(footer, static_cast<uint32_t>(crc), 4);
+    putLE(footer + 4, static_cast<uint32_t>(len), 4);
+    out.resize(start + blockLen);
+    data += len;
+    left -= len;
+  }
+}
+
+bool OutputWriter::close() {
+  if (writer_.joinable()) {
+    done_ = true;
+    writer_.join();
+    if (bgzf_) { writeRaw_(bgzfEOF, sizeof(bgzfEOF)); }
+  }
+  if (ownsFd_ and fd_ >= 0) {
+    if (::close(fd_) != 0) { failed_ = true; }
+    fd_ = -1;
+  }
+  return !failed_;
+}
+
+void OutputWriter::run_() {
+  fmt::MemoryWriter* bufs[maxBatch];
+  size_t curMaxDelay = fastx_parser::thread_utils::MIN_BACKOFF_ITERS;
+  while (true) {
+    // read done_ before looking at the queue, so that nothing submitted
+    // before close() is missed
+    bool done = done_;
+    size_t n = writeQueue_.try_dequeue_bulk(bufs, maxBatch);
+    if (n == 0) {
+      if (done) { return; }
+      fastx_parser::thread_utils::backoffOrYield(curMaxDelay);
+      continue;
+    }
+    curMaxDelay = fastx_parser::thread_utils::MIN_BACKOFF_ITERS;
+    if (!failed_ and !writeBatch_(bufs, n)) { failed_ = true; }
+    for (size_t i = 0; i < n; ++i) { release(bufs[i]); }
+  }
+}
+
+bool OutputWriter::writeBatch_(fmt::MemoryWriter** bufs, size_t n) {
+  struct iovec iov[maxBatch];
+  for (size_t i = 0; i < n; ++i) {
+    if (bgzf_) {
+      auto& c = compressed_[slot_.at(bufs[i])];
+      iov[i].iov_base = c.data();
+      iov[i].iov_len = c.size();
+    } else {
+      iov[i].iov_base = const_cast<char*>(bufs[i]->data());
+      iov[i].iov_len = bufs[i]->size();
+    }
+  }
+  struct iovec* cur = iov;
+  size_t left = n;
+  while (left > 0) {
+    ssize_t written = ::writev(fd_, cur, static_cast<int>(left));
+    if (written < 0) {
+      if (errno == EINTR) { continue; }
+      return false;
+    }
+    // skip what was written, which may end in the middle of a buffer
+    size_t w = static_cast<size_t>(written);
+    while (left > 0 and w >= cur->iov_len) {
+      w -= cur->iov_len;
+      ++cur;
+      --left;
+    }
+    if (left > 0) {
+      cur->iov_base = static_cast<char*>(cur->iov_base) + w;
+      cur->iov_len -= w;
+    }
+  }
+  return true;
+}
+
+} // namespace pufferfish
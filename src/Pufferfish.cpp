@@ -59,7 +59,9 @@ int main(int argc, char* argv[]) {
                     (required("-r", "--ref").call([]{cout << "parsing --ref\n\n";}) & value("ref_file", indexOpt.rfile)) % "path to the reference fasta file",
                     (option("-k", "--klen") & value("kmer_length", indexOpt.k))  % "length of the k-mer with which the dBG was built (default = 31)",
                     (option("-s", "--sparse").set(indexOpt.isSparse, true)) % "use the sparse pufferfish index (less space, but slower lookup)",
-                    (option("-e", "--extension") & value("extension_size", indexOpt.extensionSize)) % "length of the extension to store in the sparse index (default = 4)"
+                    (option("-e", "--extension") & value("extension_size", indexOpt.extensionSize)) % "length of the extension to store in the sparse index (default = 4)",
+                    (option("-n", "--neighbors").set(indexOpt.buildNeighborTable, true)) % "also store the neighbors of each contig, so that walking the dBG needs no k-mer lookups",
+                    (option("--refseq").set(indexOpt.storeRefSeq, true)) % "also store the reference sequences, so that the aligner can read them directly rather than from the dBG"
                     );
 
   /*
@@ -115,8 +117,19 @@ int main(int argc, char* argv[]) {
                     ),
                     (option("--maxSpliceGap") & value("max splice gap", alignmentOpt.maxSpliceGap)) % "specify maximum splice gap that two uni-MEMs should have",
                     (option("--maxFragmentLength") & value("max frag length", alignmentOpt.maxFragmentLength)) % "specify the maximum distance between the last uni-MEM of the left and first uni-MEM of the right end of the read pairs",
+                    (option("--maxNumHits") & value("max num hits", alignmentOpt.maxNumHits)) % "maximum number of mappings reported for a read (or read pair); the ones with the highest coverage are kept (default=200)",
+                    (option("--maxRefOcc") & value("max ref occ", alignmentOpt.maxRefOcc)) % "uni-MEMs occurring this many times or more in the references are only used if a read has no other uni-MEMs (default=200)",
+                    (option("--mateRescue").set(alignmentOpt.mateRescue, true)) % "when only one end of a pair maps, search for the other end near it (within --maxFragmentLength, and at most 1000 bases)",
                     (option("--writeOrphans").set(alignmentOpt.writeOrphans, true)) % "write Orphans flag",
-                    (option("-k", "--krakOut").set(alignmentOpt.krakOut, true)) % "write output in the format required for krakMap"
+                    (option("-k", "--krakOut").set(alignmentOpt.krakOut, true)) % "write output in the format required for krakMap",
+                    (option("--bam").set(alignmentOpt.bamOut, true)) % "write the alignments as BAM (BGZF compressed by the mapping threads) rather than SAM",
+                    (option("--binaryOut").set(alignmentOpt.binaryOut, true)) % "write only the mappings (reference, position, strand, score, fragment length) in a compact binary format (see include/MappingRecord.hpp) rather than SAM",
+                    (option("--eqclasses").set(alignmentOpt.eqClasses, true)) % "write only the number of reads in each equivalence class (set of references they map to), and the reference lengths, rather than the mappings",
+                    (option("--pseudo").set(alignmentOpt.pseudo, true)) % "only find the references each read (pair) is compatible with, by intersecting the equivalence classes of the contigs it hits, and write them as with --eqclasses",
+                    (option("--sort").set(alignmentOpt.sortOutput, true)) % "write the alignments sorted by reference and position (unmapped reads last)",
+                    (option("--sortMemory") & value("sort memory", alignmentOpt.sortMemory)) % "memory (in MB) to hold alignments being sorted; beyond it they are spilled to temporary files next to the output (default=2048)",
+                    (option("--stream").set(alignmentOpt.streaming, true)) % "map reads as they arrive (e.g. from a running sequencer through a FIFO, or from stdin given as -), writing their alignments within about --streamLatency rather than in large batches",
+                    (option("--streamLatency") & value("stream latency", alignmentOpt.streamLatency)) % "with --stream, the longest (in ms) a read that has been parsed waits before it is mapped (default=100)"
                     );
 
   auto cli = (
@@ -33,7 +33,6 @@
 
 
 #include "spdlog/spdlog.h"
-#include "spdlog/sinks/ostream_sink.h"
 #include "spdlog/sinks/stdout_sinks.h"
 #include "spdlog/sinks/ansicolor_sink.h"
 #include "spdlog/fmt/ostr.h"
@@ -50,11 +49,21 @@
 #include "PufferfishSparseIndex.hpp"
 #include "ScopedTimer.hpp"
 #include "Util.hpp"
+#include "EncodedRead.hpp"
 #include "SpinLock.hpp"
 #include "MemCollector.hpp"
 #include "SAMWriter.hpp"
+#include "BAMWriter.hpp"
 #include "RefSeqConstructor.hpp"
 #include "KSW2Aligner.hpp"
+#include "MateRescuer.hpp"
+#include "AlignmentCache.hpp"
+#include "OutputWriter.hpp"
+#include "RecordSorter.hpp"
+#include "MappingRecordWriter.hpp"
+#include "EquivalenceClassCounter.hpp"
+#include "PseudoAligner.hpp"
+#include "EditDistance.hpp"
 
 #define START_CONTIG_ID ((uint32_t)-1) 
 #define END_CONTIG_ID ((uint32_t)-2)
@@ -65,8 +74,8 @@
 
 #define EPS 5
 
-using paired_parser = fastx_parser::FastxParser<fastx_parser::ReadPair>;
-using single_parser = fastx_parser::FastxParser<fastx_parser::ReadSeq>;
+using paired_parser = fastx_parser::FastxParser<fastx_parser::ReadPairView>;
+using single_parser = fastx_parser::FastxParser<fastx_parser::ReadSeqView>;
 
 using HitCounters = util::HitCounters ;
 using QuasiAlignment = util::QuasiAlignment ;
@@ -82,69 +91,111 @@ void joinReadsAndFilter(spp::sparse_hash_map<size_t,std::vector<util::MemCluster
                         uint32_t perfectCoverage,
                         double coverageRatio,
                         bool verbose=false) {
+  using ClustIt = std::vector<util::MemCluster>::iterator;
   //orphan reads should be taken care of maybe with a flag!
   //uint32_t perfectCoverage{2*readLen};
   uint32_t maxCoverage{0};
+  // the left and right clusters of the current reference, sorted by their first position
+  std::vector<ClustIt> lSorted;
+  std::vector<ClustIt> rSorted;
+  auto byFirstPos = [](const ClustIt& c1, const ClustIt& c2) -> bool {
+    return c1->firstRefPos() < c2->firstRefPos();
+  };
   //std::cout << "txp count:" << leftMemClusters.size() << "\n";
   for (auto& leftClustItr : leftMemClusters) {
     // reference id
     size_t tid = leftClustItr.first;
     // left mem clusters
     auto& lClusts = leftClustItr.second;
-    // right mem clusters for the same reference id
-    auto& rClusts = rightMemClusters[tid];
-    //if ((lClusts.size() > 5 || rClusts.size() > 5) && (lClusts.size()>0 && rClusts.size()>0))
-    //std::cout << "\t" << tid << ": lClusts.size:" << lClusts.size() << " , rClusts.size:" << rClusts.size() << "\n";
-    // Compare the left clusters to the right clusters to filter by positional constraints
-    for (auto lclust =  lClusts.begin(); lclust != lClusts.end(); lclust++) {
-      for (auto rclust =  rClusts.begin(); rclust != rClusts.end(); rclust++) {
+    // right mem clusters for the same reference id (if any)
+    auto rightClustItr = rightMemClusters.find(tid);
+    if (lClusts.empty() or rightClustItr == rightMemClusters.end() or rightClustItr->second.empty()) {
+      continue;
+    }
+    auto& rClusts = rightClustItr->second;
+
+    uint32_t maxLeftCov{0};
+    uint32_t maxRightCov{0};
+    for (auto& c : lClusts) { maxLeftCov = std::max(maxLeftCov, c.coverage); }
+    for (auto& c : rClusts) { maxRightCov = std::max(maxRightCov, c.coverage); }
+    // no pair on this reference can survive the final coverage filter
+    if (maxLeftCov + maxRightCov < coverageRatio * maxCoverage) {
+      continue;
+    }
+
+    lSorted.clear();
+    rSorted.clear();
+    for (auto c = lClusts.begin(); c != lClusts.end(); ++c) { lSorted.push_back(c); }
+    for (auto c = rClusts.begin(); c != rClusts.end(); ++c) { rSorted.push_back(c); }
+    std::sort(lSorted.begin(), lSorted.end(), byFirstPos);
+    std::sort(rSorted.begin(), rSorted.end(), byFirstPos);
+
+    // The fragment length of a pair is at least the distance between the first positions
+    // of its two clusters, so for each left cluster we only have to look at the right clusters
+    // whose first position is within maxFragmentLength of it.  Since the left clusters are
+    // visited in order of position, the start of this window only ever moves forward.
+    size_t windowStart{0};
+    for (auto& lclust : lSorted) {
+      size_t lpos = lclust->firstRefPos();
+      // this left cluster can't reach the coverage of the best pair we have seen so far
+      if (lclust->coverage + maxRightCov < coverageRatio * maxCoverage) {
+        continue;
+      }
+      while (windowStart < rSorted.size() and
+             rSorted[windowStart]->firstRefPos() + maxFragmentLength <= lpos) {
+        ++windowStart;
+      }
+      for (size_t ri = windowStart;
+           ri < rSorted.size() and rSorted[ri]->firstRefPos() < lpos + maxFragmentLength; ++ri) {
+        auto& rclust = rSorted[ri];
         // if both the left and right clusters are oriented in the same direction, skip this pair
         // NOTE: This should be optional as some libraries could allow this.
         if (lclust->isFw == rclust->isFw) {
           continue;
         }
 
+        // This will add a new potential mapping. Coverage of a mapping for read pairs is left->coverage + right->coverage
+        // If we found a perfect coverage, we would only add those mappings that have the same perfect coverage
+        auto totalCoverage = lclust->coverage + rclust->coverage;
+        if (!(totalCoverage >= coverageRatio * maxCoverage or totalCoverage == perfectCoverage)) {
+          continue;
+        }
+
         // FILTER 1
         // filter read pairs based on the fragment length which is approximated by the distance between the left most start and right most hit end
         size_t fragmentLen = rclust->lastRefPos() + rclust->lastMemLen() - lclust->firstRefPos();
         if (lclust->firstRefPos() > rclust->firstRefPos()) {
           fragmentLen = lclust->lastRefPos() + lclust->lastMemLen() - rclust->firstRefPos();
         }
+        if (fragmentLen >= maxFragmentLength) {
+          continue;
+        }
 
-        if ( fragmentLen < maxFragmentLength) {
-          // This will add a new potential mapping. Coverage of a mapping for read pairs is left->coverage + right->coverage
-          // If we found a perfect coverage, we would only add those mappings that have the same perfect coverage
-          auto totalCoverage = lclust->coverage + rclust->coverage;
-          if (totalCoverage >= coverageRatio * maxCoverage or totalCoverage == perfectCoverage ) {//}|| (lclust->coverage + rclust->coverage) == ) {
-            jointMemsList.emplace_back(tid, lclust, rclust, fragmentLen);
-            if (verbose) {
-              std::cout <<"\ntid:"<<tid<<"\n";
-              std::cout <<"left:" << lclust->isFw << " size:" << lclust->mems.size() << " cov:" << lclust->coverage << "\n";
-              for (size_t i = 0; i < lclust->mems.size(); i++){
-                std::cout << "--- t" << lclust->mems[i].tpos << " r"
-                          << lclust->mems[i].memInfo->rpos << " cid:"
-                          << lclust->mems[i].memInfo->cid << " cpos: "
-                          << lclust->mems[i].memInfo->cpos << " len:"
-                          << lclust->mems[i].memInfo->memlen << " fw:"
-                          << lclust->mems[i].memInfo->cIsFw << "\n";
-              }
-              std::cout << "\nright:" << rclust->isFw << " size:" << rclust->mems.size() << " cov:" << rclust->coverage << "\n";
-              for (size_t i = 0; i < rclust->mems.size(); i++){
-                std::cout << "--- t" << rclust->mems[i].tpos << " r"
-                          << rclust->mems[i].memInfo->rpos << " cid:"
-                          << rclust->mems[i].memInfo->cid << " cpos: "
-                          << rclust->mems[i].memInfo->cpos << " len:"
-                          << rclust->mems[i].memInfo->memlen << " fw:"
-                          << rclust->mems[i].memInfo->cIsFw << "\n";
-              }
-            }
-            uint32_t currCoverage =  jointMemsList.back().coverage();
-            if (maxCoverage < currCoverage) {
-              maxCoverage = currCoverage;
-            }
+        jointMemsList.emplace_back(tid, lclust, rclust, fragmentLen);
+        if (verbose) {
+          std::cout <<"\ntid:"<<tid<<"\n";
+          std::cout <<"left:" << lclust->isFw << " size:" << lclust->mems.size() << " cov:" << lclust->coverage << "\n";
+          for (size_t i = 0; i < lclust->mems.size(); i++){
+            std::cout << "--- t" << lclust->mems[i].tpos << " r"
+                      << lclust->mems[i].memInfo->rpos << " cid:"
+                      << lclust->mems[i].memInfo->cid << " cpos: "
+                      << lclust->mems[i].memInfo->cpos << " len:"
+                      << lclust->mems[i].memInfo->memlen << " fw:"
+                      << lclust->mems[i].memInfo->cIsFw << "\n";
           }
-        } else {
-          break;
+          std::cout << "\nright:" << rclust->isFw << " size:" << rclust->mems.size() << " cov:" << rclust->coverage << "\n";
+          for (size_t i = 0; i < rclust->mems.size(); i++){
+            std::cout << "--- t" << rclust->mems[i].tpos << " r"
+                      << rclust->mems[i].memInfo->rpos << " cid:"
+                      << rclust->mems[i].memInfo->cid << " cpos: "
+                      << rclust->mems[i].memInfo->cpos << " len:"
+                      << rclust->mems[i].memInfo->memlen << " fw:"
+                      << rclust->mems[i].memInfo->cIsFw << "\n";
+          }
+        }
+        uint32_t currCoverage =  jointMemsList.back().coverage();
+        if (maxCoverage < currCoverage) {
+          maxCoverage = currCoverage;
         }
       }
     }
@@ -178,53 +229,113 @@ void joinReadsAndFilter(spp::sparse_hash_map<size_t,std::vector<util::MemCluster
   }
 }
 
-std::string extractReadSeq(const std::string readSeq, uint32_t rstart, uint32_t rend, bool isFw) {
-  std::string subseq = readSeq.substr(rstart, rend-rstart);
-  if (isFw)
-    return subseq;
-  return util::reverseComplement(subseq); //reverse-complement the substring
+// fills readSubstr with the codes of [rstart, rend) of the read on the requested strand
+void extractReadSeq(const pufferfish::EncodedRead& read, uint32_t rstart, uint32_t rend, bool isFw,
+                    std::vector<uint8_t>& readSubstr) {
+  read.extract(rstart, rend, isFw, readSubstr);
 }
 
-// decode CIGAR, just like : https://github.com/lh3/ksw2/blob/master/cli.c#L134
-std::string cigar2str(const ksw_extz_t* ez){
-  std::string cigar ;
-  if(ez->n_cigar > 0){
-    cigar.resize(ez->n_cigar*2) ;
-    for(int i = 0 ; i < ez->n_cigar ; ++i){
-      cigar += (std::to_string(ez->cigar[i]>>4) + "MID"[ez->cigar[i]&0xf]) ;
-    }
-  }
-  return cigar ;
-}
-
-std::string calculateCigar (std::string& read,
-                            std::string& ref,
-                            ksw2pp::KSW2Aligner& aligner,
-                            std::vector<util::MemCluster>::iterator clust,
-                            bool verbose=true) {
+// read holds the (already encoded) read codes, refCodes is scratch space
+// used to encode ref so that we can call the uint8_t overload of the aligner.
+// slack is how much more score (relative to a perfect alignment of the read)
+// the cluster may lose and still be reported; it is charged for this gap,
+// and false is returned if the cluster can no longer make it.
+bool calculateCigar (const std::vector<uint8_t>& read,
+                     std::string& ref,
+                     std::vector<uint8_t>& refCodes,
+                     ksw2pp::KSW2Aligner& aligner,
+                     pufferfish::AlignmentCache& alnCache,
+                     pufferfish::MyersEditDistance& editDistance,
+                     int& slack,
+                     std::vector<util::MemCluster>::iterator clust,
+                     bool verbose=true) {
+  int readLen = static_cast<int>(read.size());
   if (read.empty()) {
-    clust->cigar += (std::to_string(ref.length())+"D") ;
+    clust->cigar.push(ref.length(), 'D');
     clust->score += ref.length() * GAP_SCORE;
+    slack += ref.length() * GAP_SCORE;
   } else if (ref.empty()) {
-    clust->cigar += (std::to_string(read.length())+"I") ;
-    clust->score += read.length() * GAP_SCORE;
+    clust->cigar.push(read.size(), 'I');
+    clust->score += read.size() * GAP_SCORE;
+    slack -= readLen * (MATCH_SCORE - GAP_SCORE);
   }
   else {
-    auto score = aligner(read.c_str(),
-                         read.length(),
-                         ref.c_str(),
-                         ref.length(),
-                         ksw2pp::EnumToType<ksw2pp::KSW2AlignmentType::GLOBAL>()) ;
-    clust->score += score;
+    pufferfish::EncodedRead::encodeSeq(ref, refCodes);
+    int refLen = static_cast<int>(refCodes.size());
+    // read and reference gaps of the same length almost always differ by
+    // substitutions only, so score them base by base instead of aligning.
+    // If that leaves more mismatches than matches, there is probably an
+    // indel pair in the gap after all and we let the aligner find it.
+    if (read.size() == refCodes.size()) {
+      int numMismatch = static_cast<int>(pufferfish::EncodedRead::countMismatches(read.data(), refCodes.data(), read.size()));
+      int numMatch = static_cast<int>(read.size()) - numMismatch;
+      int ungappedScore = numMatch * MATCH_SCORE + numMismatch * MISMATCH_SCORE;
+      if (ungappedScore >= 0) {
+        clust->score += ungappedScore;
+        clust->cigar.push(read.size(), 'M');
+        slack -= readLen * MATCH_SCORE - ungappedScore;
+        return slack >= 0;
+      }
+    } else {
+      // if the gaps are identical but for a single run of extra bases in
+      // one of them, one gap (placed as far right as possible, like KSW2
+      // does) is the optimal alignment: any alignment needs at least that
+      // many gap bases, and can't have more matches
+      int shortLen = std::min(readLen, refLen);
+      int prefix{0};
+      while (prefix < shortLen and read[prefix] == refCodes[prefix] and
+             read[prefix] < pufferfish::EncodedRead::invalidCode) { ++prefix; }
+      int suffix{0};
+      while (suffix < shortLen - prefix and read[readLen - 1 - suffix] == refCodes[refLen - 1 - suffix] and
+             read[readLen - 1 - suffix] < pufferfish::EncodedRead::invalidCode) { ++suffix; }
+      if (prefix + suffix == shortLen) {
+        int gapLen = std::abs(readLen - refLen);
+        int score = shortLen * MATCH_SCORE - (aligner.config().gapo + gapLen * aligner.config().gape);
+        if (prefix > 0) { clust->cigar.push(prefix, 'M'); }
+        clust->cigar.push(gapLen, readLen > refLen ? 'I' : 'D');
+        if (suffix > 0) { clust->cigar.push(suffix, 'M'); }
+        clust->score += score;
+        slack -= readLen * MATCH_SCORE - score;
+        return slack >= 0;
+      }
+    }
+    // Before aligning, bound the score of the gap by its edit distance; if
+    // even that bound would take the cluster below the minimum score, the
+    // whole cluster is hopeless and there is no need for the DP.
+    int maxDist = editDistance.maxDistance(readLen, refLen, readLen * MATCH_SCORE - slack);
+    int dist = (maxDist < 0) ? -1 : editDistance(read.data(), readLen, refCodes.data(), refLen, maxDist);
+    if (dist < 0) {
+      if (verbose) std::cout << "gap can't reach the minimum score, discarding cluster\n";
+      return false;
+    }
+    slack -= readLen * MATCH_SCORE - editDistance.maxScore(readLen, refLen, dist);
+    // the gap lies between two exact matches, so the alignment can't stray
+    // further from the diagonal than the difference of the two gap lengths
+    int diagDiff = std::abs(static_cast<int>(read.size()) - static_cast<int>(refCodes.size()));
+    aligner.config().bandwidth = diagDiff + EPS;
     if (verbose) {
-      std::cout << "read str " << read << "\nref str " << ref << "\n";
-      std::cout << "cigar before : " << clust->cigar << "\n";
+      std::cout << "read str " << pufferfish::EncodedRead::decode(read.data(), read.size()) << "\nref str " << ref << "\n";
+      std::cout << "cigar before : " << clust->cigar.length << " ops\n";
+    }
+    // the same gap is often aligned against the same sequence under many references
+    auto cached = alnCache.find(read, refCodes, aligner.config());
+    if (cached) {
+      clust->score += cached->score;
+      clust->cigar.append(cached->cigar.data(), cached->cigar.data() + cached->cigar.size());
+    } else {
+      auto score = aligner(read.data(),
+                           read.size(),
+                           refCodes.data(),
+                           refCodes.size(),
+                           ksw2pp::EnumToType<ksw2pp::KSW2AlignmentType::GLOBAL>()) ;
+      auto& ez = aligner.result();
+      alnCache.insert(read, refCodes, aligner.config(), score, ez.cigar, ez.n_cigar);
+      clust->score += score;
+      clust->cigar.append(ez.cigar, ez.cigar + ez.n_cigar);
     }
-    clust->cigar += cigar2str(&aligner.result()) ;
-    if(verbose) std::cout << "cigar after : " << clust->cigar << "\n";
+    if(verbose) std::cout << "cigar after : " << clust->cigar.length << " ops\n";
   }
-  if (verbose) std::cout << clust->cigar << "\n";
-  return clust->cigar;
+  return slack >= 0;
 }
 
 template <typename PufferfishIndexT>
@@ -247,26 +358,36 @@ util::ContigBlock getContigBlock(std::vector<util::UniMemInfo>::iterator memInfo
 template <typename PufferfishIndexT>
 void createSeqPairs(PufferfishIndexT* pfi,
                     std::vector<util::MemCluster>::iterator clust,
-                    fastx_parser::ReadSeq& read,
+                    fastx_parser::ReadSeqView& read,
+                    const pufferfish::EncodedRead& encRead,
                     RefSeqConstructor<PufferfishIndexT>& refSeqConstructor,
                     spp::sparse_hash_map<uint32_t, util::ContigBlock>& contigSeqCache,
                     uint32_t tid,
                     ksw2pp::KSW2Aligner& aligner,
+                    pufferfish::AlignmentCache& alnCache,
+                    pufferfish::MyersEditDistance& editDistance,
+                    std::vector<uint32_t>& cigarOps,
+                    int minScore,
                     bool verbose,
                     bool naive=true){
 
   //(void)verbose;
   (void)naive;
   //std::string& readName = read.name ;
-  std::string& readSeq = read.seq ;
   auto clustSize = clust->mems.size()  ;
   clust->score = 0;
-  auto readLen = readSeq.length() ;
+  auto readLen = encRead.length() ;
+  // scratch space for the encoded read / reference pieces we align
+  std::vector<uint8_t> readSubstr;
+  std::vector<uint8_t> refCodes;
+  // how much score the cluster may lose to its gaps and still reach minScore
+  int slack = (minScore == std::numeric_limits<int>::min()) ?
+    std::numeric_limits<int>::max() / 2 : static_cast<int>(readLen) * MATCH_SCORE - minScore;
 
   //@debug
   if(verbose) std::cout << "Clust size "<<clustSize<<"\n" ;
 
-  clust->cigar = "" ;
+  clust->cigar.reset(cigarOps);
   auto prevTPos = clust->mems[0].tpos;
   size_t it = 0;
   //FIXME why we have failures in graph!! if valid, discard the whole hit, otherwise, find the bug
@@ -290,16 +411,20 @@ void createSeqPairs(PufferfishIndexT* pfi,
       continue;
     }
 
-    clust->cigar += (std::to_string(mmTstart-prevTPos) + "M");
+    clust->cigar.push(mmTstart-prevTPos, 'M');
     clust->score += ((mmTstart-prevTPos) * MATCH_SCORE);
     prevTPos = clust->mems[it+1].tpos;
 
     if (mmTend == mmTstart) { //Insertion in read
       if (rend-rstart > 0) { //validity check TODO if passed should be removed for final version
           //std::string tmp = extractReadSeq(readSeq, rstart, rend, clust->isFw) ;
-        std::string readSubstr = extractReadSeq(readSeq, rstart, rend, clust->isFw);
+        extractReadSeq(encRead, rstart, rend, clust->isFw, readSubstr);
         std::string refSeq = "";
-        calculateCigar(readSubstr, refSeq, aligner, clust, verbose);
+        if (!calculateCigar(readSubstr, refSeq, refCodes, aligner, alnCache, editDistance, slack, clust, verbose)) {
+          clust->score = std::numeric_limits<int>::min();
+          clust->isVisited = true;
+          return;
+        }
       }
       else {
           std::cerr << "ERROR: in pufferfishAligner tstart = tend while rend < rstart\n" << read.name << "\n";
@@ -308,7 +433,7 @@ void createSeqPairs(PufferfishIndexT* pfi,
     else if (rstart == rend) { //deletion in read
       if (mmTend-mmTstart > 0) { //validity check TODO if passed should be removed for final version
         //std::string tmp = extractReadSeq(readSeq, rstart, rend, clust->isFw) ;
-        clust->cigar += (std::to_string(mmTend-mmTstart)+"D") ;
+        clust->cigar.push(mmTend-mmTstart, 'D');
         clust->score += (mmTend-mmTstart) * GAP_SCORE;
         //calculateCigar(extractReadSeq(readSeq, rstart, rend, clust->isFw), "", aligner, clust);
       }
@@ -327,7 +452,7 @@ void createSeqPairs(PufferfishIndexT* pfi,
 
       // heuristic : length of mismatched parts of txp and read are both one??? It's a definite mismatch!!
       if (distOnTxp == 1 && (rend - rstart) == 1) {
-        clust->cigar += "1M";
+        clust->cigar.push(1, 'M');
         clust->score += MISMATCH_SCORE;
       }
 
@@ -355,22 +480,26 @@ void createSeqPairs(PufferfishIndexT* pfi,
           //std::cout << "SUCCESS\n";
           //std::cout << " part of read "<<extractReadSeq(readSeq, rstart, rend, clust->isFw)<<"\n"
           //         << " part of ref  " << refSeq << "\n";
-          std::string readSubstr = extractReadSeq(readSeq, rstart, rend, clust->isFw);
-          calculateCigar(readSubstr, refSeq, aligner, clust, verbose) ;
+          extractReadSeq(encRead, rstart, rend, clust->isFw, readSubstr);
+          if (!calculateCigar(readSubstr, refSeq, refCodes, aligner, alnCache, editDistance, slack, clust, verbose)) {
+            clust->score = std::numeric_limits<int>::min();
+            clust->isVisited = true;
+            return;
+          }
         } else{
-          //FIXME discard whole hit!!!
+          // no path between the two uni-MEMs: discard the whole hit
           clust->score = std::numeric_limits<int>::min();
-          //std::cout << "Graph searched FAILED \n" ;
+          clust->isVisited = true;
+          return;
         }
       }
     }
   }
   // update cigar and add matches for last unimem(s)
   // after the loop, "it" is pointing to the last unimem in the change
-  clust->cigar += (std::to_string(clust->mems[it].tpos + clust->mems[it].memInfo->memlen-prevTPos) + "M");
+  clust->cigar.push(clust->mems[it].tpos + clust->mems[it].memInfo->memlen-prevTPos, 'M');
   clust->score += ((clust->mems[it].tpos + clust->mems[it].memInfo->memlen-prevTPos) * MATCH_SCORE);
 
-
   // Take care of left and right gaps/mismatches
   util::ContigBlock dummy = {std::numeric_limits<uint64_t>::max(),0,0,"",true};
 
@@ -381,18 +510,18 @@ void createSeqPairs(PufferfishIndexT* pfi,
   auto endRem = readLen - (clust->mems[it].memInfo->rpos + clust->mems[it].memInfo->memlen);
   auto startRem = clust->mems[0].memInfo->rpos;
 
-  std::string startReadSeq = "";
-  std::string endReadSeq = "";
+  std::vector<uint8_t> startReadSeq;
+  std::vector<uint8_t> endReadSeq;
   if (clust->isFw) {
-    startReadSeq = extractReadSeq(readSeq, 0, clust->mems[0].memInfo->rpos, clust->isFw);
-    endReadSeq = extractReadSeq(readSeq, (clust->mems[it].memInfo->rpos + clust->mems[it].memInfo->memlen), readLen, clust->isFw);
+    extractReadSeq(encRead, 0, clust->mems[0].memInfo->rpos, clust->isFw, startReadSeq);
+    extractReadSeq(encRead, (clust->mems[it].memInfo->rpos + clust->mems[it].memInfo->memlen), readLen, clust->isFw, endReadSeq);
   }
 
   if (!clust->isFw) {
     endRem = clust->mems[it].memInfo->rpos;
     startRem = readLen - (clust->mems[0].memInfo->rpos + clust->mems[0].memInfo->memlen);
-    startReadSeq = extractReadSeq(readSeq, (clust->mems[0].memInfo->rpos + clust->mems[0].memInfo->memlen), readLen, clust->isFw);
-    endReadSeq = extractReadSeq(readSeq, 0, clust->mems[it].memInfo->rpos, clust->isFw);
+    extractReadSeq(encRead, (clust->mems[0].memInfo->rpos + clust->mems[0].memInfo->memlen), readLen, clust->isFw, startReadSeq);
+    extractReadSeq(encRead, 0, clust->mems[it].memInfo->rpos, clust->isFw, endReadSeq);
   }
 
   /*if (verbose) std::cout << firstContigDirWRTref << " " << startRem << " " << startReadSeq
@@ -415,19 +544,24 @@ void createSeqPairs(PufferfishIndexT* pfi,
                                          verbose);
     if(res == Task::SUCCESS) {
       if (verbose)
-        std::cerr << "\n\n\nSUCCESS   end extension::: " << read.name << "\n" << "read: " << endReadSeq << " ref: " << refSeq << "\n"
+        std::cerr << "\n\n\nSUCCESS   end extension::: " << read.name << "\n" << "read: " << pufferfish::EncodedRead::decode(endReadSeq.data(), endReadSeq.size()) << " ref: " << refSeq << "\n"
                 << "tid " << tid << " starting from " << clust->mems[it].tpos + clust->mems[it].memInfo->memlen << " endRem " << endRem << " cid " << scb.contigIdx_ << "\n" ;
       
       //std::cout << " part of read "<<endReadSeq<<"\n"
       //          << " part of ref  " << refSeq << "\n";
-      calculateCigar(endReadSeq, refSeq, aligner, clust, verbose) ;
+      if (!calculateCigar(endReadSeq, refSeq, refCodes, aligner, alnCache, editDistance, slack, clust, verbose)) {
+        clust->score = std::numeric_limits<int>::min();
+        clust->isVisited = true;
+        return;
+      }
     } else{
       if (verbose)
-        std::cerr << "\n\n\nFAILURE   end extension::: " << read.name << "\n" << "read: " << endReadSeq << " ref: " << refSeq << "\n"
+        std::cerr << "\n\n\nFAILURE   end extension::: " << read.name << "\n" << "read: " << pufferfish::EncodedRead::decode(endReadSeq.data(), endReadSeq.size()) << " ref: " << refSeq << "\n"
                 << "tid " << tid << " starting from " << clust->mems[it].tpos + clust->mems[it].memInfo->memlen << " endRem " << endRem << " cid " << scb.contigIdx_ << "\n" ;
       // discard whole hit!!!
       clust->score = std::numeric_limits<int>::min();
-      //std::cout << "Graph searched FAILED \n" ;
+      clust->isVisited = true;
+      return;
     }
   }
   if (startRem > 0) {
@@ -442,8 +576,9 @@ void createSeqPairs(PufferfishIndexT* pfi,
     }
     uint32_t cend = firstContigDirWRTref?clust->mems[0].memInfo->cpos:(clust->mems[0].memInfo->cpos + clust->mems[0].memInfo->memlen-1);
 
+    // the overhang is the startRem bases right before the first uni-MEM
     Task res = refSeqConstructor.fillSeq(tid,
-                                         clust->mems[0].tpos + clust->mems[0].memInfo->memlen-1,
+                                         clust->mems[0].tpos - startRem - 1,
                                          firstContigDirWRTref,
                                          dummy, 0, ecb, cend,
                                          firstContigDirWRTref,
@@ -453,45 +588,74 @@ void createSeqPairs(PufferfishIndexT* pfi,
     if(res == Task::SUCCESS) {
       //std::cout << " part of read "<<startReadSeq<<"\n"
       //          << " part of ref  " << refSeq << "\n";
-      calculateCigar(endReadSeq, refSeq, aligner, clust, verbose) ;
+      // the start overhang precedes everything aligned so far
+      size_t startOps = clust->cigar.offset + clust->cigar.length;
+      if (!calculateCigar(startReadSeq, refSeq, refCodes, aligner, alnCache, editDistance, slack, clust, verbose)) {
+        clust->score = std::numeric_limits<int>::min();
+        clust->isVisited = true;
+        return;
+      }
+      std::rotate(cigarOps.begin() + clust->cigar.offset, cigarOps.begin() + startOps, cigarOps.end());
     } else {
-      std::cerr << "beginning extension::: " << read.name << "\n" << "read: " << endReadSeq << " ref: " << refSeq << "\n";
+      if (verbose)
+        std::cerr << "beginning extension::: " << read.name << "\n" << "read: " << pufferfish::EncodedRead::decode(startReadSeq.data(), startReadSeq.size()) << " ref: " << refSeq << "\n";
       // discard whole hit!!!
       clust->score = std::numeric_limits<int>::min();
-      //std::cout << "Graph searched FAILED \n" ;
+      clust->isVisited = true;
+      return;
     }
   }
   clust->isVisited = true;
-  if (verbose) std::cout << read.name << " " << clust->isFw << " " << clust->mems.size() << "\n" << read.seq << "\nSCORE: " << clust->score << "\nCIGAR: " << clust->cigar << "\n" ;
+  if (verbose) std::cout << read.name << " " << clust->isFw << " " << clust->mems.size() << "\n" << read.seq << "\nSCORE: " << clust->score << "\nCIGAR ops: " << clust->cigar.length << "\n" ;
+}
+
+// A cluster whose uni-MEMs cover the whole read (in particular, the single
+// end-to-end uni-MEM clusters of MemCollector::projectPerfectHit) matches
+// the reference exactly: there is nothing to align.
+void setFullCoverage(std::vector<util::MemCluster>::iterator clust, std::vector<uint32_t>& cigarOps) {
+  clust->score = clust->coverage * MATCH_SCORE;
+  clust->cigar.reset(cigarOps);
+  clust->cigar.push(clust->coverage, 'M');
+  clust->isVisited = true;
 }
 
 template <typename ReadPairT ,typename PufferfishIndexT>
 void traverseGraph(ReadPairT& rpair,
+                   const pufferfish::EncodedRead& leftRead,
+                   const pufferfish::EncodedRead& rightRead,
                    util::JointMems& hit,
                    PufferfishIndexT& pfi,
                    RefSeqConstructor<PufferfishIndexT>& refSeqConstructor,
                    spp::sparse_hash_map<uint32_t, util::ContigBlock>& contigSeqCache,
                    ksw2pp::KSW2Aligner& aligner,
+                   pufferfish::AlignmentCache& alnCache,
+                   pufferfish::MyersEditDistance& editDistance,
+                   std::vector<uint32_t>& cigarOps,
+                   int minScore,
                    bool verbose,
                    bool naive=false){
 
   size_t tid = hit.tid ;
-  auto readLen = rpair.first.seq.length() ;
+  auto leftLen = leftRead.length() ;
+  auto rightLen = rightRead.length() ;
   if(verbose) std::cout << rpair.first.name << "\n" ;
-
-  if(!hit.leftClust->isVisited && hit.leftClust->coverage < readLen)
-    createSeqPairs(&pfi, hit.leftClust, rpair.first, refSeqConstructor, contigSeqCache, tid, aligner, verbose, naive);
-  else if (hit.leftClust->coverage == readLen) {
-    hit.leftClust->score += hit.leftClust->coverage * MATCH_SCORE;
-    hit.leftClust->cigar = std::to_string(hit.leftClust->coverage) + "M";
+  // even with a perfect mate, each end has to make up the rest of minScore
+  int leftMinScore{minScore}, rightMinScore{minScore};
+  if (minScore != std::numeric_limits<int>::min()) {
+    leftMinScore = minScore - static_cast<int>(rightLen) * MATCH_SCORE;
+    rightMinScore = minScore - static_cast<int>(leftLen) * MATCH_SCORE;
   }
+
+  // a cluster may be shared by several joint hits; it only has to be aligned once
+  if(!hit.leftClust->isVisited && hit.leftClust->coverage < leftLen)
+    createSeqPairs(&pfi, hit.leftClust, rpair.first, leftRead, refSeqConstructor, contigSeqCache, tid, aligner, alnCache, editDistance, cigarOps, leftMinScore, verbose, naive);
+  else if (!hit.leftClust->isVisited)
+    setFullCoverage(hit.leftClust, cigarOps);
     //goOverClust(pfi, hit.leftClust, rpair.first, contigSeqCache, tid, verbose) ;
-  if(!hit.rightClust->isVisited && hit.rightClust->coverage < readLen)
-    createSeqPairs(&pfi, hit.rightClust, rpair.second, refSeqConstructor, contigSeqCache, tid, aligner, verbose, naive);
-  else if (hit.rightClust->coverage == readLen) {
-    hit.rightClust->score += hit.rightClust->coverage * MATCH_SCORE;
-    hit.rightClust->cigar = std::to_string(hit.rightClust->coverage) + "M";
-  }
+  if(!hit.rightClust->isVisited && hit.rightClust->coverage < rightLen)
+    createSeqPairs(&pfi, hit.rightClust, rpair.second, rightRead, refSeqConstructor, contigSeqCache, tid, aligner, alnCache, editDistance, cigarOps, rightMinScore, verbose, naive);
+  else if (!hit.rightClust->isVisited)
+    setFullCoverage(hit.rightClust, cigarOps);
     //goOverClust(pfi, hit.rightClust, rpair.second, contigSeqCache, tid, verbose) ;
 }
 
@@ -501,10 +665,13 @@ template <typename PufferfishIndexT>
 void processReadsPair(paired_parser* parser,
                      PufferfishIndexT& pfi,
                      SpinLockT* iomutex,
-                     std::shared_ptr<spdlog::logger> outQueue,
+                     pufferfish::OutputWriter* outWriter,
+                     pufferfish::RecordSorter* sorter,
+                     pufferfish::EquivalenceClassCounter* eqCounter,
                      HitCounters& hctr,
                      AlignmentOpts* mopts){
   MemCollector<PufferfishIndexT> memCollector(&pfi) ;
+  memCollector.setMaxRefOcc(mopts->maxRefOcc);
 
   //create aligner
   spp::sparse_hash_map<uint32_t, util::ContigBlock> contigSeqCache ;
@@ -517,7 +684,19 @@ void processReadsPair(paired_parser* parser,
   std::vector<std::string> refBlocks ;
 
   auto logger = spdlog::get("stderrLog") ;
-  fmt::MemoryWriter sstream ;
+  // this thread's output for the current chunk of reads, handed over to
+  // the writer thread (which gives back an empty buffer) once it is done
+  fmt::MemoryWriter scratch;
+  // when sorting, the chunk's (BAM) records go to this thread's run instead
+  pufferfish::RecordSorter::Run* run = sorter ? sorter->nextRun() : nullptr;
+  bool bamRecords = mopts->bamOut or run;
+  fmt::MemoryWriter* sstream = (outWriter and !run) ? outWriter->acquire() : &scratch;
+  pufferfish::MappingChunkWriter chunkWriter;
+  // this thread's equivalence class counts (--eqclasses)
+  pufferfish::EquivalenceClassCounter eqClasses;
+  // --pseudo: the references each read is compatible with, and nothing else
+  pufferfish::PseudoAligner<PufferfishIndexT> pseudoAligner(&pfi);
+  std::vector<uint32_t> pseudoLabel;
   //size_t batchSize{2500} ;
   size_t readLen{0};
   size_t totLen{0};
@@ -527,6 +706,9 @@ void processReadsPair(paired_parser* parser,
   std::vector<util::JointMems> jointHits ;
   PairedAlignmentFormatter<PufferfishIndexT*> formatter(&pfi);
   util::QueryCache qc;
+  // each mate is encoded once and shared by the mem collector and the aligner
+  pufferfish::EncodedRead leftRead;
+  pufferfish::EncodedRead rightRead;
 
   //@fatemeh Initialize aligner ksw 
   ksw2pp::KSW2Config config ;
@@ -537,9 +719,17 @@ void processReadsPair(paired_parser* parser,
   config.bandwidth = -1 ;
   config.flag = KSW_EZ_RIGHT ;
   aligner.config() = config ;
+
+  pufferfish::AlignmentCache alnCache;
+  pufferfish::MyersEditDistance editDistance(MATCH_SCORE, MISMATCH_SCORE, -GAP_SCORE);
+  MateRescuer<PufferfishIndexT> mateRescuer(&pfi, &refSeqConstructor, &contigSeqCache, &aligner, &editDistance);
+  std::vector<std::pair<int, QuasiAlignment>> rescued;
+  // the (packed) CIGARs of all the alignments of the current read pair
+  std::vector<uint32_t> cigarOps;
   
   auto rg = parser->getReadGroup() ;
   while(parser->refill(rg)){
+    chunkWriter.setOrigin(rg.file(), rg.firstRead());
     for(auto& rpair : rg){
       readLen = rpair.first.seq.length() ;
       totLen = readLen + rpair.second.seq.length();
@@ -553,6 +743,20 @@ void processReadsPair(paired_parser* parser,
       leftHits.clear() ;
       rightHits.clear() ;
       memCollector.clear();
+      cigarOps.clear();
+      leftRead.encode(rpair.first.seq);
+      rightRead.encode(rpair.second.seq);
+
+      if (mopts->pseudo) {
+        pseudoAligner(leftRead, rightRead, qc, pseudoLabel);
+        if (!pseudoLabel.empty()) {
+          ++hctr.numMapped;
+          hctr.peHits += pseudoLabel.size();
+          hctr.totHits += pseudoLabel.size();
+          if (eqCounter) { eqClasses.addLabel(pseudoLabel); }
+        }
+        continue;
+      }
 
       //help me to debug, will deprecate later
       //std::cout << "\n first seq in pair " << rpair.first.seq << "\n" ;
@@ -560,7 +764,7 @@ void processReadsPair(paired_parser* parser,
 
       //std::cout << "\n going inside hit collector \n" ;
       //readLen = rpair.first.seq.length() ;
-      bool lh = memCollector(rpair.first.seq,
+      bool lh = memCollector(leftRead,
                              leftHits,
                              mopts->maxSpliceGap,
                              MateStatus::PAIRED_END_LEFT,
@@ -569,7 +773,7 @@ void processReadsPair(paired_parser* parser,
                              /*
                              mopts->consistentHits,
                              refBlocks*/) ;
-      bool rh = memCollector(rpair.second.seq,
+      bool rh = memCollector(rightRead,
                              rightHits,
                              mopts->maxSpliceGap,
                              MateStatus::PAIRED_END_RIGHT,
@@ -603,7 +807,23 @@ void processReadsPair(paired_parser* parser,
       } else{
         //ignore orphans for now
       }
-
+      // report at most maxNumHits mappings, preferring the ones with the highest
+      // coverage (ties are broken by position so that the choice is deterministic)
+      if (jointHits.size() > mopts->maxNumHits) {
+        std::sort(jointHits.begin(), jointHits.end(),
+                  [](util::JointMems& h1, util::JointMems& h2) -> bool {
+                    auto c1 = h1.coverage();
+                    auto c2 = h2.coverage();
+                    if (c1 != c2) { return c1 > c2; }
+                    if (h1.tid != h2.tid) { return h1.tid < h2.tid; }
+                    if (h1.leftClust->firstRefPos() != h2.leftClust->firstRefPos()) {
+                      return h1.leftClust->firstRefPos() < h2.leftClust->firstRefPos();
+                    }
+                    return h1.rightClust->firstRefPos() < h2.rightClust->firstRefPos();
+                  });
+        jointHits.erase(jointHits.begin() + mopts->maxNumHits, jointHits.end());
+        ++hctr.tooManyHits;
+      }
       //jointHits is a vector
       //this can be used for BFS
       //NOTE sanity check
@@ -636,39 +856,26 @@ void processReadsPair(paired_parser* parser,
         }*/
 
       int maxScore = std::numeric_limits<int>::min();
-      /*
+      // pairs scoring below scoreRatio of a perfect pair are considered spurious
+      int minScore = static_cast<int>(mopts->scoreRatio * totLen * MATCH_SCORE);
       bool doTraverse = !mopts->justMap;
       if (doTraverse) {
-        //TODO Have to make it per thread 
-        //have to make write access thread safe
-        //std::cout << "traversing graph \n" ;
-
-        if(!jointHits.empty() && jointHits.front().coverage() < 2*readLen) {
-          for(auto& hit : jointHits){
-            traverseGraph(rpair, hit, pfi, refSeqConstructor, contigSeqCache, aligner, verbose) ;
-            // update minScore across all hits
-            if(hit.leftClust->score + hit.rightClust->score > maxScore) {
-              maxScore = hit.leftClust->score + hit.rightClust->score;
-            }
+        for(auto& hit : jointHits){
+          traverseGraph(rpair, leftRead, rightRead, hit, pfi, refSeqConstructor, contigSeqCache, aligner, alnCache, editDistance, cigarOps, minScore, verbose) ;
+          if (hit.leftClust->score == std::numeric_limits<int>::min() or
+              hit.rightClust->score == std::numeric_limits<int>::min()) {
+            continue;
           }
-        }
-        else if(!jointHits.empty()){
-          maxScore = 2 * readLen * MATCH_SCORE ;
-          for(auto& jointHit : jointHits){
-            jointHit.leftClust->score = jointHit.leftClust->coverage * MATCH_SCORE ;
-            jointHit.rightClust->score = jointHit.rightClust->coverage * MATCH_SCORE;
-            jointHit.leftClust->cigar = std::to_string(readLen)+"M" ;
-            jointHit.rightClust->cigar = std::to_string(readLen)+"M" ;
+          // update maxScore across all hits
+          if(hit.leftClust->score + hit.rightClust->score > maxScore) {
+            maxScore = hit.leftClust->score + hit.rightClust->score;
           }
-
         }
       }
-      */
 
 
       hctr.totHits += jointHits.size();
       hctr.peHits += jointHits.size();
-      hctr.numMapped += !jointHits.empty() ? 1 : 0;
       if (jointHits.size() > hctr.maxMultimapping) {
         hctr.maxMultimapping = jointHits.size();
       }
@@ -679,7 +886,7 @@ void processReadsPair(paired_parser* parser,
           //std::cerr << "Failed: " << rpair.first.name << "\n";
           continue;
         }
-        if(mopts->justMap or (jointHit.leftClust->score + jointHit.rightClust->score == maxScore)) {
+        if(mopts->justMap or (maxScore >= minScore and jointHit.leftClust->score + jointHit.rightClust->score == maxScore)) {
           //std::cerr << "Selected: " << rpair.first.name << "\n";
           jointAlignments.emplace_back(jointHit.tid,           // reference id
                                       jointHit.leftClust->getTrFirstHitPos(),     // reference pos
@@ -695,17 +902,101 @@ void processReadsPair(paired_parser* parser,
           qaln.matePos = jointHit.rightClust->getTrFirstHitPos();
           qaln.mateIsFwd = jointHit.rightClust->isFw;
           qaln.mateStatus = MateStatus::PAIRED_END_PAIRED;
+          qaln.alnScore = mopts->justMap ? static_cast<int32_t>(jointHit.coverage())
+                                         : jointHit.leftClust->score + jointHit.rightClust->score;
         }
       }
 
+      // only one of the mates mapped: look for the other one next to each of its
+      // best clusters, and report the placements we can verify as proper pairs.
+      if (mopts->mateRescue and jointHits.empty() and (lh or rh)) {
+        rescued.clear();
+        for (bool anchorIsLeft : {true, false}) {
+          if (anchorIsLeft ? !lh : !rh) { continue; }
+          auto& anchorHits = anchorIsLeft ? leftHits : rightHits;
+          auto& anchorRead = anchorIsLeft ? leftRead : rightRead;
+          auto& anchorSeq = anchorIsLeft ? rpair.first : rpair.second;
+          auto& mate = anchorIsLeft ? rightRead : leftRead;
+          size_t anchorLen = anchorRead.length();
+          size_t mateLen = mate.length();
+          size_t maxCov{0};
+          for (auto& kv : anchorHits) {
+            for (auto& clust : kv.second) { maxCov = std::max(maxCov, static_cast<size_t>(clust.coverage)); }
+          }
+          int anchorMinScore = static_cast<int>(mopts->scoreRatio * anchorLen * MATCH_SCORE);
+          int mateMinScore = static_cast<int>(mopts->scoreRatio * mateLen * MATCH_SCORE);
+          uint32_t numAnchors{0};
+          // the mate lies on the other strand of its anchor
+          for (bool mateIsFw : {true, false}) {
+            mateRescuer.setMate(mate, mateIsFw);
+            for (auto& kv : anchorHits) {
+              for (auto clust = kv.second.begin(); clust != kv.second.end(); ++clust) {
+                if (clust->isFw == mateIsFw) { continue; }
+                if (clust->coverage < mopts->scoreRatio * maxCov or numAnchors >= mopts->maxNumHits) { continue; }
+                ++numAnchors;
+                util::RescuedMate res;
+                if (!mateRescuer(kv.first, *clust, mopts->maxFragmentLength, mateMinScore, cigarOps, res)) { continue; }
+                // the anchor gets its CIGAR and score like any other cluster
+                if (mopts->justMap or clust->coverage >= anchorLen) {
+                  setFullCoverage(clust, cigarOps);
+                } else {
+                  createSeqPairs(&pfi, clust, anchorSeq, anchorRead, refSeqConstructor, contigSeqCache, kv.first,
+                                 aligner, alnCache, editDistance, cigarOps, anchorMinScore, verbose);
+                  if (clust->score == std::numeric_limits<int>::min()) { continue; }
+                }
+                size_t anchorPos = clust->getTrFirstHitPos();
+                rescued.emplace_back(clust->score + res.score,
+                                     QuasiAlignment(kv.first,
+                                                    anchorIsLeft ? anchorPos : res.pos,
+                                                    anchorIsLeft ? clust->isFw : res.isFw,
+                                                    anchorIsLeft ? anchorLen : mateLen,
+                                                    anchorIsLeft ? clust->cigar : res.cigar,
+                                                    res.fragmentLen,
+                                                    true));
+                auto& qaln = rescued.back().second;
+                qaln.mateLen = anchorIsLeft ? mateLen : anchorLen;
+                qaln.mateCigar = anchorIsLeft ? res.cigar : clust->cigar;
+                qaln.matePos = anchorIsLeft ? res.pos : anchorPos;
+                qaln.mateIsFwd = anchorIsLeft ? res.isFw : clust->isFw;
+                qaln.mateStatus = MateStatus::PAIRED_END_PAIRED;
+                qaln.alnScore = clust->score + res.score;
+              }
+            }
+          }
+        }
+        int bestRescue = std::numeric_limits<int>::min();
+        for (auto& r : rescued) { bestRescue = std::max(bestRescue, r.first); }
+        for (auto& r : rescued) {
+          if (r.first >= mopts->scoreRatio * bestRescue) {
+            jointAlignments.push_back(std::move(r.second));
+          }
+        }
+        if (!jointAlignments.empty()) {
+          ++hctr.rescuedPairs;
+          hctr.peHits += jointAlignments.size();
+          hctr.totHits += jointAlignments.size();
+        }
+      }
+
+      hctr.numMapped += !jointAlignments.empty() ? 1 : 0;
       hctr.totAlignment += jointAlignments.size();
 
-      if(mopts->krakOut){
-        writeAlignmentsToKrakenDump(rpair, formatter, jointHits, sstream);
+      if (eqCounter) {
+        eqClasses.addRead(jointAlignments);
+      } else if(mopts->krakOut){
+        writeAlignmentsToKrakenDump(rpair, formatter, jointHits, *sstream);
+      } else if (mopts->binaryOut and !mopts->noOutput) {
+        chunkWriter.addRead(jointAlignments, *sstream);
+      } else if (bamRecords and !mopts->noOutput) {
+        if (jointAlignments.size() > 0) {
+          writeAlignmentsToBAM(rpair, formatter, jointAlignments, *sstream, mopts->writeOrphans, mopts->justMap);
+        } else {
+          writeUnmappedAlignmentsToBAM(rpair, formatter, jointAlignments, *sstream);
+        }
       } else if(jointAlignments.size() > 0 and !mopts->noOutput){
-        writeAlignmentsToStream(rpair, formatter, jointAlignments, sstream, mopts->writeOrphans, mopts->justMap) ;
+        writeAlignmentsToStream(rpair, formatter, jointAlignments, *sstream, mopts->writeOrphans, mopts->justMap) ;
       } else if (jointAlignments.size() == 0 and !mopts->noOutput) {
-        writeUnmappedAlignmentsToStream(rpair, formatter, jointAlignments, sstream, mopts->writeOrphans, mopts->justMap) ;
+        writeUnmappedAlignmentsToStream(rpair, formatter, jointAlignments, *sstream, mopts->writeOrphans, mopts->justMap) ;
       }
 
 
@@ -729,17 +1020,20 @@ void processReadsPair(paired_parser* parser,
 
 
     // dump output
-    if (!mopts->noOutput) {
-      std::string outStr(sstream.str());
-      // Get rid of last newline
-      if (!outStr.empty()) {
-        outStr.pop_back();
-        outQueue->info(std::move(outStr));
-      }
-      sstream.clear();
+    chunkWriter.finish(*sstream);
+    if (run) {
+      run->add(*sstream);
+    } else if (outWriter) {
+      sstream = outWriter->submit(sstream);
+    } else {
+      sstream->clear();
     }
 
   } // processed all reads
+  if (outWriter and !run) { outWriter->release(sstream); }
+  if (eqCounter) { eqCounter->merge(eqClasses); }
+  hctr.alnCacheHits += alnCache.hits();
+  hctr.alnCacheMisses += alnCache.misses();
 }
 
 //===========
@@ -749,10 +1043,13 @@ template <typename PufferfishIndexT>
 void processReadsSingle(single_parser* parser,
                      PufferfishIndexT& pfi,
                      SpinLockT* iomutex,
-                     std::shared_ptr<spdlog::logger> outQueue,
+                     pufferfish::OutputWriter* outWriter,
+                     pufferfish::RecordSorter* sorter,
+                     pufferfish::EquivalenceClassCounter* eqCounter,
                      HitCounters& hctr,
                      AlignmentOpts* mopts){
   MemCollector<PufferfishIndexT> memCollector(&pfi) ;
+  memCollector.setMaxRefOcc(mopts->maxRefOcc);
 
   //create aligner
   spp::sparse_hash_map<uint32_t, util::ContigBlock> contigSeqCache ;
@@ -760,7 +1057,19 @@ void processReadsSingle(single_parser* parser,
   std::vector<std::string> refBlocks ;
 
   auto logger = spdlog::get("stderrLog") ;
-  fmt::MemoryWriter sstream ;
+  // this thread's output for the current chunk of reads, handed over to
+  // the writer thread (which gives back an empty buffer) once it is done
+  fmt::MemoryWriter scratch;
+  // when sorting, the chunk's (BAM) records go to this thread's run instead
+  pufferfish::RecordSorter::Run* run = sorter ? sorter->nextRun() : nullptr;
+  bool bamRecords = mopts->bamOut or run;
+  fmt::MemoryWriter* sstream = (outWriter and !run) ? outWriter->acquire() : &scratch;
+  pufferfish::MappingChunkWriter chunkWriter;
+  // this thread's equivalence class counts (--eqclasses)
+  pufferfish::EquivalenceClassCounter eqClasses;
+  // --pseudo: the references each read is compatible with, and nothing else
+  pufferfish::PseudoAligner<PufferfishIndexT> pseudoAligner(&pfi);
+  std::vector<uint32_t> pseudoLabel;
   //size_t batchSize{2500} ;
   size_t readLen{0};
   size_t totLen{0};
@@ -770,6 +1079,7 @@ void processReadsSingle(single_parser* parser,
   std::vector<util::JointMems> jointHits ;
   PairedAlignmentFormatter<PufferfishIndexT*> formatter(&pfi);
   util::QueryCache qc;
+  pufferfish::EncodedRead encRead;
 
   //@fatemeh Initialize aligner ksw
   ksw2pp::KSW2Config config ;
@@ -783,6 +1093,7 @@ void processReadsSingle(single_parser* parser,
 
   auto rg = parser->getReadGroup() ;
   while(parser->refill(rg)){
+    chunkWriter.setOrigin(rg.file(), rg.firstRead());
     for(auto& read : rg){
       readLen = read.seq.length() ;
       totLen = readLen;
@@ -793,8 +1104,20 @@ void processReadsSingle(single_parser* parser,
       jointHits.clear() ;
       leftHits.clear() ;
       memCollector.clear();
+      encRead.encode(read.seq);
+
+      if (mopts->pseudo) {
+        pseudoAligner(encRead, qc, pseudoLabel);
+        if (!pseudoLabel.empty()) {
+          ++hctr.numMapped;
+          hctr.seHits += pseudoLabel.size();
+          hctr.totHits += pseudoLabel.size();
+          if (eqCounter) { eqClasses.addLabel(pseudoLabel); }
+        }
+        continue;
+      }
 
-      bool lh = memCollector(read.seq,
+      bool lh = memCollector(encRead,
                              leftHits,
                              mopts->maxSpliceGap,
                              MateStatus::SINGLE_END,
@@ -852,47 +1175,35 @@ void processReadsSingle(single_parser* parser,
             */
           }
         }
-        double thresh = mopts->scoreRatio * maxCoverage;
-        // sort the hits by coverage
-        std::sort(
-            validHits.begin(), validHits.end(),
-            [thresh](
-                std::pair<uint32_t, decltype(leftHits)::mapped_type::iterator>&
-                    e1, std::pair<uint32_t, decltype(leftHits)::mapped_type::iterator>& e2) -> bool {
-              return e1.second->coverage > e2.second->coverage;
-            });
-        // remove those that don't achieve the threshold
-        validHits.erase(std::remove_if(validHits.begin(), validHits.end(),
-          [thresh](std::pair<uint32_t, decltype(leftHits)::mapped_type::iterator>& e) -> bool {
-            return static_cast<double>(e.second->coverage) < thresh;
-          }), validHits.end());
       }
-
-      /*
-      int maxScore = std::numeric_limits<int>::min();
-      bool doTraverse = !mopts->justMap;
-      if (doTraverse) {
-        if(!jointHits.empty() && jointHits.front().coverage() < 2*readLen) {
-          for(auto& hit : jointHits){
-            traverseGraph(rpair, hit, pfi, refSeqConstructor, contigSeqCache, aligner, verbose) ;
-            // update minScore across all hits
-            if(hit.leftClust->score + hit.rightClust->score > maxScore) {
-              maxScore = hit.leftClust->score + hit.rightClust->score;
+      double thresh = mopts->scoreRatio * maxCoverage;
+      // sort the hits by coverage (ties are broken by position so that the
+      // hits we keep below are chosen deterministically)
+      std::sort(
+          validHits.begin(), validHits.end(),
+          [](
+              std::pair<uint32_t, decltype(leftHits)::mapped_type::iterator>&
+                  e1, std::pair<uint32_t, decltype(leftHits)::mapped_type::iterator>& e2) -> bool {
+            if (e1.second->coverage != e2.second->coverage) {
+              return e1.second->coverage > e2.second->coverage;
             }
-          }
-        }
-        else if(!jointHits.empty()){
-          maxScore = 2 * readLen * MATCH_SCORE ;
-          for(auto& jointHit : jointHits){
-            jointHit.leftClust->score = jointHit.leftClust->coverage * MATCH_SCORE ;
-            jointHit.rightClust->score = jointHit.rightClust->coverage * MATCH_SCORE;
-            jointHit.leftClust->cigar = std::to_string(readLen)+"M" ;
-            jointHit.rightClust->cigar = std::to_string(readLen)+"M" ;
-          }
-
-        }
+            if (e1.first != e2.first) { return e1.first < e2.first; }
+            if (e1.second->firstRefPos() != e2.second->firstRefPos()) {
+              return e1.second->firstRefPos() < e2.second->firstRefPos();
+            }
+            return e1.second->isFw and !e2.second->isFw;
+          });
+      // remove those that don't achieve the threshold
+      validHits.erase(std::remove_if(validHits.begin(), validHits.end(),
+        [thresh](std::pair<uint32_t, decltype(leftHits)::mapped_type::iterator>& e) -> bool {
+          return static_cast<double>(e.second->coverage) < thresh;
+        }), validHits.end());
+      // and report at most maxNumHits of them
+      if (validHits.size() > mopts->maxNumHits) {
+        validHits.erase(validHits.begin() + mopts->maxNumHits, validHits.end());
+        ++hctr.tooManyHits;
       }
-      */
+
       hctr.totHits += validHits.size();
       hctr.seHits += validHits.size();
       hctr.numMapped += !validHits.empty() ? 1 : 0;
@@ -915,25 +1226,37 @@ void processReadsSingle(single_parser* parser,
         // info
         auto& qaln = jointAlignments.back();
         qaln.mateLen = readLen;
-        qaln.mateCigar = "";
+        qaln.mateCigar = util::PackedCigar();
         qaln.matePos = 0;       // jointHit.rightClust->getTrFirstHitPos();
         qaln.mateIsFwd = false; // jointHit.rightClust->isFw;
         qaln.mateStatus = MateStatus::SINGLE_END;
+        // single-end reads aren't aligned, so they are scored by coverage
+        qaln.alnScore = static_cast<int32_t>(memIt->coverage);
       }
 
       hctr.totAlignment += validHits.size();
 
       // write puffkrak format output
-      if(mopts->krakOut){
-        writeAlignmentsToKrakenDump(read, formatter, validHits, sstream);
+      if (eqCounter) {
+        eqClasses.addRead(jointAlignments);
+      } else if(mopts->krakOut){
+        writeAlignmentsToKrakenDump(read, formatter, validHits, *sstream);
+      } else if (mopts->binaryOut and !mopts->noOutput) {
+        chunkWriter.addRead(jointAlignments, *sstream);
+      } else if (bamRecords and !mopts->noOutput) {
+        if (validHits.size() > 0) {
+          writeAlignmentsToBAMSingle(read, formatter, jointAlignments, *sstream, mopts->justMap);
+        } else {
+          writeUnmappedAlignmentsToBAMSingle(read, formatter, jointAlignments, *sstream);
+        }
       } else if (validHits.size() > 0 and !mopts->noOutput) {
         // write sam output for mapped reads
-        writeAlignmentsToStreamSingle(read, formatter, jointAlignments, sstream,
+        writeAlignmentsToStreamSingle(read, formatter, jointAlignments, *sstream,
                                mopts->writeOrphans, mopts->justMap);
       } else if (validHits.size() == 0 and !mopts->noOutput) {
         // write sam output for un-mapped reads
         writeUnmappedAlignmentsToStreamSingle(read, formatter, jointAlignments,
-                                        sstream, mopts->writeOrphans,
+                                        *sstream, mopts->writeOrphans,
                                         mopts->justMap);
       }
 
@@ -956,17 +1279,18 @@ void processReadsSingle(single_parser* parser,
 
 
     // dump output
-    if (!mopts->noOutput) {
-      std::string outStr(sstream.str());
-      // Get rid of last newline
-      if (!outStr.empty()) {
-        outStr.pop_back();
-        outQueue->info(std::move(outStr));
-      }
-      sstream.clear();
+    chunkWriter.finish(*sstream);
+    if (run) {
+      run->add(*sstream);
+    } else if (outWriter) {
+      sstream = outWriter->submit(sstream);
+    } else {
+      sstream->clear();
     }
 
   } // processed all reads
+  if (outWriter and !run) { outWriter->release(sstream); }
+  if (eqCounter) { eqCounter->merge(eqClasses); }
 }
 
 template <typename PufferfishIndexT>
@@ -975,7 +1299,9 @@ bool spawnProcessReadsthreads(
                               paired_parser* parser,
                               PufferfishIndexT& pfi,
                               SpinLockT& iomutex,
-                              std::shared_ptr<spdlog::logger> outQueue,
+                              pufferfish::OutputWriter* outWriter,
+                              pufferfish::RecordSorter* sorter,
+                              pufferfish::EquivalenceClassCounter* eqCounter,
                               HitCounters& hctr,
                               AlignmentOpts* mopts){
 
@@ -987,7 +1313,9 @@ bool spawnProcessReadsthreads(
                          parser,
                          std::ref(pfi),
                          &iomutex,
-                         outQueue,
+                         outWriter,
+                         sorter,
+                         eqCounter,
                          std::ref(hctr),
                          mopts);
   }
@@ -1002,7 +1330,9 @@ bool spawnProcessReadsthreads(
                               single_parser* parser,
                               PufferfishIndexT& pfi,
                               SpinLockT& iomutex,
-                              std::shared_ptr<spdlog::logger> outQueue,
+                              pufferfish::OutputWriter* outWriter,
+                              pufferfish::RecordSorter* sorter,
+                              pufferfish::EquivalenceClassCounter* eqCounter,
                               HitCounters& hctr,
                               AlignmentOpts* mopts){
 
@@ -1014,7 +1344,9 @@ bool spawnProcessReadsthreads(
                          parser,
                          std::ref(pfi),
                          &iomutex,
-                         outQueue,
+                         outWriter,
+                         sorter,
+                         eqCounter,
                          std::ref(hctr),
                          mopts);
   }
@@ -1032,6 +1364,13 @@ void printAlignmentSummary(HitCounters& hctrs, std::shared_ptr<spdlog::logger> c
   consoleLog->info("Average # hits per read : {}", hctrs.totHits / static_cast<float>(hctrs.numReads));
   consoleLog->info("Total # of alignments : {}", hctrs.totAlignment);
   consoleLog->info("Max multimapping group : {}", hctrs.maxMultimapping);
+  consoleLog->info("# reads with more than --maxNumHits mappings : {}", hctrs.tooManyHits);
+  consoleLog->info("# read pairs recovered by mate rescue : {}", hctrs.rescuedPairs);
+  uint64_t alnCacheLookups = hctrs.alnCacheHits + hctrs.alnCacheMisses;
+  if (alnCacheLookups > 0) {
+    consoleLog->info("Gap alignment cache hits : {} of {} ({:03.2f}%)", hctrs.alnCacheHits, alnCacheLookups,
+                     (100.0 * hctrs.alnCacheHits) / alnCacheLookups);
+  }
   consoleLog->info("=====");
 }
 
@@ -1043,42 +1382,68 @@ bool alignReads(
 
 
 
-  std::streambuf* outBuf ;
-  std::ofstream outFile ;
-  std::unique_ptr<std::ostream> outStream{nullptr};
-  //bool haveOutputFile{false} ;
-  std::shared_ptr<spdlog::logger> outLog{nullptr};
+  uint32_t nthread = mopts->numThreads ;
+  // pseudoalignments have no positions to write; they are only counted
+  // per equivalence class
+  if (mopts->pseudo) { mopts->eqClasses = true; }
+  // the output (to stdout if no file was given) is written by its own thread
+  std::unique_ptr<pufferfish::OutputWriter> outWriter{nullptr};
   if (!mopts->noOutput) {
-    if(mopts->outname == ""){
-      outBuf = std::cout.rdbuf() ;
-    }else{
-      outFile.open(mopts->outname) ;
-      outBuf = outFile.rdbuf() ;
-      //haveOutputFile = true ;
+    if (mopts->krakOut and mopts->bamOut) {
+      consoleLog->error("--krakOut and --bam can't be used together");
+      std::exit(1);
+    }
+    if (mopts->krakOut and mopts->sortOutput) {
+      consoleLog->error("--krakOut output can't be sorted");
+      std::exit(1);
+    }
+    if (mopts->binaryOut and (mopts->krakOut or mopts->bamOut or mopts->sortOutput)) {
+      consoleLog->error("--binaryOut can't be used with --krakOut, --bam or --sort");
+      std::exit(1);
+    }
+    if (mopts->eqClasses and (mopts->krakOut or mopts->bamOut or mopts->sortOutput or mopts->binaryOut)) {
+      consoleLog->error("--eqclasses can't be used with --krakOut, --bam, --sort or --binaryOut");
+      std::exit(1);
+    }
+    if (mopts->streaming and (mopts->sortOutput or mopts->eqClasses)) {
+      consoleLog->error("--stream can't be used with --sort, --eqclasses or --pseudo, whose output is only written once all the reads are mapped");
+      std::exit(1);
+    }
+    // each worker fills one buffer while the previous one is being written
+    outWriter.reset(new pufferfish::OutputWriter(mopts->outname, 2 * nthread + 2, mopts->bamOut));
+    if (!outWriter->good()) {
+      consoleLog->error("could not open output file {}", mopts->outname);
+      std::exit(1);
     }
-
-    // out stream to the buffer
-    // it can be std::cout or a file
-    outStream.reset(new std::ostream(outBuf));
-
-    // the async queue size must be a power of 2
-    size_t queueSize{268435456};
-    spdlog::set_async_mode(queueSize);
-
-    auto outputSink = std::make_shared<spdlog::sinks::ostream_sink_mt>(*outStream) ;
-    outLog = std::make_shared<spdlog::logger>("puffer::outLog",outputSink) ;
-    outLog->set_pattern("%v");
 
     // write the SAM Header
-    // If nothing gets printed by this time we are in trouble
-    if (mopts->krakOut) {
-      writeKrakOutHeader(pfi, outLog, mopts);
+    fmt::MemoryWriter hd;
+    if (mopts->eqClasses) {
+      // the table is written once all the reads are mapped
+    } else if (mopts->krakOut) {
+      writeKrakOutHeader(pfi, hd, mopts);
+    } else if (mopts->binaryOut) {
+      writeMappingHeader(pfi, hd, !mopts->singleEnd);
+    } else if (mopts->bamOut) {
+      writeBAMHeader(pfi, hd, mopts->sortOutput);
     } else {
-      writeSAMHeader(pfi, outLog);
+      writeSAMHeader(pfi, hd, mopts->sortOutput);
     }
+    if (hd.size() > 0) { outWriter->write(hd); }
+  }
+  // with --eqclasses, the mapping threads only count reads per class
+  std::unique_ptr<pufferfish::EquivalenceClassCounter> eqCounter{nullptr};
+  if (mopts->eqClasses and !mopts->noOutput) {
+    eqCounter.reset(new pufferfish::EquivalenceClassCounter);
+  }
+  // the mapping threads fill the sorter's runs, which are merged into the
+  // output once all the reads are mapped
+  std::unique_ptr<pufferfish::RecordSorter> sorter{nullptr};
+  if (mopts->sortOutput and !mopts->noOutput) {
+    std::string tmpPrefix = (mopts->outname.empty() ? std::string("pufferfish") : mopts->outname) + ".sorttmp";
+    sorter.reset(new pufferfish::RecordSorter(tmpPrefix, static_cast<size_t>(mopts->sortMemory) << 20, nthread));
   }
 
-  uint32_t nthread = mopts->numThreads ;
   std::unique_ptr<paired_parser> pairParserPtr{nullptr} ;
   std::unique_ptr<single_parser> singleParserPtr{nullptr} ;
 
@@ -1100,15 +1465,15 @@ bool alignReads(
 
     uint32_t nprod = (read1Vec.size() > 1) ? 2 : 1;
     pairParserPtr.reset(new paired_parser(read1Vec, read2Vec, nthread, nprod, chunkSize));
+    if (mopts->streaming) { pairParserPtr->setMaxLatency(std::chrono::milliseconds(mopts->streamLatency)); }
     pairParserPtr->start();
 
     spawnProcessReadsthreads(nthread, pairParserPtr.get(), pfi, iomutex,
-                             outLog, hctrs, mopts) ;
+                             outWriter.get(), sorter.get(), eqCounter.get(), hctrs, mopts) ;
 
     pairParserPtr->stop();
     consoleLog->info("flushing output queue.");
     printAlignmentSummary(hctrs, consoleLog);
-	if (outLog) { outLog->flush(); }
   } else {
     ScopedTimer timer(!mopts->quiet) ;
     HitCounters hctrs ;
@@ -1117,15 +1482,40 @@ bool alignReads(
 
     uint32_t nprod = (readVec.size() > 1) ? 2 : 1;
     singleParserPtr.reset(new single_parser(readVec, nthread, nprod, chunkSize));
+    if (mopts->streaming) { singleParserPtr->setMaxLatency(std::chrono::milliseconds(mopts->streamLatency)); }
     singleParserPtr->start();
 
     spawnProcessReadsthreads(nthread, singleParserPtr.get(), pfi, iomutex,
-                             outLog, hctrs, mopts) ;
+                             outWriter.get(), sorter.get(), eqCounter.get(), hctrs, mopts) ;
 
     singleParserPtr->stop();
     consoleLog->info("flushing output queue.");
     printAlignmentSummary(hctrs, consoleLog);
-    if (outLog) { outLog->flush(); }
+  }
+  if (eqCounter) {
+    consoleLog->info("writing {} equivalence classes.", eqCounter->numClasses());
+    fmt::MemoryWriter table;
+    eqCounter->write(pfi, table);
+    outWriter->write(table);
+  }
+  if (sorter) {
+    consoleLog->info("merging sorted alignments.");
+    auto& refNames = pfi.getRefNames();
+    bool merged = sorter->merge(*outWriter, [&](const char* rec, size_t len, fmt::MemoryWriter& out) {
+        if (mopts->bamOut) {
+          out.buffer().append(rec, rec + len);
+        } else {
+          bam::writeSAMRecord(rec, len, refNames, out);
+        }
+      });
+    if (!merged) {
+      consoleLog->error("error writing or reading the temporary files of the sort");
+      return false;
+    }
+  }
+  if (outWriter and !outWriter->close()) {
+    consoleLog->error("error writing the output");
+    return false;
   }
   return true ;
 }
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 
@@ -105,6 +106,29 @@ PufferfishIndex::PufferfishIndex(const std::string& indexDir) {
     std::string pfile = indexDir + "/edge.bin";
     sdsl::load_from_file(edge_, pfile);
   }
+
+  {
+    std::string rsfile = indexDir + "/refseq.bin";
+    if (puffer::fs::FileExists(rsfile.c_str())) {
+      CLI::AutoTimer timer{"Loading reference sequences", CLI::Timer::Big};
+      sdsl::load_from_file(refSeq_, rsfile);
+      std::ifstream refAccumStream(indexDir + "/refAccumLengths.bin");
+      cereal::BinaryInputArchive refAccumArchive(refAccumStream);
+      refAccumArchive(refAccumLengths_);
+      std::ifstream refNRunsStream(indexDir + "/refNRuns.bin");
+      cereal::BinaryInputArchive refNRunsArchive(refNRunsStream);
+      refNRunsArchive(refNRuns_);
+    }
+  }
+
+  {
+    std::string nfile = indexDir + "/nbr.bin";
+    if (puffer::fs::FileExists(nfile.c_str())) {
+      CLI::AutoTimer timer{"Loading contig neighbors", CLI::Timer::Big};
+      sdsl::load_from_file(nbrOffsets_, indexDir + "/nbr_offsets.bin");
+      sdsl::load_from_file(nbrs_, nfile);
+    }
+  }
   /*
   {
     CLI::AutoTimer timer{"Loading edges", CLI::Timer::Big};
@@ -434,6 +458,40 @@ std::vector<CanonicalKmer> PufferfishIndex::getNextKmerOnGraph(uint64_t rank, ut
   return nextKmers ;
 }
 
+bool PufferfishIndex::getRefWindow(uint32_t tid, uint64_t start, uint32_t len, bool isFw, std::string& out) {
+  if (tid + 1 >= refAccumLengths_.size()) { return false; }
+  uint64_t refStart = refAccumLengths_[tid];
+  uint64_t refLen = refAccumLengths_[tid + 1] - refStart;
+  if (start > refLen or len > refLen - start) { return false; }
+  uint64_t globalPos = refStart + start;
+  // those bases are stored as A, so they would read as matches; the first
+  // bound past globalPos is the end of a run containing it, or the start
+  // of the next run
+  auto bound = std::upper_bound(refNRuns_.begin(), refNRuns_.end(), globalPos);
+  if ((bound - refNRuns_.begin()) % 2 == 1 or
+      (bound != refNRuns_.end() and *bound < globalPos + len)) {
+    return false;
+  }
+
+  static constexpr char fwChars[] = {'A', 'C', 'G', 'T'};
+  static constexpr char rcChars[] = {'T', 'G', 'C', 'A'};
+  size_t outStart = out.size();
+  out.resize(outStart + len);
+  // decode up to 32 bases per word
+  for (uint32_t i = 0; i < len; i += 32) {
+    uint32_t validLength = std::min(len - i, static_cast<uint32_t>(32));
+    uint64_t word = refSeq_.get_int(2 * (globalPos + i), 2 * validLength);
+    for (uint32_t j = 0; j < validLength; ++j, word >>= 2) {
+      if (isFw) {
+        out[outStart + i + j] = fwChars[word & 0x3];
+      } else {
+        out[outStart + len - 1 - (i + j)] = rcChars[word & 0x3];
+      }
+    }
+  }
+  return true;
+}
+
 uint32_t PufferfishIndex::getContigLen(uint64_t rank){
   uint64_t sp = (rank == 0) ? 0 : static_cast<uint64_t>(contigSelect_(rank)) + 1;
   uint64_t contigEnd = contigSelect_(rank + 1);
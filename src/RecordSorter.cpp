@@ -0,0 +1,190 @@
+#include "RecordSorter.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <thread>
+
+namespace pufferfish {
+
+namespace {
+// bytes read from a spilled run at a time
+constexpr size_t readChunk = 1 << 20;
+// merged output handed to the writer at a time
+constexpr size_t flushSize = 1 << 22;
+
+// the length of a BAM record, including its block size
+inline size_t recordLength(const char* rec) {
+  uint32_t blockSize;
+  std::memcpy(&blockSize, rec, sizeof(blockSize));
+  return static_cast<size_t>(blockSize) + sizeof(blockSize);
+}
+
+// The records of one sorted run, in order; either a spilled run read
+// back from its file, or the (sorted) records a run still has in memory
+class RunReader {
+public:
+  explicit RunReader(const std::string& fname) : f_(std::fopen(fname.c_str(), "rb")) {}
+  RunReader(const std::vector<char>& data, const std::vector<RecordSorter::Key>& index)
+      : data_(&data), index_(&index) {}
+  ~RunReader() {
+    if (f_) { std::fclose(f_); }
+  }
+
+  bool good() const { return f_ != nullptr or data_ != nullptr; }
+  // the run ended early (a truncated or unreadable file)
+  bool failed() const { return failed_; }
+
+  const char* record() const { return rec_; }
+  size_t length() const { return len_; }
+
+  // Move to the next record; false at the end of the run
+  bool next() {
+    if (data_) {
+      if (idx_ >= index_->size()) { return false; }
+      rec_ = data_->data() + (*index_)[idx_++].second;
+      len_ = recordLength(rec_);
+      return true;
+    }
+    if (!f_) { return false; }
+    pos_ += len_;
+    len_ = 0;
+    if (!fill_(sizeof(uint32_t))) { return false; }
+    size_t len = recordLength(buf_.data() + pos_);
+    if (!fill_(len)) { return false; }
+    rec_ = buf_.data() + pos_;
+    len_ = len;
+    return true;
+  }
+
+private:
+  // make sure the next n bytes are in buf_
+  bool fill_(size_t n) {
+    if (end_ - pos_ >= n) { return true; }
+    std::copy(buf_.begin() + pos_, buf_.begin() + end_, buf_.begin());
+    end_ -= pos_;
+    pos_ = 0;
+    if (buf_.size() < std::max(n, readChunk)) { buf_.resize(std::max(n, readChunk)); }
+    while (end_ < n) {
+      size_t got = std::fread(buf_.data() + end_, 1, buf_.size() - end_, f_);
+      if (got == 0) {
+        // a clean end of the run only falls between records
+        if (end_ > 0 or std::ferror(f_)) { failed_ = true; }
+        return false;
+      }
+      end_ += got;
+    }
+    return true;
+  }
+
+  std::FILE* f_{nullptr};
+  std::vector<char> buf_;
+  size_t pos_{0};
+  size_t end_{0};
+
+  const std::vector<char>* data_{nullptr};
+  const std::vector<RecordSorter::Key>* index_{nullptr};
+  size_t idx_{0};
+
+  const char* rec_{nullptr};
+  size_t len_{0};
+  bool failed_{false};
+};
+}
+
+void RecordSorter::Run::add(fmt::MemoryWriter& buf) {
+  size_t base = data_.size();
+  data_.insert(data_.end(), buf.data(), buf.data() + buf.size());
+  buf.clear();
+  for (size_t off = base; off < data_.size(); off += recordLength(&data_[off])) {
+    index_.emplace_back(RecordSorter::key(&data_[off]), off);
+  }
+  if (data_.size() + index_.size() * sizeof(Key) >= sorter_->runBudget_) { spill_(); }
+}
+
+void RecordSorter::Run::sort_() {
+  // ties are broken by offset, i.e. records keep the order they came in
+  std::sort(index_.begin(), index_.end());
+}
+
+void RecordSorter::Run::spill_() {
+  sort_();
+  spills_.push_back(sorter_->tmpPrefix_ + "." + std::to_string(id_) + "." +
+                    std::to_string(spills_.size()));
+  std::FILE* f = std::fopen(spills_.back().c_str(), "wb");
+  bool ok = (f != nullptr);
+  if (ok) {
+    for (auto& e : index_) {
+      const char* rec = &data_[e.second];
+      size_t len = recordLength(rec);
+      if (std::fwrite(rec, 1, len, f) != len) {
+        ok = false;
+        break;
+      }
+    }
+    if (std::fclose(f) != 0) { ok = false; }
+  }
+  if (!ok) { sorter_->failed_ = true; }
+  data_.clear();
+  index_.clear();
+}
+
+RecordSorter::RecordSorter(const std::string& tmpPrefix, size_t memBudget, uint32_t numRuns)
+    : tmpPrefix_(tmpPrefix), runBudget_(memBudget / std::max(numRuns, 1u)) {
+  runs_.reserve(numRuns);
+  for (uint32_t i = 0; i < numRuns; ++i) { runs_.emplace_back(new Run(this, i)); }
+}
+
+RecordSorter::~RecordSorter() {
+  for (auto& run : runs_) {
+    for (auto& f : run->spills_) { std::remove(f.c_str()); }
+  }
+}
+
+RecordSorter::Run* RecordSorter::nextRun() { return runs_.at(nextRun_++).get(); }
+
+bool RecordSorter::merge(OutputWriter& out,
+                         const std::function<void(const char*, size_t, fmt::MemoryWriter&)>& emit) {
+  // sort what the runs still hold in memory, in parallel
+  std::vector<std::thread> sorters;
+  for (auto& run : runs_) {
+    if (!run->index_.empty()) { sorters.emplace_back(&Run::sort_, run.get()); }
+  }
+  for (auto& t : sorters) { t.join(); }
+
+  std::vector<std::unique_ptr<RunReader>> readers;
+  for (auto& run : runs_) {
+    for (auto& f : run->spills_) {
+      readers.emplace_back(new RunReader(f));
+      if (!readers.back()->good()) { failed_ = true; }
+    }
+    if (!run->index_.empty()) { readers.emplace_back(new RunReader(run->data_, run->index_)); }
+  }
+
+  // the next record of every reader, smallest key first; equal keys come
+  // from the readers in order, which keeps each run in arrival order
+  using HeapEntry = std::pair<uint64_t, size_t>;
+  std::priority_queue<HeapEntry, std::vector<HeapEntry>, std::greater<HeapEntry>> heap;
+  for (size_t i = 0; i < readers.size(); ++i) {
+    if (readers[i]->next()) { heap.emplace(key(readers[i]->record()), i); }
+  }
+
+  fmt::MemoryWriter* buf = out.acquire();
+  while (!heap.empty()) {
+    size_t i = heap.top().second;
+    heap.pop();
+    auto& r = *readers[i];
+    emit(r.record(), r.length(), *buf);
+    if (buf->size() >= flushSize) { buf = out.submit(buf); }
+    if (r.next()) { heap.emplace(key(r.record()), i); }
+  }
+  buf = out.submit(buf);
+  out.release(buf);
+
+  for (auto& r : readers) {
+    if (r->failed()) { failed_ = true; }
+  }
+  return !failed_;
+}
+
+} // namespace pufferfish
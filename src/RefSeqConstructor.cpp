@@ -44,34 +44,50 @@ Task RefSeqConstructor<PufferfishIndexT>::fillSeq(size_t tid,
   
   //std::cerr << curContig.isDummy()<<endContig.isDummy() << " ";
 
+  // if the index has the reference sequences, there is nothing to walk
+  // (unless the stretch runs into Ns, which only the graph spells out)
+  if (pfi_->hasRefSeq() and pfi_->getRefWindow(tid, tpos + 1, txpDist, true, seq)) {
+    return Task::SUCCESS;
+  }
+
   if (curContig.contigIdx_ == endContig.contigIdx_ && endp-startp-1 == txpDist) {
     append(seq, curContig, startp, endp, isCurContigFw);
     //std::cerr << txpDist << "-" << seq.length() <<  " ";
     return Task::SUCCESS;
   }
   size_t endTpos = tpos + txpDist + 1;
-  
+
+  if (curContig.isDummy()) {
+    // nothing to start from (the overhang before the first uni-MEM), so walk
+    // the graph backward from the end contig, building the reverse complement
+    revSeq_.clear();
+    Task res = doDFS(tid, endTpos, isEndContigFw, endContig, endp, curContig, isCurContigFw, txpDist, false, revSeq_, verbose);
+    if (res == Task::SUCCESS) {
+      for (auto it = revSeq_.rbegin(); it != revSeq_.rend(); ++it) {
+        seq.push_back(rev(*it));
+      }
+    }
+    return res;
+  }
+
+  // the end of the stretch may lie in the end contig, before endp; if so, we
+  // only have to walk up to the start of the end contig, and the rest goes
+  // after that
+  uint32_t endRemLen{0};
   if (!endContig.isDummy()) {
-    auto endRemLen = remainingLen(endContig, endp, isEndContigFw, prefixIfFw);
+    endRemLen = static_cast<uint32_t>(remainingLen(endContig, endp, isEndContigFw, prefixIfFw));
     if (endRemLen >= txpDist) {
       appendByLen(seq, endContig, endp, txpDist, isEndContigFw, prefixIfFw);
       return Task::SUCCESS;
-    } else if (endRemLen > 0) {
-      appendByLen(seq, endContig, endp, endRemLen, isEndContigFw, prefixIfFw);
-      txpDist-=endRemLen;
-      if (isCurContigFw) endp -= endRemLen; // as it is prefix, in case of forward contig, we update the endp by reducing it
-      else endp += endRemLen;
-      tpos += endRemLen;
     }
-  }
-  if (curContig.isDummy()) {
-    std::string tmp;
-    doDFS(tid, endTpos, isEndContigFw, endContig, endp, curContig, isCurContigFw, txpDist, false, tmp);
-    seq = rc(tmp) + seq;
-    return Task::SUCCESS;
+    txpDist -= endRemLen;
   }
   if (verbose) std::cerr << std::this_thread::get_id() << " "  << "\n\nWOOOOOT!! Got to bfs\n";
-  return doDFS(tid, tpos, isCurContigFw, curContig, startp, endContig, isEndContigFw, txpDist, true, seq, verbose);
+  Task res = doDFS(tid, tpos, isCurContigFw, curContig, startp, endContig, isEndContigFw, txpDist, true, seq, verbose);
+  if (res == Task::SUCCESS and endRemLen > 0) {
+    appendByLen(seq, endContig, endp, endRemLen, isEndContigFw, prefixIfFw);
+  }
+  return res;
 }
 
 template <typename PufferfishIndexT>
@@ -86,118 +102,108 @@ Task RefSeqConstructor<PufferfishIndexT>::doDFS(size_t tid,
                                                 bool walkForward,
                                                 std::string& seq,
                                                 bool verbose) {
-
-
-
-  if(verbose) std::cerr << std::this_thread::get_id() << " "  << "\n[doBFS]\n" << "called for txp " << tid << " with pos " << tpos << " with curr contig: "
-                        << curContig.contigIdx_ << " of length " << curContig.contigLen_ << " ori " << isCurContigFw
-                        << " start " << startp << "\n"
-                        << "end contig index "<< endContig.contigIdx_ << " is dummy: " << endContig.isDummy() << "\ntxpDist: " << txpDist << "\n";
-
-  if (startp >= curContig.contigLen_) {
-      std::cerr << std::this_thread::get_id() << " "  << "ERROR!!! shouldn't happen ---> startp >= curContig.contigLen_ : " << startp << ">" << curContig.contigLen_ << "\n";
+  frames_.clear();
+  children_.clear();
+  SearchType searchType = walkForward ? SearchType::SUCCESSOR : SearchType::PREDECESSOR;
+  // the contig being visited; the first one is the caller's, the others live
+  // in contigSeqCache_ (and are looked up again at every visit, since
+  // inserting into the cache may move them)
+  util::ContigBlock* contig = &curContig;
+
+  while (true) {
+    if(verbose) std::cerr << std::this_thread::get_id() << " "  << "\n[doDFS]\n" << "called for txp " << tid << " with pos " << tpos << " with curr contig: "
+                          << contig->contigIdx_ << " of length " << contig->contigLen_ << " ori " << isCurContigFw
+                          << " start " << startp << "\n"
+                          << "end contig index "<< endContig.contigIdx_ << " is dummy: " << endContig.isDummy() << "\ntxpDist: " << txpDist << "\n";
+
+    bool found{false};
+    if (startp >= contig->contigLen_) {
+      std::cerr << std::this_thread::get_id() << " "  << "ERROR!!! shouldn't happen ---> startp >= curContig.contigLen_ : " << startp << ">" << contig->contigLen_ << "\n";
       std::cerr << std::this_thread::get_id() << " "  << "called for txp " << tid << " with pos " << tpos << " with curr contig: "
-                << curContig.contigIdx_ << " of length " << curContig.contigLen_ << " ori " << isCurContigFw
+                << contig->contigIdx_ << " of length " << contig->contigLen_ << " ori " << isCurContigFw
                 << " start " << startp << "\n"
                 << "end contig index "<< endContig.contigIdx_
-                << "\nis end dummy: " << endContig.isDummy()
-                << " is start dummy: " << curContig.isDummy() << "\ntxpDist: " << txpDist << "\n";
-      std::exit(1);
-  }
-    // used in all the following terminal conditions
-    auto remLen = remainingLen(curContig, startp, walkForward?isCurContigFw:!isCurContigFw, suffixIfFw);
-    if (remLen >= txpDist) {
-      if (endContig.isDummy()){
-        appendByLen(seq, curContig, startp, txpDist, walkForward?isCurContigFw:!isCurContigFw, suffixIfFw);
-        if (verbose) std::cerr << std::this_thread::get_id() << " "  << "\t[After append] " << seq << "\n";
-        return Task::SUCCESS;
-      }
-      // DON'T GET STUCK IN INFINITE LOOPS
-      // if we have not reached the last contigId
-      // and also end of the path is NOT open
-      // then if the remaining of the contig from this position is less than txpDist it should be counted as a failure
-      // because we couldn't find the path between start and end that is shorter than some txpDist
-      else {
+                << "\nis end dummy: " << endContig.isDummy() << "\ntxpDist: " << txpDist << "\n";
+      // treat it as a dead end
+    } else {
+      bool isWalkFw = walkForward ? isCurContigFw : !isCurContigFw;
+      // used in all the following terminal conditions
+      auto remLen = remainingLen(*contig, startp, isWalkFw, suffixIfFw);
+      if (remLen >= txpDist) {
+        if (endContig.isDummy()) {
+          appendByLen(seq, *contig, startp, txpDist, isWalkFw, suffixIfFw);
+          if (verbose) std::cerr << std::this_thread::get_id() << " "  << "\t[After append] " << seq << "\n";
+          return Task::SUCCESS;
+        }
+        // DON'T GET STUCK IN INFINITE LOOPS
+        // if we have not reached the last contigId
+        // and also end of the path is NOT open
+        // then if the remaining of the contig from this position is less than txpDist it should be counted as a failure
+        // because we couldn't find the path between start and end that is shorter than some txpDist
         if (remLen > txpDist) {
-
+          // the rest of this contig has to be the start of the end contig
           if (remLen-txpDist < endContig.contigLen_ &&
-              getRemSeq(curContig, remLen-txpDist, isCurContigFw, suffixIfFw) == getRemSeq(endContig, remLen-txpDist, isEndContigFw, prefixIfFw)) {
-            appendByLen(seq, curContig, startp, txpDist, isCurContigFw, suffixIfFw);
+              sameRemSeq(*contig, isCurContigFw, suffixIfFw, endContig, isEndContigFw, prefixIfFw, remLen-txpDist)) {
+            appendByLen(seq, *contig, startp, txpDist, isCurContigFw, suffixIfFw);
             return Task::SUCCESS;
           }
-          else {
-            if(verbose) std::cerr << std::this_thread::get_id() << " "  << "[doBFS] returning failure\n";
-            return Task::FAILURE;
+          if(verbose) std::cerr << std::this_thread::get_id() << " "  << "[doDFS] dead end\n";
+        } else {
+          // remLen == txpDist (also when txpDist == 0): the next contig has
+          // to be the end contig
+          size_t childBegin = children_.size();
+          uint64_t cid = contig->contigIdx_;
+          fetchNext(*contig, isCurContigFw, tid, tpos + remLen, SearchType::SUCCESSOR, verbose);
+          for (size_t i = childBegin; i < children_.size() and !found; ++i) {
+            auto& c = children_[i];
+            util::ContigBlock& cb = (*contigSeqCache_)[c.cid];
+            if (cb.contigLen_-(k-1) <= endContig.contigLen_ &&
+                sameRemSeq(cb, c.isCurContigFw, suffixIfFw, endContig, isEndContigFw, prefixIfFw, cb.contigLen_-(k-1))) {
+              found = true;
+            }
           }
-        }
-        // terminal condition
-        // called even when txpDist == 0
-        // remLen == txpDist
-        auto tmp =  fetchSuccessors(curContig, isCurContigFw, tid, tpos, txpDist);
-        if (tmp.size() > 4) {
-          std::cerr << "Failure for this f*cking size: " << tmp.size();
-          std::exit(1);
-        }
-        for (auto& c : tmp) {
-          util::ContigBlock& cb = (*contigSeqCache_)[c.cid];
-          if (cb.contigLen_-(k-1) <= endContig.contigLen_ &&
-              getRemSeq(cb, cb.contigLen_-(k-1), c.isCurContigFw, suffixIfFw) == getRemSeq(endContig, cb.contigLen_-(k-1), isEndContigFw, prefixIfFw))
-            appendByLen(seq, curContig, startp, txpDist, isCurContigFw, suffixIfFw);
+          children_.erase(children_.begin() + childBegin, children_.end());
+          if (found) {
+            contig = frames_.empty() ? &curContig : &(*contigSeqCache_)[cid];
+            appendByLen(seq, *contig, startp, txpDist, isCurContigFw, suffixIfFw);
             return Task::SUCCESS;
+          }
         }
-        return Task::FAILURE; // I'm in the middle of no where!! lost!!
+      } else {
+        // remLen < txpDist: take the rest of this contig, and go one level
+        // deeper with each of the contigs that can follow it
+        size_t childBegin = children_.size();
+        frames_.push_back({seq.size(), childBegin, childBegin, childBegin, txpDist - static_cast<uint32_t>(remLen)});
+        appendByLen(seq, *contig, startp, remLen, isWalkFw, suffixIfFw);
+        tpos = walkForward ? (tpos + remLen) : (tpos - remLen);
+        fetchNext(*contig, isCurContigFw, tid, tpos, searchType, verbose);
+        frames_.back().childEnd = children_.size();
       }
     }
 
-    // if we are here, this means remLen < txpDist
-
-    // If we didn't meet any terminal conditions, we need to dig deeper into the tree through BFS
-    // The approach is the same for both valid and dummy end nodes
-    //if(verbose) std::cerr << std::this_thread::get_id() << " "  << "[doBFS] remLen < txpDist : " << remLen << " < " << txpDist << "\n" ;
-    appendByLen(seq, curContig, startp, remLen, walkForward?isCurContigFw:!isCurContigFw, suffixIfFw);
-    txpDist-=remLen;
-    if (walkForward) {
-      if (isCurContigFw) startp += remLen;
-      else startp -= remLen;
-      tpos += remLen;
-    } else {
-      if (isCurContigFw) startp -= remLen;
-      else startp += remLen;
-      tpos -= remLen;
-    }
-
-    std::vector<nextCompatibleStruct> children;
-    if (walkForward) {
-      children = fetchSuccessors(curContig, isCurContigFw, tid, tpos, txpDist);
-    }
-    else {
-      children = fetchPredecessors(curContig, isCurContigFw, tid, tpos, txpDist);
-    }
-    for (auto& c : children) {
-      // act greedily and return with the first successfully constructed sequence.
-      util::ContigBlock& cb = (*contigSeqCache_)[c.cid];
-      if (doDFS(tid, c.tpos, c.isCurContigFw, cb, c.cpos, endContig, isEndContigFw, txpDist, walkForward, seq, verbose) == Task::SUCCESS) {
-        return Task::SUCCESS;
+    // move on to the next candidate of the deepest level that has one left,
+    // undoing the levels that have been exhausted
+    bool advanced{false};
+    while (!frames_.empty()) {
+      auto& f = frames_.back();
+      if (f.childNext < f.childEnd) {
+        // act greedily and return with the first successfully constructed sequence.
+        auto& c = children_[f.childNext++];
+        contig = &(*contigSeqCache_)[c.cid];
+        tpos = c.tpos;
+        isCurContigFw = c.isCurContigFw;
+        startp = c.cpos;
+        txpDist = f.txpDist;
+        advanced = true;
+        break;
       }
+      if(verbose) std::cerr << std::this_thread::get_id() << " "  <<"[doDFS] failed!!\n";
+      seq.resize(f.seqLen);
+      children_.erase(children_.begin() + f.childBegin, children_.end());
+      frames_.pop_back();
     }
-
-    // If couldn't find any valid/compatible successors,
-    //then this path was a dead end. Revert your append and return with failure
-    if(verbose) std::cerr << std::this_thread::get_id() << " "  <<"[doBFS] failed!!\n";
-    //revert back
-    txpDist+=remLen;
-    if (walkForward) {
-      if (isCurContigFw) startp -= remLen;
-      else startp += remLen;
-      tpos -= remLen;
-    } else {
-      if (isCurContigFw) startp += remLen;
-      else startp -= remLen;
-      tpos += remLen;
-    }
-
-    cutoff(seq, remLen);
-    return Task::FAILURE;
+    if (!advanced) { return Task::FAILURE; }
+  }
 }
 
 
@@ -221,81 +227,76 @@ void RefSeqConstructor<PufferfishIndexT>::append(std::string& seq,
   if(isCurContigFw) {
     if(verbose) std::cerr << std::this_thread::get_id() << " "  << "\t[append] 1 " << seq << " clipping by pos: from "<<startp+1<< " to " << endp << " in a contig with len "<<contig.contigLen_
                           << " str len: " << contig.seq.length() << "\n" ;
-      seq += contig.substrSeq(startp+1, endp-startp-1);
+    appendRange(seq, contig, startp+1, endp-startp-1, true);
   }
     else {
       if(verbose) std::cerr << std::this_thread::get_id() << " "  << "\t[append] 2 rc " << seq << " clipping by pos: from "<<endp+1<< " to " << startp << " in a contig with len "<<contig.contigLen_<<"\n" ;
       // we are always building the seq by moving forward in transcript, so we always append (& never prepend) any substring that we construct
-      seq += rc(contig.substrSeq(endp+1, startp-endp-1)); 
+      appendRange(seq, contig, endp+1, startp-endp-1, false);
     }
 }
 
 
+// Appends the len bases next to startp (after it if appendSuffix, before it
+// otherwise, in the orientation of the contig) in reference orientation.
 template <typename PufferfishIndexT>
 void RefSeqConstructor<PufferfishIndexT>::appendByLen(std::string& seq, util::ContigBlock& contig, size_t startp, size_t len, bool isCurContigFw, bool appendSuffix, bool verbose) {
   if (len == 0)
     return;
-  if (isCurContigFw && appendSuffix) { // append suffix
+  if (isCurContigFw && appendSuffix) { // suffix
     if(verbose) std::cerr << std::this_thread::get_id() << " "  << "\t[appendByLen] 1 from " << startp+1 << " to " << startp+1+len << " total length " << contig.contigLen_ << "\n";
-    seq += contig.substrSeq(startp+1, len);
+    appendRange(seq, contig, startp+1, len, true);
   }
-  else if (isCurContigFw && !appendSuffix) {// append prefix
+  else if (isCurContigFw && !appendSuffix) {// prefix
     if(verbose) std::cerr << std::this_thread::get_id() << " "  << "\t[appendByLen] 2 from " << startp-len << " to " << startp << " total length " << contig.contigLen_ << "\n";
-    seq = contig.substrSeq(startp-len, len) + seq;
+    appendRange(seq, contig, startp-len, len, true);
   }
-  else if (!isCurContigFw && appendSuffix) {// append rc of the seq from the other end as a suffix
+  else if (!isCurContigFw && appendSuffix) {// rc of the seq from the other end
     if(verbose) std::cerr << std::this_thread::get_id() << " "  << "\t[appendByLen] 3 rc from " << startp-len << " to " << startp << " total length " << contig.contigLen_ << "\n";
-    seq += rc(contig.substrSeq(startp-len, len));
+    appendRange(seq, contig, startp-len, len, false);
   }
-  else if (!isCurContigFw && !appendSuffix) {// append rc of the seq as prefix
+  else if (!isCurContigFw && !appendSuffix) {// rc of the prefix
     if(verbose) std::cerr << std::this_thread::get_id() << " "  << "\t[appendByLen] 4 rc from " << startp+1 << " to " << startp+1+len << " total length " << contig.contigLen_ << "\n";
-    seq = rc(contig.substrSeq(startp+1, len)) + seq;
+    appendRange(seq, contig, startp+1, len, false);
   }
 }
 
 
 template <typename PufferfishIndexT>
-std::string RefSeqConstructor<PufferfishIndexT>::getRemSeq(util::ContigBlock& contig, size_t len, bool isCurContigFw, bool appendSuffix, bool verbose) {
-  std::string seq = "";
-  if (len == 0)
-    return "";
-  if (isCurContigFw && appendSuffix) {// append suffix
-    if(verbose) std::cerr << std::this_thread::get_id() << " "  << "\t[getRemSeq] 1 from " << contig.contigLen_-len << " to " << contig.contigLen_ << " total length " << contig.contigLen_ << "\n";
-    seq += contig.substrSeq(contig.contigLen_-len, len);
-  }
-  else if (isCurContigFw && !appendSuffix) {// append prefix
-    if(verbose) std::cerr << std::this_thread::get_id() << " "  << "\t[getRemSeq] 2 from " << 0 << " to " << len << " total length " << contig.contigLen_ << "\n";
-    seq = contig.substrSeq(0, len) + seq;
-  }
-  else if (!isCurContigFw && appendSuffix) {// append rc of the seq from the other end as a suffix
-    if(verbose) std::cerr << std::this_thread::get_id() << " "  << "\t[getRemSeq] 3 rc from " << 0 << " to " << len << " total length " << contig.contigLen_ << "\n";
-    seq += rc(contig.substrSeq(0, len));
-  }
-  else if (!isCurContigFw && !appendSuffix) {// append rc of the seq as prefix
-    if(verbose) std::cerr << std::this_thread::get_id() << " "  << "\t[getRemSeq] 4 rc from " << contig.contigLen_-len << " to " << contig.contigLen_ << " total length " << contig.contigLen_ << "\n";
-    seq = rc(contig.substrSeq(contig.contigLen_-len, len)) + seq;
+void RefSeqConstructor<PufferfishIndexT>::appendRange(std::string& seq, util::ContigBlock& contig, size_t pos, size_t len, bool isFw) {
+  // same bounds check as ContigBlock::substrSeq
+  if (pos+len > contig.contigLen_)
+    return;
+  if (isFw) {
+    seq.append(contig.seq, pos, len);
+  } else {
+    for (size_t i = pos+len; i > pos; --i) {
+      seq.push_back(rev(contig.seq[i-1]));
+    }
   }
-  return seq;
 }
 
+
 template <typename PufferfishIndexT>
-void RefSeqConstructor<PufferfishIndexT>::cutoff(std::string& seq, size_t len, bool verbose) {
-  (void) verbose;
-    seq = seq.substr(0, seq.length()-len);
+char RefSeqConstructor<PufferfishIndexT>::remBase(util::ContigBlock& contig, size_t len, bool isCurContigFw, bool fromTheEnd, size_t i) {
+  if (isCurContigFw)
+    return fromTheEnd ? contig.seq[contig.contigLen_-len+i] : contig.seq[i];
+  else
+    return fromTheEnd ? rev(contig.seq[len-1-i]) : rev(contig.seq[contig.contigLen_-1-i]);
 }
 
 
-//TODO couldn't make it reference bc of the section seq += rc(str)
-// now eachtime calling this we are copying a string twice which is not good
 template <typename PufferfishIndexT>
-std::string RefSeqConstructor<PufferfishIndexT>::rc(std::string str, bool verbose) {
-  (void) verbose;
-    for (uint32_t i = 0; i < str.length()/2; i++) {
-      char tmp = str[i];
-      str[i] = rev(str[str.length()-1-i]);
-      str[str.length()-1-i] = rev(tmp);
-    }
-    return str;
+bool RefSeqConstructor<PufferfishIndexT>::sameRemSeq(util::ContigBlock& contig1, bool isContig1Fw, bool fromTheEnd1,
+                                                     util::ContigBlock& contig2, bool isContig2Fw, bool fromTheEnd2,
+                                                     size_t len) {
+  if (len > contig1.contigLen_ or len > contig2.contigLen_)
+    return len == 0;
+  for (size_t i = 0; i < len; ++i) {
+    if (remBase(contig1, len, isContig1Fw, fromTheEnd1, i) != remBase(contig2, len, isContig2Fw, fromTheEnd2, i))
+      return false;
+  }
+  return true;
 }
 
 
@@ -315,146 +316,104 @@ char RefSeqConstructor<PufferfishIndexT>::rev(const char& c) {
 }
 
 template <typename PufferfishIndexT>
-std::vector<nextCompatibleStruct> RefSeqConstructor<PufferfishIndexT>::fetchSuccessors(util::ContigBlock& contig,
-                                                                                       bool isCurContigFw,
-                                                                                       size_t tid,
-                                                                                       size_t tpos,
-                                                                                       uint32_t txpDist,
-                                                                                       bool verbose) {
-
-  //if(verbose) std::cerr << std::this_thread::get_id() << " "  << "\t[Fetch successors] \n" ;
-    std::vector<nextCompatibleStruct> successors ;
-    CanonicalKmer::k(k) ;
-
-    auto& edges = pfi_->getEdge() ;
-    util::Direction dir = isCurContigFw?util::Direction::FORWARD:util::Direction::BACKWORD ;
-
-    uint8_t edgeVec = edges[contig.contigIdx_] ;
-    std::vector<util::extension> ext = util::getExts(edgeVec) ;
-
-    if(!ext.empty()){
-      CanonicalKmer kb ;
-      kb.fromStr(contig.seq.substr(0,k)) ;
-      CanonicalKmer ke ;
-      ke.fromStr(contig.seq.substr(contig.contigLen_-k,k)) ;
-      CanonicalKmer kt ;
-
-      for(auto& ed : ext){
-        if(ed.dir == dir){
-          (dir == util::Direction::FORWARD)?ke.shiftFw(ed.c):kb.shiftBw(ed.c) ;
-          (dir == util::Direction::FORWARD)?kt.fromNum(ke.getCanonicalWord()):kt.fromNum(kb.getCanonicalWord()) ;
-
-          auto nextHit = pfi_->getRefPos(kt) ;
-
-          if(contigSeqCache_->find(nextHit.contigIdx_) == contigSeqCache_->end()){
-            std::string contigseq = pfi_->getSeqStr(nextHit.globalPos_,nextHit.contigLen_);
-            (*contigSeqCache_)[nextHit.contigIdx_] = {nextHit.contigIdx_, nextHit.globalPos_, nextHit.contigLen_, contigseq} ;
-          }
+void RefSeqConstructor<PufferfishIndexT>::fetchNext(util::ContigBlock& contig,
+                                                    bool isCurContigFw,
+                                                    size_t tid,
+                                                    size_t tpos,
+                                                    SearchType searchType,
+                                                    bool verbose) {
+
+  // successors of a forward contig (and predecessors of a reverse one) hang
+  // off its last k-mer, the others off its first one
+  util::Direction dir = (isCurContigFw == (searchType == SearchType::SUCCESSOR)) ?
+    util::Direction::FORWARD : util::Direction::BACKWORD;
+  uint64_t cid = contig.contigIdx_;
+  uint8_t edgeVec = pfi_->getEdge()[cid];
+  // bits 0-3 are the forward extensions, 4-7 the backward ones
+  static constexpr char nuclmap[] = {'C','G','T','A','C','G','T','A'};
+  uint32_t firstBit = (dir == util::Direction::FORWARD) ? 0 : 4;
+
+  // the boundary k-mer of the contig is only built if one of its neighbors
+  // has not been resolved before; this happens before anything is inserted
+  // into contigSeqCache_, which may move `contig`
+  CanonicalKmer boundary;
+  bool haveBoundary{false};
+
+  for (uint32_t bit = firstBit; bit < firstBit + 4; ++bit) {
+    if (!(edgeVec & (1 << bit))) { continue; }
+
+    if (pfi_->hasNeighborTable()) {
+      uint64_t nid = pfi_->getNeighbor(cid, bit) >> 1;
+      if(contigSeqCache_->find(nid) == contigSeqCache_->end()){
+        (*contigSeqCache_)[nid] = pfi_->getContigBlock(nid);
+      }
+      pushIfNext(nid, (*contigSeqCache_)[nid].contigLen_, pfi_->refList(nid), tid, tpos, searchType);
+      continue;
+    }
 
-          util::ContigBlock cb = (*contigSeqCache_)[nextHit.contigIdx_] ;
-          nextCompatibleStruct theBest {cb.contigIdx_, tpos, 0, true};
-          bool isBestValid = false;
-          for(auto& posIt: nextHit.refRange){
-            size_t succLastBaseTpos = posIt.pos() + cb.contigLen_ - 1;
-            int overlap = tpos - posIt.pos() + 1;
-            if (posIt.transcript_id() == tid and tpos < succLastBaseTpos and overlap > 0) {
-              //heuristic : TODO make sure it's right
-              // As a successor, if the txp distance is not less than txpDist, then they are not successors in this txp
-              // that 1 base in tpos + txpDist + 1 was kept as an overlap with end contig to have sanity check
-              if (theBest.tpos < succLastBaseTpos) {
-                isBestValid = true;
-                theBest.tpos = succLastBaseTpos; 
-                theBest.isCurContigFw = posIt.orientation();
-                theBest.cpos=theBest.isCurContigFw?(overlap-1):(cb.contigLen_-overlap);
-                if (txpDist < succLastBaseTpos - tpos)
-                  break;
-              }
-            }
-          }
-          if (isBestValid) {
-            theBest.tpos = tpos;
-            successors.push_back(theBest) ;
-          }
+    // no neighbor table in the index, so look the neighboring k-mer up
+    uint64_t key = (cid << 3) | bit;
+    auto hitIt = nextHitCache_.find(key);
+    if (hitIt == nextHitCache_.end()) {
+      if (!haveBoundary) {
+        CanonicalKmer::k(k);
+        if (dir == util::Direction::FORWARD) {
+          boundary.fromStr(contig.seq.data() + contig.contigLen_ - k);
+        } else {
+          boundary.fromStr(contig.seq.data());
         }
+        haveBoundary = true;
       }
+      CanonicalKmer kt = boundary;
+      (dir == util::Direction::FORWARD) ? kt.shiftFw(nuclmap[bit]) : kt.shiftBw(nuclmap[bit]);
+      if (nextHitCache_.size() >= maxCachedNextHits) { nextHitCache_.clear(); }
+      hitIt = nextHitCache_.insert(std::make_pair(key, pfi_->getRefPos(kt))).first;
+    }
+    // copied, as inserting into the caches below may move the entry
+    util::ProjectedHits nextHit = hitIt->second;
+    if (nextHit.empty()) { continue; }
+
+    if(contigSeqCache_->find(nextHit.contigIdx_) == contigSeqCache_->end()){
+      // the k-mer may be the last one of the contig, so go back to its start
+      uint64_t contigStart = nextHit.globalPos_ - nextHit.contigPos_;
+      (*contigSeqCache_)[nextHit.contigIdx_] = {nextHit.contigIdx_, contigStart, nextHit.contigLen_,
+                                                pfi_->getSeqStr(contigStart, nextHit.contigLen_)};
     }
+    pushIfNext(nextHit.contigIdx_, nextHit.contigLen_, nextHit.refRange, tid, tpos, searchType);
+  }
 
-    if (verbose) std::cerr << " RETURNING SUCCESSOR!!\n";
-    return successors;
+  if (verbose) std::cerr << " RETURNING " << (searchType == SearchType::SUCCESSOR ? "SUCCESSORS" : "PREDECESSORS") << "!!\n";
 }
 
-
 template <typename PufferfishIndexT>
-std::vector<nextCompatibleStruct> RefSeqConstructor<PufferfishIndexT>::fetchPredecessors(util::ContigBlock& contig,
-                                                                                       bool isCurContigFw,
-                                                                                       size_t tid,
-                                                                                       size_t tpos,
-                                                                                         uint32_t txpDist,
-                                                                                         bool verbose) {
-
-  //if(verbose) std::cerr << std::this_thread::get_id() << " "  << "\t[Fetch successors] \n" ;
-    std::vector<nextCompatibleStruct> predecessors ;
-    CanonicalKmer::k(k) ;
-
-    // [DEV BUG] TODO : Moving to having only one "edge set" breaks this.  FIX THIS!!
-    // The below line used to be this:
-    //auto& edges = pfi_->getRevEdge() ;
-    auto& edges = pfi_->getEdge() ;
-
-    util::Direction dir = isCurContigFw?util::Direction::BACKWORD:util::Direction::FORWARD ;
-
-    uint8_t edgeVec = edges[contig.contigIdx_] ;
-    std::vector<util::extension> ext = util::getExts(edgeVec) ;
-
-    if(!ext.empty()){
-      CanonicalKmer kb ;
-      kb.fromStr(contig.seq.substr(0,k)) ;
-      CanonicalKmer ke ;
-      ke.fromStr(contig.seq.substr(contig.contigLen_-k,k)) ;
-      CanonicalKmer kt ;
-
-      for(auto& ed : ext){
-        if(ed.dir == dir){
-          (dir == util::Direction::FORWARD)?ke.shiftFw(ed.c):kb.shiftBw(ed.c) ;
-          (dir == util::Direction::FORWARD)?kt.fromNum(ke.getCanonicalWord()):kt.fromNum(kb.getCanonicalWord()) ;
-
-          auto nextHit = pfi_->getRefPos(kt) ;
-
-          if(contigSeqCache_->find(nextHit.contigIdx_) == contigSeqCache_->end()){
-            std::string contigseq = pfi_->getSeqStr(nextHit.globalPos_,nextHit.contigLen_);
-            (*contigSeqCache_)[nextHit.contigIdx_] = {nextHit.contigIdx_, nextHit.globalPos_, nextHit.contigLen_, contigseq} ;
-          }
-
-          util::ContigBlock cb = (*contigSeqCache_)[nextHit.contigIdx_] ;
-          nextCompatibleStruct theBest {cb.contigIdx_, tpos, 0, true};
-          bool isBestValid = false;
-          for(auto& posIt: nextHit.refRange){
-            size_t predLastBaseTpos = posIt.pos() + cb.contigLen_ - 1;
-            int overlap = predLastBaseTpos - tpos + 1;
-            if (posIt.transcript_id() == tid and tpos > predLastBaseTpos and overlap > 0) {
-              //heuristic : TODO make sure it's right
-              // As a successor, if the txp distance is not less than txpDist, then they are not successors in this txp
-              // that 1 base in tpos + txpDist + 1 was kept as an overlap with end contig to have sanity check
-              if (theBest.tpos > predLastBaseTpos) {
-                isBestValid = true;
-                theBest.tpos = predLastBaseTpos; // NOTE: careful
-                theBest.isCurContigFw = posIt.orientation();
-                theBest.cpos=theBest.isCurContigFw?(cb.contigLen_-overlap):(overlap-1);
-                if (txpDist < tpos - predLastBaseTpos)
-                  break;
-              }
-            }
-          }
-          if (isBestValid) {
-            theBest.tpos = tpos;
-            predecessors.push_back(theBest);
-          }
-        }
+template <typename PosRangeT>
+void RefSeqConstructor<PufferfishIndexT>::pushIfNext(uint64_t nid,
+                                                     uint32_t clen,
+                                                     PosRangeT& refs,
+                                                     size_t tid,
+                                                     size_t tpos,
+                                                     SearchType searchType) {
+  // neighboring contigs overlap by exactly k-1 bases, so on tid the
+  // successor has to start k-2 bases before the last base of this contig
+  // (and the predecessor end k-2 bases after its first one); repeats may
+  // put other occurrences of the same contig nearby
+  for (auto posIt : refs) {
+    if (posIt.transcript_id() != tid) { continue; }
+    size_t nextFirstBaseTpos = posIt.pos();
+    size_t nextLastBaseTpos = posIt.pos() + clen - 1;
+    bool isNextFw = posIt.orientation();
+    if (searchType == SearchType::SUCCESSOR) {
+      if (nextFirstBaseTpos + (k-1) == tpos + 1) {
+        children_.emplace_back(nid, tpos, isNextFw ? (k-2) : (clen-k+1), isNextFw);
+        return;
+      }
+    } else {
+      if (nextLastBaseTpos + 1 == tpos + (k-1)) {
+        children_.emplace_back(nid, tpos, isNextFw ? (clen-k+1) : (k-2), isNextFw);
+        return;
       }
     }
-
-    if (verbose) std::cerr << " RETURNING Predecessors!!\n";
-    return predecessors;
+  }
 }
 
 template class RefSeqConstructor<PufferfishIndex>;
@@ -9,9 +9,21 @@
 #endif
 
 int ksw_gg2_sse(void *km, int qlen, const uint8_t *query, int tlen, const uint8_t *target, int8_t m, const int8_t *mat, int8_t q, int8_t e, int w, int *m_cigar_, int *n_cigar_, uint32_t **cigar_)
+{
+	int t, H0;
+	uint8_t *qr;
+	qr = (uint8_t*)kmalloc(km, qlen);
+	for (t = 0; t < qlen; ++t)
+		qr[t] = query[qlen - 1 - t];
+	H0 = ksw_gg2_sse_qr(km, qlen, qr, tlen, target, m, mat, q, e, w, m_cigar_, n_cigar_, cigar_);
+	kfree(km, qr);
+	return H0;
+}
+
+int ksw_gg2_sse_qr(void *km, int qlen, const uint8_t *qr, int tlen, const uint8_t *target, int8_t m, const int8_t *mat, int8_t q, int8_t e, int w, int *m_cigar_, int *n_cigar_, uint32_t **cigar_)
 {
 	int r, t, n_col, n_col_, *off, tlen_, last_st, last_en, H0 = 0, last_H0_t = 0;
-	uint8_t *qr, *mem, *mem2;
+	uint8_t *mem, *mem2;
 	__m128i *u, *v, *x, *y, *s, *p;
 	__m128i q_, qe2_, zero_, flag1_, flag2_, flag8_, flag16_;
 
@@ -32,14 +44,10 @@ int ksw_gg2_sse(void *km, int qlen, const uint8_t *query, int tlen, const uint8_
 	mem = (uint8_t*)kcalloc(km, tlen_ * 5 + 1, 16);
 	u = (__m128i*)(((size_t)mem + 15) >> 4 << 4); // 16-byte aligned
 	v = u + tlen_, x = v + tlen_, y = x + tlen_, s = y + tlen_;
-	qr = (uint8_t*)kcalloc(km, qlen, 1);
 	mem2 = (uint8_t*)kmalloc(km, ((qlen + tlen - 1) * n_col_ + 1) * 16);
 	p = (__m128i*)(((size_t)mem2 + 15) >> 4 << 4);
 	off = (int*)kmalloc(km, (qlen + tlen - 1) * sizeof(int));
 
-	for (t = 0; t < qlen; ++t)
-		qr[t] = query[qlen - 1 - t];
-
 	for (r = 0, last_st = last_en = -1; r < qlen + tlen - 1; ++r) {
 		int st = 0, en = tlen - 1, st0, en0, st_, en_;
 		int8_t x1, v1;
@@ -119,7 +127,7 @@ int ksw_gg2_sse(void *km, int qlen, const uint8_t *query, int tlen, const uint8_
 		last_st = st, last_en = en;
 		//for (t = st0; t <= en0; ++t) printf("(%d,%d)\t(%d,%d,%d,%d)\t%x\n", r, t, ((uint8_t*)u)[t], ((uint8_t*)v)[t], ((uint8_t*)x)[t], ((uint8_t*)y)[t], ((uint8_t*)(p + r * n_col_))[t-st]); // for debugging
 	}
-	kfree(km, mem); kfree(km, qr);
+	kfree(km, mem);
 	ksw_backtrack(km, 1, 0, 0, (uint8_t*)p, off, 0, n_col, tlen-1, qlen-1, m_cigar_, n_cigar_, cigar_);
 	kfree(km, mem2); kfree(km, off);
 	return H0;